@@ -0,0 +1,640 @@
+/*
+ *   Copyright (c) 2007-2008 C3SL.
+ *
+ *   This file is part of Bosh.
+ *
+ *   Bosh is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   any later version.
+ *
+ *   Bosh is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ */
+
+
+/* A BOSH load generator.
+ *
+ * It opens N sessions against a bosh server, keeps a long-poll held on each
+ * one and posts messages at a fixed interval. Every session uses two HTTP
+ * connections, like a browser would. Messages carry their send time in the
+ * id, so when the stub XMPP server echoes them back the end-to-end latency
+ * can be measured. At the end it reports the session creation rate, the
+ * message rates and the latency percentiles. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_EVENTS 1024
+#define INPUT_BUFFER_SIZE (64*1024)
+#define CONNECTIONS_PER_SESSION 2
+
+#define HTTP_REQUEST "POST %s HTTP/1.1\r\n" \
+    "Host: %s\r\n" \
+    "Content-Type: text/xml; charset=utf-8\r\n" \
+    "Content-Length: %d\r\n" \
+    "\r\n" \
+    "%s"
+
+#define CREATE_BODY "<body rid='%" PRIu64 "' to='%s' wait='%d' hold='1' " \
+    "ver='1.6' xmlns='http://jabber.org/protocol/httpbind'/>"
+
+#define POLL_BODY "<body rid='%" PRIu64 "' sid='%s' " \
+    "xmlns='http://jabber.org/protocol/httpbind'/>"
+
+#define MESSAGE_BODY "<body rid='%" PRIu64 "' sid='%s' " \
+    "xmlns='http://jabber.org/protocol/httpbind'>" \
+    "<message to='echo@%s' id='bench-%" PRId64 "' type='chat'>" \
+    "<body>%s</body></message></body>"
+
+struct Session;
+
+typedef struct Connection {
+    int fd;
+    struct Session* session;
+    int busy;                   /* 1 if a request is outstanding          */
+    int64_t request_time;       /* when the request was sent              */
+    char* output;               /* request being written                  */
+    size_t output_size, output_offset;
+    char input[INPUT_BUFFER_SIZE + 1];
+    size_t input_size;
+} Connection;
+
+typedef struct Session {
+    uint64_t rid;
+    char sid[64];               /* empty until the session is created     */
+    int dead;                   /* 1 if the session failed                */
+    int pending_messages;       /* messages waiting for a free connection */
+    int64_t next_send;          /* when the next message is due           */
+    int heap_pos;               /* position in the timer heap             */
+    Connection connections[CONNECTIONS_PER_SESSION];
+} Session;
+
+typedef struct Samples {
+    int64_t* values;
+    size_t size, capacity;
+} Samples;
+
+static struct {
+    const char* host;
+    int port;
+    const char* path;
+    const char* domain;
+    int sessions;
+    int concurrency;            /* session creations in flight            */
+    int wait;
+    int interval;               /* ms between messages of a session       */
+    int size;                   /* size of the message bodies             */
+    int duration;               /* seconds of the steady phase            */
+} config = {"127.0.0.1", 8082, "/", "localhost", 100, 64, 30, 1000, 64, 10};
+
+static struct {
+    uint64_t created, failed, requests, responses, empty;
+    uint64_t sent, received, errors;
+} stats;
+
+static Samples creation_latency, message_latency;
+
+static int epoll_fd;
+static struct sockaddr_in server_addr;
+static Session* sessions;
+static Session** heap;
+static int heap_size;
+static char* padding;
+static int steady = 0;
+static volatile int running = 1;
+
+/*! \brief Returns the current time in nanoseconds */
+static int64_t now_ns() {
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000000ll + tp.tv_nsec;
+}
+
+static void handle_signal(int signal) {
+    running = 0;
+}
+
+static void samples_add(Samples* samples, int64_t value) {
+    if(samples->size == samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        samples->values = realloc(samples->values,
+                samples->capacity * sizeof(int64_t));
+    }
+    samples->values[samples->size++] = value;
+}
+
+static int compare_int64(const void* a, const void* b) {
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/*! \brief Print the percentiles of the samples in milliseconds */
+static void samples_report(const char* name, Samples* samples) {
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    int i;
+
+    if(samples->size == 0) {
+        printf("%-22s no samples\n", name);
+        return;
+    }
+
+    qsort(samples->values, samples->size, sizeof(int64_t), compare_int64);
+
+    printf("%-22s", name);
+    for(i = 0; i < sizeof(quantiles)/sizeof(double); ++i) {
+        printf(" p%g=%.3fms", quantiles[i] * 100,
+                samples->values[(size_t)(quantiles[i] * (samples->size - 1))]
+                / 1e6);
+    }
+    printf(" max=%.3fms\n", samples->values[samples->size - 1] / 1e6);
+}
+
+/* A binary heap of sessions ordered by next_send */
+
+static void heap_swap(int a, int b) {
+    Session* tmp = heap[a];
+    heap[a] = heap[b];
+    heap[b] = tmp;
+    heap[a]->heap_pos = a;
+    heap[b]->heap_pos = b;
+}
+
+static void heap_push(Session* session) {
+    int pos = heap_size++;
+
+    heap[pos] = session;
+    session->heap_pos = pos;
+    while(pos > 0 && heap[(pos-1)/2]->next_send > heap[pos]->next_send) {
+        heap_swap(pos, (pos-1)/2);
+        pos = (pos-1)/2;
+    }
+}
+
+static Session* heap_pop() {
+    Session* top = heap[0];
+    int pos = 0, child;
+
+    heap_swap(0, --heap_size);
+    for(;;) {
+        child = pos*2 + 1;
+        if(child >= heap_size) {
+            break;
+        }
+        if(child + 1 < heap_size &&
+                heap[child+1]->next_send < heap[child]->next_send) {
+            child++;
+        }
+        if(heap[pos]->next_send <= heap[child]->next_send) {
+            break;
+        }
+        heap_swap(pos, child);
+        pos = child;
+    }
+
+    return top;
+}
+
+static void connection_close(Connection* connection) {
+    if(connection->fd != -1) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+        close(connection->fd);
+        connection->fd = -1;
+    }
+    free(connection->output);
+    connection->output = NULL;
+    connection->busy = 0;
+    connection->input_size = 0;
+}
+
+static void session_fail(Session* session) {
+    int i;
+
+    if(!session->dead) {
+        session->dead = 1;
+        stats.errors++;
+        if(session->sid[0] == 0) {
+            stats.failed++;
+        }
+    }
+    for(i = 0; i < CONNECTIONS_PER_SESSION; ++i) {
+        connection_close(&session->connections[i]);
+    }
+}
+
+/*! \brief Write the pending request */
+static int connection_flush(Connection* connection) {
+    struct epoll_event event;
+    ssize_t ret;
+
+    while(connection->output_offset < connection->output_size) {
+        ret = send(connection->fd, connection->output +
+                connection->output_offset, connection->output_size -
+                connection->output_offset, MSG_NOSIGNAL);
+        if(ret > 0) {
+            connection->output_offset += ret;
+        } else if(ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == ENOTCONN)) {
+            break;
+        } else {
+            return 0;
+        }
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    if(connection->output_offset < connection->output_size) {
+        event.events |= EPOLLOUT;
+    }
+    event.data.ptr = connection;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+
+    return 1;
+}
+
+/*! \brief Send a request with the given body */
+static int connection_request(Connection* connection, const char* body) {
+    struct epoll_event event;
+    int opt = 1;
+
+    /* open the connection if needed */
+    if(connection->fd == -1) {
+        connection->fd = socket(AF_INET, SOCK_STREAM, 0);
+        fcntl(connection->fd, F_SETFL,
+                fcntl(connection->fd, F_GETFL, NULL) | O_NONBLOCK);
+        setsockopt(connection->fd, IPPROTO_TCP, TCP_NODELAY, &opt,
+                sizeof(opt));
+        if(connect(connection->fd, (struct sockaddr*)&server_addr,
+                    sizeof(server_addr)) == -1 && errno != EINPROGRESS) {
+            return 0;
+        }
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLOUT;
+        event.data.ptr = connection;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection->fd, &event);
+    }
+
+    free(connection->output);
+    connection->output_size = asprintf(&connection->output, HTTP_REQUEST,
+            config.path, config.host, (int)strlen(body), body);
+    connection->output_offset = 0;
+    connection->busy = 1;
+    connection->request_time = now_ns();
+    stats.requests++;
+
+    return connection_flush(connection);
+}
+
+/*! \brief Keep a request held and send the pending messages */
+static void session_dispatch(Session* session) {
+    Connection* connection;
+    char* body;
+    int i, busy = 0, ok = 1;
+
+    if(session->dead || session->sid[0] == 0) {
+        return;
+    }
+
+    for(i = 0; i < CONNECTIONS_PER_SESSION && ok; ++i) {
+        connection = &session->connections[i];
+        if(connection->busy) {
+            busy++;
+        } else if(session->pending_messages > 0) {
+            asprintf(&body, MESSAGE_BODY, session->rid++, session->sid,
+                    config.domain, now_ns(), padding);
+            ok = connection_request(connection, body);
+            free(body);
+            session->pending_messages--;
+            if(steady) {
+                stats.sent++;
+            }
+            busy++;
+        }
+    }
+
+    /* if nothing is held, send an empty poll */
+    for(i = 0; i < CONNECTIONS_PER_SESSION && ok && busy == 0; ++i) {
+        connection = &session->connections[i];
+        asprintf(&body, POLL_BODY, session->rid++, session->sid);
+        ok = connection_request(connection, body);
+        free(body);
+        busy++;
+    }
+
+    if(!ok) {
+        session_fail(session);
+    }
+}
+
+/*! \brief Start the creation of a session */
+static void session_create(Session* session) {
+    char* body;
+    int i;
+
+    session->rid = 1000000 + lrand48() % 1000000;
+    for(i = 0; i < CONNECTIONS_PER_SESSION; ++i) {
+        session->connections[i].fd = -1;
+        session->connections[i].session = session;
+    }
+
+    asprintf(&body, CREATE_BODY, session->rid++, config.domain, config.wait);
+    if(!connection_request(&session->connections[0], body)) {
+        session_fail(session);
+    }
+    free(body);
+}
+
+/*! \brief Handle a complete response */
+static void session_response(Session* session, Connection* connection,
+        const char* body) {
+    const char* ptr;
+    int64_t now = now_ns(), sent;
+    int n;
+
+    stats.responses++;
+
+    if(strstr(body, "type='terminate'") != NULL ||
+            strstr(body, "type=\"terminate\"") != NULL) {
+        session_fail(session);
+        return;
+    }
+
+    if(session->sid[0] == 0) {
+        /* session creation */
+        ptr = strstr(body, "sid='");
+        if(ptr == NULL || sscanf(ptr + 5, "%63[^']", session->sid) != 1) {
+            session->sid[0] = 0;
+            session_fail(session);
+            return;
+        }
+        stats.created++;
+        samples_add(&creation_latency, now - connection->request_time);
+
+        /* schedule the messages, spreading the sessions over the interval */
+        if(config.interval > 0) {
+            session->next_send = now + (lrand48() % config.interval) * 1000000ll;
+            heap_push(session);
+        }
+        return;
+    }
+
+    /* measure the latency of each message */
+    n = 0;
+    for(ptr = strstr(body, "bench-"); ptr != NULL;
+            ptr = strstr(ptr + 6, "bench-")) {
+        if(sscanf(ptr + 6, "%" SCNd64, &sent) == 1) {
+            samples_add(&message_latency, now - sent);
+            n++;
+        }
+    }
+    if(n == 0) {
+        stats.empty++;
+    } else if(steady) {
+        stats.received += n;
+    }
+}
+
+/*! \brief Read the responses on a connection */
+static void connection_read(Connection* connection) {
+    Session* session = connection->session;
+    const char* header_end;
+    const char* length;
+    size_t header_size, content_size;
+    ssize_t ret;
+
+    for(;;) {
+        ret = recv(connection->fd, connection->input + connection->input_size,
+                INPUT_BUFFER_SIZE - connection->input_size, 0);
+        if(ret > 0) {
+            connection->input_size += ret;
+            connection->input[connection->input_size] = 0;
+        } else if(ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            session_fail(session);
+            return;
+        }
+
+        /* process every complete response in the buffer */
+        while((header_end = strstr(connection->input, "\r\n\r\n")) != NULL) {
+            header_size = header_end + 4 - connection->input;
+            length = strcasestr(connection->input, "Content-Length:");
+            content_size = length != NULL && length < header_end ?
+                strtoul(length + 15, NULL, 10) : 0;
+            if(connection->input_size < header_size + content_size) {
+                break;
+            }
+            if(strncmp(connection->input + 9, "200", 3) != 0) {
+                session_fail(session);
+                return;
+            }
+
+            connection->busy = 0;
+            connection->input[header_size + content_size] = 0;
+            session_response(session, connection,
+                    connection->input + header_size);
+            if(session->dead) {
+                return;
+            }
+
+            memmove(connection->input, connection->input + header_size +
+                    content_size, connection->input_size - header_size -
+                    content_size + 1);
+            connection->input_size -= header_size + content_size;
+        }
+
+        if(connection->input_size == INPUT_BUFFER_SIZE) {
+            session_fail(session);
+            return;
+        }
+    }
+
+    session_dispatch(session);
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [options]\n"
+            "  -h  bosh host (default 127.0.0.1)\n"
+            "  -p  bosh port (default 8082)\n"
+            "  -u  http path (default /)\n"
+            "  -t  xmpp domain (default localhost)\n"
+            "  -n  number of sessions (default 100)\n"
+            "  -c  session creations in flight (default 64)\n"
+            "  -w  wait attribute in seconds (default 30)\n"
+            "  -i  interval between messages of a session in ms, 0 to only"
+            " poll (default 1000)\n"
+            "  -s  size of the message bodies (default 64)\n"
+            "  -d  duration of the steady phase in seconds (default 10)\n",
+            name);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    struct epoll_event events[MAX_EVENTS];
+    Connection* connection;
+    Session* session;
+    int64_t start, created_time = 0, end = 0, now;
+    int opt, n, i, timeout, next_session = 0, in_flight;
+
+    while((opt = getopt(argc, argv, "h:p:u:t:n:c:w:i:s:d:")) != -1) {
+        switch(opt) {
+            case 'h': config.host = optarg; break;
+            case 'p': config.port = atoi(optarg); break;
+            case 'u': config.path = optarg; break;
+            case 't': config.domain = optarg; break;
+            case 'n': config.sessions = atoi(optarg); break;
+            case 'c': config.concurrency = atoi(optarg); break;
+            case 'w': config.wait = atoi(optarg); break;
+            case 'i': config.interval = atoi(optarg); break;
+            case 's': config.size = atoi(optarg); break;
+            case 'd': config.duration = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(config.port);
+    if(inet_pton(AF_INET, config.host, &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address %s\n", config.host);
+        return 1;
+    }
+
+    padding = malloc(config.size + 1);
+    memset(padding, 'x', config.size);
+    padding[config.size] = 0;
+
+    sessions = calloc(config.sessions, sizeof(Session));
+    heap = calloc(config.sessions, sizeof(Session*));
+    epoll_fd = epoll_create(MAX_EVENTS);
+    srand48(now_ns());
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    start = now_ns();
+
+    while(running) {
+        now = now_ns();
+
+        /* start new sessions keeping at most concurrency in flight */
+        in_flight = next_session - stats.created - stats.failed;
+        while(next_session < config.sessions &&
+                in_flight < config.concurrency) {
+            session_create(&sessions[next_session++]);
+            in_flight++;
+        }
+
+        /* all sessions are up, start the steady phase */
+        if(!steady && stats.created + stats.failed == config.sessions) {
+            steady = 1;
+            created_time = now;
+            end = now + config.duration * 1000000000ll;
+            fprintf(stderr, "%" PRIu64 " sessions created, running for %ds\n",
+                    stats.created, config.duration);
+        }
+        if(steady && now >= end) {
+            break;
+        }
+
+        /* send the messages that are due */
+        while(heap_size > 0 && heap[0]->next_send <= now) {
+            session = heap_pop();
+            if(session->dead) {
+                continue;
+            }
+            session->pending_messages++;
+            session->next_send += config.interval * 1000000ll;
+            heap_push(session);
+            session_dispatch(session);
+        }
+
+        /* wait for the next timer */
+        timeout = 100;
+        if(heap_size > 0) {
+            timeout = heap[0]->next_send > now ?
+                (heap[0]->next_send - now + 999999) / 1000000 : 0;
+            if(timeout > 100) {
+                timeout = 100;
+            }
+        }
+
+        n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        for(i = 0; i < n; ++i) {
+            connection = events[i].data.ptr;
+            if(connection->fd == -1) {
+                continue;
+            }
+            if(events[i].events & (EPOLLERR | EPOLLHUP)) {
+                session_fail(connection->session);
+                continue;
+            }
+            if(events[i].events & EPOLLOUT) {
+                if(!connection_flush(connection)) {
+                    session_fail(connection->session);
+                    continue;
+                }
+            }
+            if(events[i].events & EPOLLIN) {
+                connection_read(connection);
+            }
+        }
+    }
+
+    now = now_ns();
+    if(!steady) {
+        created_time = now;
+    }
+
+    printf("sessions created      %" PRIu64 " (%" PRIu64 " failed) in %.3fs,"
+            " %.1f sessions/s\n", stats.created, stats.failed,
+            (created_time - start) / 1e9,
+            stats.created / ((created_time - start) / 1e9));
+    printf("requests              %" PRIu64 " sent, %" PRIu64 " answered, %"
+            PRIu64 " empty\n", stats.requests, stats.responses, stats.empty);
+    if(steady && now > created_time) {
+        printf("messages              %" PRIu64 " sent (%.1f/s), %" PRIu64
+                " received (%.1f/s) in %.3fs\n", stats.sent,
+                stats.sent / ((now - created_time) / 1e9), stats.received,
+                stats.received / ((now - created_time) / 1e9),
+                (now - created_time) / 1e9);
+    }
+    printf("errors                %" PRIu64 "\n", stats.errors);
+    samples_report("session creation", &creation_latency);
+    samples_report("message latency", &message_latency);
+
+    for(i = 0; i < config.sessions; ++i) {
+        for(n = 0; n < CONNECTIONS_PER_SESSION; ++n) {
+            if(sessions[i].connections[n].session != NULL) {
+                connection_close(&sessions[i].connections[n]);
+            }
+        }
+    }
+    free(sessions);
+    free(heap);
+    free(padding);
+    free(creation_latency.values);
+    free(message_latency.values);
+    close(epoll_fd);
+
+    return 0;
+}
@@ -0,0 +1,364 @@
+/*
+ *   Copyright (c) 2007-2008 C3SL.
+ *
+ *   This file is part of Bosh.
+ *
+ *   Bosh is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   any later version.
+ *
+ *   Bosh is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ */
+
+
+/* Microbenchmarks of the containers, the allocators and the parsers.
+ *
+ * Every benchmark reports the time per operation and, when the kernel lets
+ * us open a hardware counter, the cache misses per operation. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+#include "hash.h"
+#include "list.h"
+#include "allocator.h"
+#include "http.h"
+
+#ifdef HAVE_IKSEMEL
+#include <iksemel.h>
+#endif
+
+#define HTTP_ITERATIONS 200000
+#define ALLOCATOR_OBJECTS 100000
+#define ALLOCATOR_ROUNDS 20
+
+/* the same hash used for the sids in jabber_bind.c */
+static inline int compare_key(uint64_t s1, uint64_t s2) {
+    return s1 == s2;
+}
+
+static inline unsigned int hash_key(uint64_t s) {
+    return s % 4294967291u;
+}
+
+typedef uint64_t uint64;
+DECLARE_HASH(uint64, hash_key, compare_key);
+IMPLEMENT_HASH(uint64);
+
+typedef struct Object64 {
+    char data[64];
+} Object64;
+
+typedef struct Object1k {
+    char data[1024];
+} Object1k;
+
+DECLARE_ALLOCATOR(Object64);
+IMPLEMENT_ALLOCATOR(Object64);
+
+DECLARE_ALLOCATOR(Object1k);
+IMPLEMENT_ALLOCATOR(Object1k);
+
+static const char HTTP_REQUEST[] =
+    "POST /http-bind/ HTTP/1.1\r\n"
+    "Host: chat.example.org\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 "
+        "Firefox/115.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Content-Type: text/xml; charset=UTF-8\r\n"
+    "Origin: https://chat.example.org\r\n"
+    "Referer: https://chat.example.org/room/lobby\r\n"
+    "X-Forwarded-For: 203.0.113.7\r\n"
+    "X-Forwarded-Host: chat.example.org\r\n"
+    "X-Forwarded-Server: chat.example.org\r\n"
+    "Connection: Keep-Alive\r\n"
+    "Content-Length: 219\r\n"
+    "\r\n";
+
+#ifdef HAVE_IKSEMEL
+static const char BOSH_BODY[] =
+    "<body rid='1573741820' sid='8163946285193755' "
+    "xmlns='http://jabber.org/protocol/httpbind'>"
+    "<message to='lobby@conference.example.org' type='groupchat' "
+    "id='ab12c'><body>Hello everybody, how is it going?</body></message>"
+    "</body>";
+#endif
+
+static int perf_fd = -1;
+static volatile uintptr_t sink;
+
+/*! \brief Returns the current time in nanoseconds */
+static int64_t now_ns() {
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000000ll + tp.tv_nsec;
+}
+
+/*! \brief Open the cache misses counter, if available */
+static void perf_open() {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    perf_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if(perf_fd == -1) {
+        fprintf(stderr, "Cache miss counter not available\n");
+    }
+}
+
+typedef struct Measure {
+    int64_t start;
+} Measure;
+
+static void measure_start(Measure* measure) {
+    if(perf_fd != -1) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    measure->start = now_ns();
+}
+
+/*! \brief Stop the measure and print the result */
+static void measure_stop(Measure* measure, const char* name, size_t ops) {
+    int64_t elapsed = now_ns() - measure->start;
+    uint64_t misses = 0;
+
+    if(perf_fd != -1) {
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if(read(perf_fd, &misses, sizeof(misses)) != sizeof(misses)) {
+            misses = 0;
+        }
+        printf("%-36s %10.1f ns/op %10.3f misses/op\n", name,
+                (double)elapsed / ops, (double)misses / ops);
+    } else {
+        printf("%-36s %10.1f ns/op\n", name, (double)elapsed / ops);
+    }
+}
+
+/*! \brief Returns a random 64 bits key */
+static uint64_t random_key() {
+    return lrand48() | (((uint64_t)lrand48())<<32);
+}
+
+static void bench_hash(size_t n) {
+    uint64_hash* h;
+    uint64_t* keys;
+    Measure measure;
+    char name[64];
+    size_t i;
+
+    keys = malloc(n * sizeof(uint64_t));
+    for(i = 0; i < n; ++i) {
+        keys[i] = random_key();
+    }
+
+    h = uint64_hash_new();
+
+    /* insert into an empty table, this includes all the resizes */
+    snprintf(name, sizeof(name), "hash insert n=%zu", n);
+    measure_start(&measure);
+    for(i = 0; i < n; ++i) {
+        uint64_hash_insert(h, keys[i], keys + i);
+    }
+    measure_stop(&measure, name, n);
+
+    snprintf(name, sizeof(name), "hash find hit n=%zu", n);
+    measure_start(&measure);
+    for(i = 0; i < n; ++i) {
+        sink += (uintptr_t)uint64_hash_find(h, keys[i]);
+    }
+    measure_stop(&measure, name, n);
+
+    snprintf(name, sizeof(name), "hash find miss n=%zu", n);
+    measure_start(&measure);
+    for(i = 0; i < n; ++i) {
+        sink += (uintptr_t)uint64_hash_find(h, keys[i] + 1);
+    }
+    measure_stop(&measure, name, n);
+
+    snprintf(name, sizeof(name), "hash erase n=%zu", n);
+    measure_start(&measure);
+    for(i = 0; i < n; ++i) {
+        sink += (uintptr_t)uint64_hash_erase(h, keys[i]);
+    }
+    measure_stop(&measure, name, n);
+
+    uint64_hash_delete(h);
+    free(keys);
+}
+
+static void bench_list(size_t n) {
+    list* l;
+    list_iterator* its;
+    Measure measure;
+    char name[64];
+    size_t i, j;
+
+    l = list_new();
+    its = malloc(n * sizeof(list_iterator));
+
+    snprintf(name, sizeof(name), "list push_back n=%zu", n);
+    measure_start(&measure);
+    for(i = 0; i < n; ++i) {
+        its[i] = list_push_back(l, its + i);
+    }
+    measure_stop(&measure, name, n);
+
+    snprintf(name, sizeof(name), "list pop_front n=%zu", n);
+    measure_start(&measure);
+    for(i = 0; i < n; ++i) {
+        sink += (uintptr_t)list_pop_front(l);
+    }
+    measure_stop(&measure, name, n);
+
+    /* erase in random order, like sessions closing */
+    for(i = 0; i < n; ++i) {
+        its[i] = list_push_back(l, its + i);
+    }
+    for(i = n - 1; i > 0; --i) {
+        list_iterator tmp = its[i];
+        j = lrand48() % (i + 1);
+        its[i] = its[j];
+        its[j] = tmp;
+    }
+    snprintf(name, sizeof(name), "list erase random n=%zu", n);
+    measure_start(&measure);
+    for(i = 0; i < n; ++i) {
+        sink += (uintptr_t)list_erase(its[i]);
+    }
+    measure_stop(&measure, name, n);
+
+    list_delete(l, NULL);
+    free(its);
+}
+
+/* The allocator benchmarks allocate a batch of objects and free them, for
+ * several rounds, so the allocator free lists are warm after the first. */
+#define BENCH_ALLOCATOR(type, alloc, release, label)                           \
+    do {                                                                       \
+        type** objs = malloc(ALLOCATOR_OBJECTS * sizeof(type*));               \
+        Measure measure;                                                       \
+        int i, round;                                                          \
+                                                                               \
+        measure_start(&measure);                                               \
+        for(round = 0; round < ALLOCATOR_ROUNDS; ++round) {                    \
+            for(i = 0; i < ALLOCATOR_OBJECTS; ++i) {                           \
+                objs[i] = alloc;                                               \
+                objs[i]->data[0] = i;                                          \
+            }                                                                  \
+            for(i = 0; i < ALLOCATOR_OBJECTS; ++i) {                           \
+                release(objs[i]);                                              \
+            }                                                                  \
+        }                                                                      \
+        measure_stop(&measure, label,                                          \
+                2 * ALLOCATOR_OBJECTS * ALLOCATOR_ROUNDS);                     \
+        free(objs);                                                            \
+    } while(0)
+
+static void bench_allocator() {
+    BENCH_ALLOCATOR(Object64, Object64_alloc(), Object64_free,
+            "allocator alloc+free 64B");
+    BENCH_ALLOCATOR(Object64, malloc(sizeof(Object64)), free,
+            "malloc alloc+free 64B");
+    BENCH_ALLOCATOR(Object1k, Object1k_alloc(), Object1k_free,
+            "allocator alloc+free 1KB");
+    BENCH_ALLOCATOR(Object1k, malloc(sizeof(Object1k)), free,
+            "malloc alloc+free 1KB");
+}
+
+static void bench_http() {
+    HttpHeader* header;
+    Measure measure;
+    int i;
+
+    measure_start(&measure);
+    for(i = 0; i < HTTP_ITERATIONS; ++i) {
+        header = http_parse(HTTP_REQUEST);
+        sink += (uintptr_t)http_get_field(header, "Content-Length");
+        http_delete(header);
+    }
+    measure_stop(&measure, "http_parse proxy request", HTTP_ITERATIONS);
+}
+
+#ifdef HAVE_IKSEMEL
+static void bench_iks() {
+    Measure measure;
+    iks* body;
+    iks* stanza;
+    char* str;
+    int i;
+
+    measure_start(&measure);
+    for(i = 0; i < HTTP_ITERATIONS; ++i) {
+        body = iks_tree(BOSH_BODY, sizeof(BOSH_BODY) - 1, NULL);
+        sink += (uintptr_t)iks_find_attrib(body, "sid");
+        iks_delete(body);
+    }
+    measure_stop(&measure, "iks_tree bosh body", HTTP_ITERATIONS);
+
+    body = iks_tree(BOSH_BODY, sizeof(BOSH_BODY) - 1, NULL);
+    stanza = iks_first_tag(body);
+    measure_start(&measure);
+    for(i = 0; i < HTTP_ITERATIONS; ++i) {
+        str = iks_string(NULL, stanza);
+        sink += (uintptr_t)str;
+        iks_free(str);
+    }
+    measure_stop(&measure, "iks_string stanza", HTTP_ITERATIONS);
+    iks_delete(body);
+}
+#endif
+
+int main(int argc, char** argv) {
+    size_t n;
+
+    srand48(42);
+    perf_open();
+
+    for(n = 1000; n <= 1000000; n *= 10) {
+        bench_hash(n);
+    }
+
+    for(n = 1000; n <= 1000000; n *= 10) {
+        bench_list(n);
+    }
+
+    bench_allocator();
+
+    bench_http();
+
+#ifdef HAVE_IKSEMEL
+    bench_iks();
+#else
+    printf("iksemel not available, skipping iks_tree and iks_string\n");
+#endif
+
+    if(perf_fd != -1) {
+        close(perf_fd);
+    }
+
+    return 0;
+}
@@ -0,0 +1,408 @@
+/*
+ *   Copyright (c) 2007-2008 C3SL.
+ *
+ *   This file is part of Bosh.
+ *
+ *   Bosh is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   any later version.
+ *
+ *   Bosh is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ */
+
+
+/* A stub XMPP server for benchmarks.
+ *
+ * It accepts client streams, answers the stream header and then echoes every
+ * stanza it receives. It can also generate messages to every stream at a
+ * fixed rate. Generated messages carry the send time in their id, so the load
+ * generator can measure the delivery latency. There is no authentication,
+ * bosh doesn't need it. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_EVENTS 1024
+#define INPUT_BUFFER_SIZE (64*1024)
+
+#define STREAM_HEADER "<?xml version='1.0'?>" \
+    "<stream:stream xmlns='jabber:client' " \
+    "xmlns:stream='http://etherx.jabber.org/streams' id='%d' from='%s'>"
+
+#define GENERATED_MESSAGE "<message from='stub@%s' to='bench@%s' " \
+    "id='bench-%" PRId64 "' type='chat'><body>%s</body></message>"
+
+typedef struct Stream {
+    int fd;
+    char input[INPUT_BUFFER_SIZE];
+    size_t input_size;      /* bytes in the input buffer                  */
+    size_t scan;            /* position where the tag scanning stopped    */
+    size_t stanza_start;    /* beginning of the stanza being received     */
+    int depth;              /* xml depth, 1 means inside the stream       */
+    char* output;           /* data waiting to be written                 */
+    size_t output_size, output_offset, output_capacity;
+    struct Stream* next;    /* list of streams                            */
+    struct Stream* prev;
+} Stream;
+
+static struct {
+    int port;
+    int echo;
+    double rate;            /* generated messages per second per stream  */
+    int size;               /* size of the generated message body        */
+    const char* domain;
+} config = {5222, 1, 0, 64, "localhost"};
+
+static struct {
+    uint64_t streams, stanzas_in, stanzas_out, bytes_in, bytes_out;
+} stats;
+
+static int epoll_fd;
+static Stream streams = {.next = &streams, .prev = &streams};
+static char* padding = NULL;
+static volatile int running = 1;
+
+/*! \brief Returns the current time in nanoseconds */
+static int64_t now_ns() {
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000000ll + tp.tv_nsec;
+}
+
+static void handle_signal(int signal) {
+    running = 0;
+}
+
+static void set_nonblock(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, NULL) | O_NONBLOCK);
+}
+
+/*! \brief Close a stream and free it */
+static void stream_close(Stream* stream) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, stream->fd, NULL);
+    close(stream->fd);
+    stream->prev->next = stream->next;
+    stream->next->prev = stream->prev;
+    free(stream->output);
+    free(stream);
+}
+
+/*! \brief Write pending output, returns 0 if the stream was closed */
+static int stream_flush(Stream* stream) {
+    struct epoll_event event;
+    ssize_t ret;
+
+    while(stream->output_offset < stream->output_size) {
+        ret = send(stream->fd, stream->output + stream->output_offset,
+                stream->output_size - stream->output_offset, MSG_NOSIGNAL);
+        if(ret > 0) {
+            stream->output_offset += ret;
+            stats.bytes_out += ret;
+        } else if(ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            stream_close(stream);
+            return 0;
+        }
+    }
+
+    if(stream->output_offset == stream->output_size) {
+        stream->output_offset = stream->output_size = 0;
+    }
+
+    /* only wait for EPOLLOUT if something is left */
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | (stream->output_size > 0 ? EPOLLOUT : 0);
+    event.data.ptr = stream;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, stream->fd, &event);
+
+    return 1;
+}
+
+/*! \brief Queue data to be written */
+static void stream_write(Stream* stream, const char* data, size_t len) {
+    if(stream->output_size + len > stream->output_capacity) {
+        stream->output_capacity = (stream->output_size + len) * 2;
+        stream->output = realloc(stream->output, stream->output_capacity);
+    }
+    memcpy(stream->output + stream->output_size, data, len);
+    stream->output_size += len;
+}
+
+/*! \brief Scan the complete tags in the input buffer
+ *
+ * Returns 0 if the client closed the stream */
+static int stream_scan(Stream* stream) {
+    char header[512];
+    char* begin;
+    char* end;
+    size_t keep;
+    int n;
+
+    for(;;) {
+        begin = memchr(stream->input + stream->scan, '<',
+                stream->input_size - stream->scan);
+        if(begin == NULL) {
+            stream->scan = stream->input_size;
+            break;
+        }
+        end = memchr(begin, '>', stream->input + stream->input_size - begin);
+        if(end == NULL) {
+            stream->scan = begin - stream->input;
+            break;
+        }
+        stream->scan = end + 1 - stream->input;
+
+        if(begin[1] == '?' || begin[1] == '!') {
+            /* xml declaration or comment */
+        } else if(begin[1] == '/') {
+            /* closing tag */
+            stream->depth--;
+            if(stream->depth == 0) {
+                return 0;
+            } else if(stream->depth == 1) {
+                stats.stanzas_in++;
+                if(config.echo) {
+                    stream_write(stream, stream->input + stream->stanza_start,
+                            stream->scan - stream->stanza_start);
+                    stats.stanzas_out++;
+                }
+            }
+        } else if(stream->depth == 0) {
+            /* stream header, answer it */
+            stream->depth = 1;
+            n = snprintf(header, sizeof(header), STREAM_HEADER, stream->fd,
+                    config.domain);
+            stream_write(stream, header, n);
+        } else {
+            /* opening tag */
+            if(stream->depth == 1) {
+                stream->stanza_start = begin - stream->input;
+            }
+            if(end[-1] != '/') {
+                stream->depth++;
+            } else if(stream->depth == 1) {
+                /* a stanza without children */
+                stats.stanzas_in++;
+                if(config.echo) {
+                    stream_write(stream, begin, end + 1 - begin);
+                    stats.stanzas_out++;
+                }
+            }
+        }
+    }
+
+    /* drop what was already scanned, keeping the stanza being received */
+    keep = stream->depth > 1 ? stream->stanza_start : stream->scan;
+    memmove(stream->input, stream->input + keep, stream->input_size - keep);
+    stream->input_size -= keep;
+    stream->scan -= keep;
+    if(stream->depth > 1) {
+        stream->stanza_start = 0;
+    }
+
+    return 1;
+}
+
+/*! \brief Read data from a stream */
+static void stream_read(Stream* stream) {
+    ssize_t ret;
+
+    for(;;) {
+        if(stream->input_size == INPUT_BUFFER_SIZE) {
+            fprintf(stderr, "Stanza too big, closing stream\n");
+            stream_close(stream);
+            return;
+        }
+        ret = recv(stream->fd, stream->input + stream->input_size,
+                INPUT_BUFFER_SIZE - stream->input_size, 0);
+        if(ret > 0) {
+            stats.bytes_in += ret;
+            stream->input_size += ret;
+            if(stream_scan(stream) == 0) {
+                stream_flush(stream);
+                stream_close(stream);
+                return;
+            }
+        } else if(ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            stream_close(stream);
+            return;
+        }
+    }
+
+    stream_flush(stream);
+}
+
+/*! \brief Accept incoming streams */
+static void stream_accept(int listen_fd) {
+    struct epoll_event event;
+    Stream* stream;
+    int fd, opt = 1;
+
+    while((fd = accept(listen_fd, NULL, NULL)) != -1) {
+        set_nonblock(fd);
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+        stream = calloc(1, sizeof(Stream));
+        stream->fd = fd;
+        stream->next = &streams;
+        stream->prev = streams.prev;
+        stream->next->prev = stream;
+        stream->prev->next = stream;
+        stats.streams++;
+
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = stream;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+}
+
+/*! \brief Send a generated message to every open stream */
+static void generate_messages() {
+    Stream* stream;
+    Stream* next;
+    char* msg;
+    int n;
+
+    for(stream = streams.next; stream != &streams; stream = next) {
+        next = stream->next;
+        if(stream->depth == 0) {
+            continue;
+        }
+        n = asprintf(&msg, GENERATED_MESSAGE, config.domain, config.domain,
+                now_ns(), padding);
+        stream_write(stream, msg, n);
+        free(msg);
+        stats.stanzas_out++;
+        stream_flush(stream);
+    }
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-p port] [-d domain] [-r rate] [-s size]"
+            " [-n]\n"
+            "  -p  port to listen (default 5222)\n"
+            "  -d  domain of the server (default localhost)\n"
+            "  -r  generated messages per second per stream (default 0)\n"
+            "  -s  size of the generated message bodies (default 64)\n"
+            "  -n  don't echo the received stanzas\n", name);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event event;
+    struct sockaddr_in addr;
+    int64_t next_generation = 0, period = 0, now;
+    int listen_fd, opt, n, i, timeout;
+
+    while((opt = getopt(argc, argv, "p:d:r:s:n")) != -1) {
+        switch(opt) {
+            case 'p': config.port = atoi(optarg); break;
+            case 'd': config.domain = optarg; break;
+            case 'r': config.rate = atof(optarg); break;
+            case 's': config.size = atoi(optarg); break;
+            case 'n': config.echo = 0; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    padding = malloc(config.size + 1);
+    memset(padding, 'x', config.size);
+    padding[config.size] = 0;
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    /* listen on the loopback interface */
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    opt = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+            listen(listen_fd, 1024) == -1) {
+        fprintf(stderr, "Unable to listen on port %d: %s\n", config.port,
+                strerror(errno));
+        return 1;
+    }
+    set_nonblock(listen_fd);
+
+    epoll_fd = epoll_create(MAX_EVENTS);
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+
+    if(config.rate > 0) {
+        period = 1e9 / config.rate;
+        next_generation = now_ns() + period;
+    }
+
+    fprintf(stderr, "Stub XMPP server listening on port %d\n", config.port);
+
+    while(running) {
+        /* wait until the next generation round */
+        timeout = -1;
+        if(period > 0) {
+            now = now_ns();
+            timeout = next_generation > now ?
+                (next_generation - now + 999999) / 1000000 : 0;
+        }
+
+        n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        for(i = 0; i < n; ++i) {
+            if(events[i].data.ptr == NULL) {
+                stream_accept(listen_fd);
+            } else if(events[i].events & EPOLLIN) {
+                stream_read(events[i].data.ptr);
+            } else if(events[i].events & EPOLLOUT) {
+                stream_flush(events[i].data.ptr);
+            } else {
+                stream_close(events[i].data.ptr);
+            }
+        }
+
+        if(period > 0 && now_ns() >= next_generation) {
+            generate_messages();
+            next_generation += period;
+        }
+    }
+
+    fprintf(stderr, "streams=%" PRIu64 " stanzas_in=%" PRIu64
+            " stanzas_out=%" PRIu64 " bytes_in=%" PRIu64
+            " bytes_out=%" PRIu64 "\n", stats.streams, stats.stanzas_in,
+            stats.stanzas_out, stats.bytes_in, stats.bytes_out);
+
+    while(streams.next != &streams) {
+        stream_close(streams.next);
+    }
+    close(listen_fd);
+    close(epoll_fd);
+    free(padding);
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ *   Copyright (c) 2007-2008 C3SL.
+ *
+ *   This file is part of Bosh.
+ *
+ *   Bosh is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   any later version.
+ *
+ *   Bosh is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "allocator.h"
+
+/* the huge page size of x86_64 and most arm64 kernels */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+AllocatorStats* allocator_stats = NULL;
+
+/* how allocator_map backs the reserved objects */
+static AllocatorPages map_pages = ALLOCATOR_PAGES_NORMAL;
+static int map_lock = 0;
+
+/* bytes mapped on each kind of pages, and the ones mlock refused */
+static size_t reserved[ALLOCATOR_PAGES_EXPLICIT + 1];
+static size_t unlocked = 0;
+
+/*! \brief Add the counters of an allocator to the list */
+void allocator_register(AllocatorStats* stats) {
+    stats->next = allocator_stats;
+    allocator_stats = stats;
+}
+
+/*! \brief Choose the pages of the next reservations, and if they are locked
+ * in memory */
+void allocator_set_pages(AllocatorPages pages, int lock) {
+    map_pages = pages;
+    map_lock = lock;
+}
+
+/*! \brief Map memory for the objects reserved at startup
+ *
+ * The pages are faulted in now, so the first sessions don't pay for it.
+ * Explicit huge pages fall back to transparent ones when the kernel has not
+ * enough of them set aside. The memory is never unmapped, like the rest of
+ * the free lists. Returns NULL on failure. */
+void* allocator_map(size_t size) {
+    AllocatorPages pages = map_pages;
+    char* region = MAP_FAILED;
+    char* start;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t i, slack;
+
+    /* the region is unmapped in part below, which works on whole pages */
+    size = (size + page - 1) & ~(page - 1);
+
+    if(pages == ALLOCATOR_PAGES_EXPLICIT) {
+        size = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+        region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        if(region == MAP_FAILED) {
+            pages = ALLOCATOR_PAGES_TRANSPARENT;
+        }
+    }
+
+    if(region == MAP_FAILED && pages == ALLOCATOR_PAGES_TRANSPARENT) {
+        /* align on a huge page, so no part of it falls on small pages */
+        region = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(region == MAP_FAILED) {
+            return NULL;
+        }
+        start = (char*)(((uintptr_t)region + HUGE_PAGE_SIZE - 1) &
+                ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+        slack = start - region;
+        if(slack > 0) {
+            munmap(region, slack);
+        }
+        munmap(start + size, HUGE_PAGE_SIZE - slack);
+        region = start;
+
+        if(madvise(region, size, MADV_HUGEPAGE) != 0) {
+            pages = ALLOCATOR_PAGES_NORMAL;
+        }
+    } else if(region == MAP_FAILED) {
+        region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(region == MAP_FAILED) {
+            return NULL;
+        }
+    }
+
+    /* the huge pages of MAP_HUGETLB are already populated */
+    if(pages != ALLOCATOR_PAGES_EXPLICIT) {
+        for(i = 0; i < size; i += page) {
+            ((volatile char*)region)[i] = 0;
+        }
+    }
+
+    if(map_lock && mlock(region, size) != 0) {
+        unlocked += size;
+    }
+    reserved[pages] += size;
+
+    return region;
+}
+
+/*! \brief Returns the bytes reserved on the given kind of pages */
+size_t allocator_reserved(AllocatorPages pages) {
+    return reserved[pages];
+}
+
+/*! \brief Returns the reserved bytes that could not be locked in memory */
+size_t allocator_unlocked() {
+    return unlocked;
+}
@@ -21,6 +21,46 @@
 
 #include <stdlib.h>
 
+/*! \brief What a type of object takes from malloc
+ *
+ * Each allocator registers its counters at startup, the memory page walks
+ * them. The objects are counted, the bytes are the counts times the size. */
+typedef struct AllocatorStats {
+    const char* name;
+    size_t object_size;
+    size_t live;                /* objects handed out               */
+    size_t free;                /* objects kept for the next alloc  */
+    size_t overhead;            /* bytes of the free list nodes     */
+    struct AllocatorStats* next;
+} AllocatorStats;
+
+/*! \brief The registered allocators */
+extern AllocatorStats* allocator_stats;
+
+void allocator_register(AllocatorStats* stats);
+
+/*! \brief The pages behind the reserved objects */
+typedef enum AllocatorPages {
+    ALLOCATOR_PAGES_NORMAL,
+    ALLOCATOR_PAGES_TRANSPARENT,    /* madvise(MADV_HUGEPAGE)             */
+    ALLOCATOR_PAGES_EXPLICIT        /* MAP_HUGETLB, from nr_hugepages     */
+} AllocatorPages;
+
+void allocator_set_pages(AllocatorPages pages, int lock);
+
+void* allocator_map(size_t size);
+
+size_t allocator_reserved(AllocatorPages pages);
+
+size_t allocator_unlocked();
+
+/* Define the counters of a type and register them before main */
+#define IMPLEMENT_ALLOCATOR_STATS(var, type_name, size)                        \
+    AllocatorStats var = {type_name, size, 0, 0, 0, NULL};                     \
+    static void __attribute__((constructor)) var##_register() {                \
+        allocator_register(&var);                                              \
+    }
+
 /* This is an implementation of a specialized allocator,
  * this is more efficient for frequently allocated objects.
  * Unused objects are stored on a buffer, and when an alloc
@@ -36,6 +76,7 @@
 #define ALLOCATOR_BLOCK_SIZE 4096
 
 #define IMPLEMENT_ALLOCATOR(type)                                              \
+    IMPLEMENT_ALLOCATOR_STATS(_##type##_allocator_stats, #type, sizeof(type))  \
     _##type##_allocator_node* _##type##_allocator_buffer = NULL;
 
 #define DECLARE_ALLOCATOR(type)                                                \
@@ -49,17 +90,24 @@ typedef struct _##type##_allocator_node {                                      \
     type* objs[ALLOCATOR_BLOCK_SIZE];                                          \
 } _##type##_allocator_node;                                                    \
 extern _##type##_allocator_node* _##type##_allocator_buffer;                   \
-static inline type* type##_alloc() {                                           \
-    int i;                                                                     \
-                                                                               \
+extern AllocatorStats _##type##_allocator_stats;                               \
+static inline void _##type##_allocator_init() {                                \
     /* check if the buffer has not been initialized yet */                     \
     if(_##type##_allocator_buffer == NULL) {                                   \
         _##type##_allocator_buffer =                                           \
             malloc(sizeof(_##type##_allocator_node));                          \
+        _##type##_allocator_stats.overhead +=                                  \
+            sizeof(_##type##_allocator_node);                                  \
         _##type##_allocator_buffer->next = _##type##_allocator_buffer;         \
         _##type##_allocator_buffer->prev = _##type##_allocator_buffer;         \
         _##type##_allocator_buffer->size = 0;                                  \
     }                                                                          \
+}                                                                              \
+                                                                               \
+static inline type* type##_alloc() {                                           \
+    int i;                                                                     \
+                                                                               \
+    _##type##_allocator_init();                                                \
                                                                                \
     /* if there is no unused obj, alloc a bunch at once */                     \
     if(_##type##_allocator_buffer->size == 0) {                                \
@@ -71,9 +119,12 @@ static inline type* type##_alloc() {                                           \
                 _##type##_allocator_buffer->objs[i] = objs + i;                \
             }                                                                  \
             _##type##_allocator_buffer->size = _##type##alloc_step;            \
+            _##type##_allocator_stats.free += _##type##alloc_step;             \
         }                                                                      \
     }                                                                          \
                                                                                \
+    _##type##_allocator_stats.live++;                                          \
+    _##type##_allocator_stats.free--;                                          \
     return _##type##_allocator_buffer->objs                                    \
         [--_##type##_allocator_buffer->size];                                  \
 }                                                                              \
@@ -92,25 +143,53 @@ static inline void type##_free(type* obj) {                                    \
             node->next->prev = node;                                           \
             node->prev->next = node;                                           \
             _##type##_allocator_buffer = node;                                 \
+            _##type##_allocator_stats.overhead +=                              \
+                sizeof(_##type##_allocator_node);                              \
         }                                                                      \
     }                                                                          \
+    _##type##_allocator_stats.live--;                                          \
+    _##type##_allocator_stats.free++;                                          \
     _##type##_allocator_buffer->objs                                           \
     [_##type##_allocator_buffer->size++] = obj;                                \
-    }
+}                                                                              \
+                                                                               \
+/*! \brief Fill the free list with count objects from allocator_map */        \
+static inline void type##_reserve(size_t count) {                              \
+    type* objs;                                                                \
+    size_t i;                                                                  \
+                                                                               \
+    if(count == 0 || (objs = allocator_map(count * sizeof(type))) == NULL) {   \
+        return;                                                                \
+    }                                                                          \
+    _##type##_allocator_init();                                                \
+                                                                               \
+    /* freed backwards, so they are handed out in address order */             \
+    _##type##_allocator_stats.live += count;                                   \
+    for(i = count; i > 0; --i) {                                               \
+        type##_free(objs + i - 1);                                             \
+    }                                                                          \
+}
 
 
 
 #else
 
-#define IMPLEMENT_ALLOCATOR(type)
+#define IMPLEMENT_ALLOCATOR(type)                                              \
+    IMPLEMENT_ALLOCATOR_STATS(_##type##_allocator_stats, #type, sizeof(type))
 
 #define DECLARE_ALLOCATOR(type)                                                \
+extern AllocatorStats _##type##_allocator_stats;                               \
 static inline type* type##_alloc() {                                           \
+    _##type##_allocator_stats.live++;                                          \
     return malloc(sizeof(type));                                               \
 }                                                                              \
                                                                                \
 static inline void type##_free(type* obj) {                                    \
+    _##type##_allocator_stats.live--;                                          \
     free(obj);                                                                 \
+}                                                                              \
+                                                                               \
+static inline void type##_reserve(size_t count) {                              \
 }
 #endif
 
@@ -0,0 +1,235 @@
+/*
+ *   Copyright (c) 2007-2008 C3SL.
+ *
+ *   This file is part of Bosh.
+ *
+ *   Bosh is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   any later version.
+ *
+ *   Bosh is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ */
+
+/* Hands the sockets of the server to a new binary.
+ *
+ * The old process starts the new one with a unix socket on HANDOFF_ENV, and
+ * sends its state over it as messages. Each message is a type followed by
+ * the data, and may carry a file descriptor. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "handoff.h"
+#include "log.h"
+
+/* fd of the channel in the new process */
+#define CHANNEL_FD 3
+
+static char** handoff_argv = NULL;
+
+/*! \brief Save the command line, so the new binary gets the same one */
+void handoff_init(char** argv) {
+    handoff_argv = argv;
+}
+
+/*! \brief Returns the channel inherited from the old process, or -1 */
+int handoff_inherited() {
+    const char* str = getenv(HANDOFF_ENV);
+    int channel;
+
+    if(str == NULL) {
+        return -1;
+    }
+    channel = atoi(str);
+    unsetenv(HANDOFF_ENV);
+
+    return channel;
+}
+
+/*! \brief Start a new process of the server.
+ *
+ * Returns the channel to talk to it, or -1 on error. The pid of the new
+ * process is stored in pid. */
+int handoff_spawn(pid_t* pid) {
+    int fds[2];
+    char str[16];
+    long fd, max_fd;
+
+    if(handoff_argv == NULL) {
+        log(ERROR, "Can't start a new process without the command line");
+        return -1;
+    }
+
+    /* a seqpacket socket keeps the messages boundaries */
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == -1) {
+        log(ERROR, "Unable to create the handoff channel: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    /* setenv is not safe after fork in a threaded process */
+    snprintf(str, sizeof(str), "%d", CHANNEL_FD);
+    setenv(HANDOFF_ENV, str, 1);
+    max_fd = sysconf(_SC_OPEN_MAX);
+
+    *pid = fork();
+    if(*pid == 0) {
+        /* keep only the standard streams and the channel, the sockets we
+         * want the new process to have are sent over the channel */
+        if(dup2(fds[1], CHANNEL_FD) == -1) {
+            _exit(1);
+        }
+        for(fd = CHANNEL_FD + 1; fd < max_fd; ++fd) {
+            close(fd);
+        }
+        execvp(handoff_argv[0], handoff_argv);
+        _exit(1);
+    }
+
+    unsetenv(HANDOFF_ENV);
+    close(fds[1]);
+
+    if(*pid == -1) {
+        log(ERROR, "Unable to start the new process: %s", strerror(errno));
+        close(fds[0]);
+        return -1;
+    }
+
+    log(INFO, "Started new process pid=%d", (int)*pid);
+
+    return fds[0];
+}
+
+/*! \brief Close the channel and kill the new process after a failed handoff
+ *
+ * The new process may already hold the listening socket and some of the
+ * jabber connections, it must not keep running next to us. */
+void handoff_abort(int channel, pid_t pid) {
+    int status;
+
+    close(channel);
+
+    if(kill(pid, SIGKILL) == -1 && errno != ESRCH) {
+        log(ERROR, "Unable to kill the new process pid=%d: %s", (int)pid,
+                strerror(errno));
+        return;
+    }
+    while(waitpid(pid, &status, 0) == -1 && errno == EINTR);
+
+    log(INFO, "Killed the new process pid=%d", (int)pid);
+}
+
+/*! \brief Send a message and optionally a file descriptor (-1 for none) */
+int handoff_send(int channel, int type, const void* data, size_t len, int fd) {
+    struct msghdr msg;
+    struct iovec iov[2];
+    struct cmsghdr* cmsg;
+    char control[CMSG_SPACE(sizeof(int))];
+
+    memset(&msg, 0, sizeof(msg));
+    iov[0].iov_base = &type;
+    iov[0].iov_len = sizeof(type);
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    /* attach the file descriptor */
+    if(fd != -1) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    if(sendmsg(channel, &msg, MSG_NOSIGNAL) == -1) {
+        log(ERROR, "Unable to send handoff message: %s", strerror(errno));
+        return 0;
+    }
+
+    return 1;
+}
+
+/*! \brief Receive a message, waiting at most timeout miliseconds
+ *
+ * Returns the length of the data or -1 on error. If a file descriptor came
+ * with the message, it is stored in fd, otherwise fd is -1. */
+ssize_t handoff_recv(int channel, int* type, void* data, size_t len, int* fd,
+        time_type timeout) {
+    struct msghdr msg;
+    struct iovec iov[2];
+    struct cmsghdr* cmsg;
+    struct pollfd pfd;
+    char control[CMSG_SPACE(sizeof(int))];
+    ssize_t ret;
+
+    *fd = -1;
+
+    /* wait for the message */
+    pfd.fd = channel;
+    pfd.events = POLLIN;
+    do {
+        ret = poll(&pfd, 1, timeout);
+    } while(ret == -1 && errno == EINTR);
+    if(ret <= 0) {
+        log(ERROR, "Timeout waiting for handoff message");
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov[0].iov_base = type;
+    iov[0].iov_len = sizeof(*type);
+    iov[1].iov_base = data;
+    iov[1].iov_len = len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    do {
+        ret = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+    } while(ret == -1 && errno == EINTR);
+    if(ret < (ssize_t)sizeof(*type)) {
+        log(ERROR, "Unable to receive handoff message: %s",
+                ret == -1 ? strerror(errno) : "channel closed");
+        return -1;
+    }
+
+    /* take the file descriptor */
+    for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    if(msg.msg_flags & MSG_TRUNC) {
+        log(ERROR, "Handoff message truncated");
+        if(*fd != -1) {
+            close(*fd);
+            *fd = -1;
+        }
+        return -1;
+    }
+
+    return ret - sizeof(*type);
+}
@@ -0,0 +1,57 @@
+/*
+ *   Copyright (c) 2007-2008 C3SL.
+ *
+ *   This file is part of Bosh.
+ *
+ *   Bosh is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   any later version.
+ *
+ *   Bosh is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ */
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <sys/types.h>
+
+#include "time.h"
+
+/* environment variable with the channel fd in the new process */
+#define HANDOFF_ENV "BOSH_HANDOFF_FD"
+
+/* largest message sent over the channel */
+#define HANDOFF_MAX_MESSAGE (16 * 1024)
+
+/*! \brief Save the command line, so the new binary gets the same one */
+void handoff_init(char** argv);
+
+/*! \brief Returns the channel inherited from the old process, or -1 */
+int handoff_inherited();
+
+/*! \brief Start a new process of the server.
+ *
+ * Returns the channel to talk to it, or -1 on error. The pid of the new
+ * process is stored in pid. */
+int handoff_spawn(pid_t* pid);
+
+/*! \brief Close the channel and kill the new process after a failed handoff */
+void handoff_abort(int channel, pid_t pid);
+
+/*! \brief Send a message and optionally a file descriptor (-1 for none) */
+int handoff_send(int channel, int type, const void* data, size_t len, int fd);
+
+/*! \brief Receive a message, waiting at most timeout miliseconds
+ *
+ * Returns the length of the data or -1 on error. If a file descriptor came
+ * with the message, it is stored in fd, otherwise fd is -1. */
+ssize_t handoff_recv(int channel, int* type, void* data, size_t len, int* fd,
+        time_type timeout);
+
+#endif
@@ -35,7 +35,9 @@ static const size_t prime_numbers[] = {
 #define IMPLEMENT_HASH(key_type)                                            \
                                                                             \
 IMPLEMENT_ALLOCATOR(_##key_type##_hash_node);                               \
-IMPLEMENT_ALLOCATOR(key_type##_hash);
+IMPLEMENT_ALLOCATOR(key_type##_hash);                                       \
+IMPLEMENT_ALLOCATOR_STATS(_##key_type##_hash_table_stats,                   \
+        #key_type "_hash_table", sizeof(_##key_type##_hash_node));
 
 
 
@@ -60,6 +62,9 @@ typedef struct key_type##_hash {                                            \
 DECLARE_ALLOCATOR(_##key_type##_hash_node);                                 \
 DECLARE_ALLOCATOR(key_type##_hash);                                         \
                                                                             \
+/* the buckets of all the tables, counted as live objects */                \
+extern AllocatorStats _##key_type##_hash_table_stats;                       \
+                                                                            \
 /*! \brief Creates a new hash table. */                                     \
 static inline key_type##_hash* key_type##_hash_new() {                      \
                                                                             \
@@ -71,6 +76,7 @@ static inline key_type##_hash* key_type##_hash_new() {                      \
     h->table_size = prime_numbers[0];                                       \
                                                                             \
     h->table = calloc(h->table_size, sizeof(_##key_type##_hash_node));      \
+    _##key_type##_hash_table_stats.live += h->table_size;                   \
                                                                             \
     return h;                                                               \
 }                                                                           \
@@ -102,6 +108,7 @@ static inline void _##key_type##_hash_resize(key_type##_hash* h) {          \
                                                                             \
         h->table_size = prime_numbers[i];                                   \
         h->table = calloc(h->table_size, sizeof(_##key_type##_hash_node));  \
+        _##key_type##_hash_table_stats.live += h->table_size - old_size;    \
                                                                             \
         for(i = 0; i < old_size; ++i) {                                     \
             while(old_table[i].next != NULL) {                              \
@@ -226,6 +233,7 @@ static inline void key_type##_hash_clear(key_type##_hash* h) {              \
 static inline void key_type##_hash_delete(key_type##_hash* h) {             \
     key_type##_hash_clear(h);                                               \
     free(h->table);                                                         \
+    _##key_type##_hash_table_stats.live -= h->table_size;                   \
     key_type##_hash_free(h);                                                \
 }                                                                           \
                                                                             \
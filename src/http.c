@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 
 #include "http.h"
@@ -155,17 +156,30 @@ HttpHeader* http_parse(const char* str) {
     }
 }
 
+const char* http_status_message(int code) {
+    switch(code) {
+        case 200:
+            return "OK";
+        case 400:
+            return "Bad Request";
+        case 404:
+            return "Not Found";
+        case 429:
+            return "Too Many Requests";
+        case 500:
+            return "Internal Server Error";
+        case 503:
+            return "Service Unavailable";
+        default:
+            return "ERROR";
+    }
+}
+
 char* make_http_head(int code, size_t data_size, const char* content_type) {
 	char* msg;
-	const char* code_msg;
-
-	if(code == 200) {
-		code_msg = "OK";
-	} else {
-		code_msg = "ERROR";
-	}
 
-	asprintf(&msg, HTTP_HEADER, code, code_msg, content_type, (int)data_size);
+	asprintf(&msg, HTTP_HEADER, code, http_status_message(code), content_type,
+            (int)data_size);
 
 	return msg;
 }
@@ -174,7 +188,7 @@ const char* http_get_field(HttpHeader* header, const char* field) {
     int i;
 
     for(i = 0;i < header->n_fields; ++i) {
-        if(strcmp(field, header->fields[i].name) == 0)
+        if(strcasecmp(field, header->fields[i].name) == 0)
             return header->fields[i].value;
     }
 
@@ -26,6 +26,7 @@
 
 #define HTTP_XML_CONTENT "text/xml"
 #define HTTP_HTML_CONTENT "text/html"
+#define HTTP_METRICS_CONTENT "text/plain; version=0.0.4"
 
 typedef struct HttpField {
     char* name;
@@ -43,6 +44,8 @@ void http_delete(HttpHeader* header);
 
 HttpHeader* http_parse(const char* str);
 
+const char* http_status_message(int http_code);
+
 char* make_http_head(int http_code, size_t data_size, const char* content_type);
 
 const char* http_get_field(HttpHeader* header, const char* field);
@@ -20,29 +20,78 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 
 #include <sys/socket.h>
 #include <unistd.h>
 
 #include <errno.h>
 
+#include <sys/epoll.h>
+
 #include "http_server.h"
 #include "socket.h"
+#include "socket_monitor.h"
+#include "handoff.h"
+#include "workers.h"
+#include "rate_limit.h"
 #include "log.h"
+#include "metrics.h"
 
 #include "allocator.h"
 
 #define HTTP_PORT 8080
 
 #define HTML_ERROR "<html><head>" \
-						"<title>400 Bad Request</title>" \
+						"<title>%d %s</title>" \
 						"</head><body>" \
-						"<h1>Bad Request</h1>" \
+						"<h1>%s</h1>" \
 						"<p>%s</p>" \
 						"</body></html>"
 
 #define MAX_BUFFER_SIZE (1024*128)
 
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define WS_HANDSHAKE "HTTP/1.1 101 Switching Protocols\r\n" \
+                        "Upgrade: websocket\r\n" \
+                        "Connection: Upgrade\r\n" \
+                        "Sec-WebSocket-Accept: %s\r\n" \
+                        "Sec-WebSocket-Protocol: %s\r\n" \
+                        "\r\n"
+
+/* websocket frame opcodes */
+enum WS_OPCODE {
+    WS_CONTINUATION = 0x0,
+    WS_TEXT = 0x1,
+    WS_BINARY = 0x2,
+    WS_CLOSE = 0x8,
+    WS_PING = 0x9,
+    WS_PONG = 0xa
+};
+
+/* default deadlines of a connection, in ms */
+#define HEADER_TIMEOUT 10000
+#define BODY_TIMEOUT 30000
+#define KEEPALIVE_TIMEOUT 75000
+#define LINGER_TIMEOUT 10000
+#define WEBSOCKET_TIMEOUT 60000
+
+/* The deadlines of the connections. A connection is in at most one list, and
+ * every deadline of a list has the same delay, so appending keeps it sorted:
+ * the next timeout is at the front of each list, and the expired ones are
+ * found without looking at the others. */
+enum HC_TIMER {
+    HC_TIMER_HEADER,            /* a request started, or none yet       */
+    HC_TIMER_BODY,              /* the header is here, not the content  */
+    HC_TIMER_IDLE,              /* answered, waiting for a new request  */
+    HC_TIMER_LINGER,            /* closing, sending the last responses  */
+    HC_TIMER_WEBSOCKET,         /* a websocket, waiting for a frame     */
+    HC_TIMER_COUNT,
+    HC_TIMER_NONE = -1          /* a request is held                    */
+};
+
 struct HttpConnection {
     char buffer[MAX_BUFFER_SIZE+1];
     size_t buffer_size;
@@ -54,6 +103,32 @@ struct HttpConnection {
 
     hc_close_callback close_callback;
     void* close_data;
+
+    int forward_channel;        /* where to pass the connection, or -1 */
+
+    int websocket;              /* 1 after the websocket handshake      */
+    int ws_closing;             /* 1 after we sent a close frame        */
+    int ws_pinged;              /* 1 after we sent a ping, until a frame
+                                   comes in                             */
+    char* ws_message;           /* fragments of the current message     */
+    size_t ws_message_size;
+    hc_message_callback message_callback;
+    void* message_data;
+    hc_writable_callback writable_callback;
+    void* writable_data;
+
+    PeerAddress client;         /* who sent the current request         */
+    int client_known;           /* 0 behind a proxy that didn't tell    */
+    int counted;                /* 1 if the limiter counts the socket   */
+    int charged;                /* 1 if the process that passed the
+                                   connection charged its request       */
+
+    int timer;                  /* the list it is in, or HC_TIMER_NONE  */
+    list_iterator timer_it;
+    time_type deadline;
+    int requests;               /* requests processed                   */
+    int processing;             /* 1 inside the request callback        */
+    int closing;                /* 1 once hc_close was called           */
 };
 
 struct HttpServer {
@@ -61,21 +136,151 @@ struct HttpServer {
     Socket* sock;
 	hs_request_callback callback;
 	void* user_data;
+    size_t high_water;          /* water marks of the connections output */
+    size_t low_water;
+    SocketInfo* inbox_si;       /* connections passed by other processes */
+    int inbox;
+    TlsContext* tls;            /* NULL if the connections are plain */
+    SocketOptions tcp_options;  /* set on the listening socket, the
+                                   accepted ones inherit them          */
+    RateLimiter* limiter;       /* NULL if there are no limits        */
+    PeerAddress trusted_proxy;  /* its X-Forwarded-For is believed    */
+    int has_trusted_proxy;
+    list* timers[HC_TIMER_COUNT];
+    time_type timeouts[HC_TIMER_COUNT]; /* 0 if there is no deadline  */
+    int max_requests;           /* per connection, 0 for no limit     */
 };
 
 DECLARE_ALLOCATOR(HttpConnection);
 IMPLEMENT_ALLOCATOR(HttpConnection);
 
+/* Returns 1 if the connection is closed after the current response */
+static int hc_last_request(HttpConnection* connection) {
+    return connection->server->max_requests > 0 &&
+        connection->requests >= connection->server->max_requests;
+}
+
+/* Take the connection out of its deadline list */
+static void hc_stop_timer(HttpConnection* connection) {
+    if(connection->timer != HC_TIMER_NONE) {
+        list_erase(connection->timer_it);
+        connection->timer = HC_TIMER_NONE;
+    }
+}
+
+/* Put the connection in the deadline list of its state
+ *
+ * The header and body deadlines are not moved by the data that trickles
+ * in, only by the next state. */
+static void hc_update_timer(HttpConnection* connection) {
+    HttpServer* server = connection->server;
+    int timer;
+
+    /* a closing connection keeps the linger deadline */
+    if(connection->closing) {
+        return;
+    }
+
+    if(connection->websocket) {
+        /* don't wait forever for the answer to our close */
+        timer = connection->ws_closing ? HC_TIMER_IDLE : HC_TIMER_WEBSOCKET;
+    } else if(hc_last_request(connection)) {
+        timer = connection->close_callback != NULL ? HC_TIMER_NONE :
+            HC_TIMER_IDLE;
+    } else if(connection->header != NULL) {
+        timer = HC_TIMER_BODY;
+    } else if(connection->buffer_size > 0 || connection->requests == 0) {
+        timer = HC_TIMER_HEADER;
+    } else if(connection->close_callback != NULL) {
+        timer = HC_TIMER_NONE;
+    } else {
+        timer = HC_TIMER_IDLE;
+    }
+
+    if(timer == connection->timer) {
+        return;
+    }
+    hc_stop_timer(connection);
+
+    if(timer == HC_TIMER_IDLE && !connection->websocket &&
+            hc_last_request(connection)) {
+        /* it served its share, close it when the loop comes back */
+        connection->deadline = get_time();
+        connection->timer_it = list_push_front(server->timers[timer],
+                connection);
+        connection->timer = timer;
+    } else if(timer != HC_TIMER_NONE && server->timeouts[timer] > 0) {
+        connection->deadline = get_time() + server->timeouts[timer];
+        connection->timer_it = list_push_back(server->timers[timer],
+                connection);
+        connection->timer = timer;
+    }
+}
+
+/* The header of a response, telling the client when it is the last one */
+static char* hc_make_head(HttpConnection* connection, int code, size_t size,
+        const char* content_type) {
+    char* head;
+    char* header;
+
+    head = make_http_head(code, size, content_type);
+    if(!hc_last_request(connection)) {
+        return head;
+    }
+
+    /* put the Connection field before the empty line */
+    asprintf(&header, "%.*sConnection: close\r\n\r\n",
+            (int)strlen(head) - 2, head);
+    free(head);
+
+    return header;
+}
+
 /*! \brief Send an http error response */
-static void hc_report_error(HttpConnection* connection, const char* msg) {
+void hs_report_error(HttpConnection* connection, int code, const char* msg) {
 	char* body = NULL;
 	char* header = NULL;
+    const char* status = http_status_message(code);
+
+    metric_inc(METRIC_HTTP_ERRORS);
 
-	asprintf(&body, HTML_ERROR, msg);
-	header = make_http_head(500, strlen(body), HTTP_HTML_CONTENT);
+	asprintf(&body, HTML_ERROR, code, status, status, msg);
+	header = hc_make_head(connection, code, strlen(body), HTTP_HTML_CONTENT);
 
     sock_send(connection->sock, header, strlen(header), 1);
     sock_send(connection->sock, body, strlen(body), 0);
+
+    if(!connection->processing) {
+        hc_update_timer(connection);
+    }
+}
+
+/*! \brief Answer with an error telling when to try again, like 429 or 503
+ *
+ * retry_after is in seconds. */
+void hs_report_retry(HttpConnection* connection, int code, int retry_after,
+        const char* msg) {
+	char* body = NULL;
+	char* header = NULL;
+	char* head = NULL;
+    const char* status = http_status_message(code);
+
+    metric_inc(METRIC_HTTP_ERRORS);
+
+	asprintf(&body, HTML_ERROR, code, status, status, msg);
+	head = hc_make_head(connection, code, strlen(body), HTTP_HTML_CONTENT);
+
+    /* put the Retry-After field before the empty line */
+    asprintf(&header, "%.*sRetry-After: %d\r\n\r\n", (int)strlen(head) - 2,
+            head, retry_after);
+    free(head);
+
+    sock_send(connection->sock, header, strlen(header), 1);
+    sock_send(connection->sock, body, strlen(body), 0);
+
+    if(!connection->processing) {
+        hc_update_timer(connection);
+    }
 }
 
 /*! \brief Release the connection's resources */
@@ -89,6 +294,13 @@ static void hc_delete(HttpConnection* connection) {
         connection->close_callback(connection->close_data);
     }
 
+    if(connection->counted) {
+        rl_disconnect(connection->server->limiter,
+                sock_peer(connection->sock));
+    }
+
+    hc_stop_timer(connection);
+
     /* delete the socket */
     sock_delete(connection->sock);
 
@@ -101,14 +313,72 @@ static void hc_delete(HttpConnection* connection) {
         connection->header = NULL;
     }
 
+    if(connection->websocket) {
+        free(connection->ws_message);
+        metric_dec(METRIC_WEBSOCKET_CONNECTIONS);
+    }
+
+    metric_dec(METRIC_HTTP_CONNECTIONS);
+
     /* free memory */
     HttpConnection_free(connection);
 }
 
+/* Put the connection in the linger list */
+static void hc_start_linger(HttpConnection* connection) {
+    HttpServer* server = connection->server;
+
+    hc_stop_timer(connection);
+    connection->deadline = get_time() + server->timeouts[HC_TIMER_LINGER];
+    connection->timer_it = list_push_back(server->timers[HC_TIMER_LINGER],
+            connection);
+    connection->timer = HC_TIMER_LINGER;
+}
+
+/* The last responses are sent, send a FIN and wait for the client's
+ *
+ * Closing right away would reset the connection if the client sent more,
+ * and the reset can destroy the responses it hasn't read yet. */
+static void hc_drained(void* _connection) {
+    HttpConnection* connection = _connection;
+
+    sock_shutdown_write(connection->sock);
+    if(sock_recv_paused(connection->sock)) {
+        sock_resume_recv(connection->sock);
+    }
+}
+
+/*! \brief Close the connection once its responses are sent
+ *
+ * Nothing more is processed. The connection is deleted when the client
+ * closes its side, or after linger_timeout. */
+static void hc_close(HttpConnection* connection) {
+    if(sock_status(connection->sock) != SOCKET_CONNECTED ||
+            connection->server->timeouts[HC_TIMER_LINGER] <= 0) {
+        hc_delete(connection);
+        return;
+    }
+
+    connection->closing = 1;
+    connection->message_callback = NULL;
+    connection->writable_callback = NULL;
+    hc_start_linger(connection);
+
+    if(sock_queued_bytes(connection->sock) == 0) {
+        hc_drained(connection);
+    } else {
+        /* don't read a close from the client before the responses are out */
+        sock_pause_recv(connection->sock);
+        sock_set_drained_callback(connection->sock, hc_drained, connection);
+    }
+}
+
 static void hc_read(void* _connection);
 
 static void hc_handle_error(void* _connection, int error);
 
+static void hc_writable(void* _connection);
+
 /*! \brief Create an http connetion */
 static HttpConnection* hc_create(HttpServer* server, Socket* sock) {
     HttpConnection* connection;
@@ -123,15 +393,41 @@ static HttpConnection* hc_create(HttpServer* server, Socket* sock) {
     connection->header = NULL;
     connection->close_callback = NULL;
     connection->close_data = NULL;
+    connection->forward_channel = -1;
+    connection->websocket = 0;
+    connection->ws_closing = 0;
+    connection->ws_pinged = 0;
+    connection->ws_message = NULL;
+    connection->ws_message_size = 0;
+    connection->message_callback = NULL;
+    connection->message_data = NULL;
+    connection->writable_callback = NULL;
+    connection->writable_data = NULL;
+    connection->client_known = 0;
+    connection->counted = 0;
+    connection->charged = 0;
+    connection->timer = HC_TIMER_NONE;
+    connection->requests = 0;
+    connection->processing = 0;
+    connection->closing = 0;
 
     /* insert the conenction into the connection list */
 	connection->it = list_push_back(server->http_connections, connection);
+    metric_inc(METRIC_HTTP_CONNECTIONS);
+    metric_inc(METRIC_HTTP_CONNECTIONS_TOTAL);
 
     /* start to monitor the connection */
     sock_set_data_callback(sock, hc_read, connection);
 
     sock_set_error_callback(sock, hc_handle_error, connection);
 
+    /* stop reading requests from clients that don't read the responses */
+    sock_set_water_marks(sock, server->high_water, server->low_water);
+    sock_set_writable_callback(sock, hc_writable, connection);
+
+    /* the first request must come before the header deadline */
+    hc_update_timer(connection);
+
     log(INFO, "Http connection created socket=%p", connection->sock);
 
     return connection;
@@ -146,13 +442,407 @@ void hc_set_close_callback(HttpConnection* connection,
     connection->close_data = data;
 }
 
-/*! \brief Process an incoming message */
-static void hc_process(HttpConnection* connection) {
+/*! \brief Pass the connection to another process after the request
+ *
+ * This should be called from the request callback, instead of answering the
+ * request. The socket and all the data read from it are sent on the
+ * channel, the other process should call hs_adopt_connection. */
+void hc_forward(HttpConnection* connection, int channel) {
+    /* the TLS state in user space can't go with the socket */
+    if(sock_has_tls(connection->sock)) {
+        log(WARNING, "Can't pass a TLS connection without kTLS to another "
+                "process");
+        hs_report_error(connection, 500, "Session owned by another worker");
+        return;
+    }
+    connection->forward_channel = channel;
+}
+
+/*! \brief Returns 1 if a comma separated header field has the given token */
+static int hc_field_has(HttpHeader* header, const char* field,
+        const char* token) {
+    const char* value = http_get_field(header, field);
+    size_t len = strlen(token);
+
+    while(value != NULL && *value != 0) {
+        while(*value == ',' || isspace((unsigned char)*value)) {
+            ++value;
+        }
+        if(strncasecmp(value, token, len) == 0 &&
+                (value[len] == 0 || value[len] == ',' ||
+                 isspace((unsigned char)value[len]))) {
+            return 1;
+        }
+        value = strchr(value, ',');
+    }
+
+    return 0;
+}
+
+/*! \brief Switch the connection to the websocket protocol
+ *
+ * This should be called from the request callback, with a GET request. The
+ * handshake is answered if the client asked for the given subprotocol,
+ * afterwards the messages go to the message callback. Returns 1 on success,
+ * otherwise the request is answered with an error and 0 is returned. */
+int hc_accept_websocket(const HttpRequest* request, const char* protocol) {
+    HttpConnection* connection = request->connection;
+    const char* key;
+    char* accept;
+    char* msg;
+    char hex[41];
+    char digest[20];
+    iksha* sha;
+    int i;
+
+    key = http_get_field(request->header, "Sec-WebSocket-Key");
+    if(key == NULL || !hc_field_has(request->header, "Upgrade", "websocket") ||
+            !hc_field_has(request->header, "Connection", "upgrade") ||
+            !hc_field_has(request->header, "Sec-WebSocket-Version", "13") ||
+            !hc_field_has(request->header, "Sec-WebSocket-Protocol",
+                protocol)) {
+        log(WARNING, "Invalid websocket handshake");
+        hs_report_error(connection, 400, "Invalid websocket handshake");
+        return 0;
+    }
+    while(isspace((unsigned char)*key)) {
+        ++key;
+    }
+
+    /* the accept value is the base64 of the sha1 of the key and the guid */
+    sha = iks_sha_new();
+    iks_sha_hash(sha, (const unsigned char*)key, strcspn(key, " \t"), 0);
+    iks_sha_hash(sha, (const unsigned char*)WS_GUID, strlen(WS_GUID), 1);
+    iks_sha_print(sha, hex);
+    iks_sha_delete(sha);
+    for(i = 0; i < 20; ++i) {
+        sscanf(hex + 2 * i, "%2hhx", (unsigned char*)&digest[i]);
+    }
+    accept = iks_base64_encode(digest, sizeof(digest));
+
+    asprintf(&msg, WS_HANDSHAKE, accept, protocol);
+    iks_free(accept);
+    sock_send(connection->sock, msg, strlen(msg), 0);
+
+    connection->websocket = 1;
+    metric_inc(METRIC_WEBSOCKET_CONNECTIONS);
+
+    log(INFO, "Websocket connection accepted socket=%p", connection->sock);
+
+    return 1;
+}
+
+/*! \brief Set the function receiving the messages of a websocket */
+void hc_set_message_callback(HttpConnection* connection,
+        hc_message_callback callback, void* data) {
+
+    connection->message_callback = callback;
+    connection->message_data = data;
+}
+
+/*! \brief Set a callback to be called when a slow connection can take more
+ * data again */
+void hc_set_writable_callback(HttpConnection* connection,
+        hc_writable_callback callback, void* data) {
+
+    connection->writable_callback = callback;
+    connection->writable_data = data;
+}
+
+/*! \brief Returns 0 if the client is not reading what we send */
+int hc_is_writable(HttpConnection* connection) {
+    return sock_writable(connection->sock);
+}
+
+/* Returns 1 if the peer is a unix socket or the trusted proxy */
+static int hs_trusted_peer(HttpServer* server, const PeerAddress* peer) {
+    static const PeerAddress unix_peer;
+
+    return memcmp(peer, &unix_peer, sizeof(*peer)) == 0 ||
+        (server->has_trusted_proxy &&
+         memcmp(peer, &server->trusted_proxy, sizeof(*peer)) == 0);
+}
+
+/* Find the client of the current request: the peer, or the last address in
+ * X-Forwarded-For when the peer is a proxy we trust. The earlier addresses
+ * are written by the client, they can't be believed. */
+static void hc_find_client(HttpConnection* connection) {
+    const PeerAddress* peer = sock_peer(connection->sock);
+    const char* forwarded;
+    const char* last;
+
+    connection->client_known = 0;
+    if(!hs_trusted_peer(connection->server, peer)) {
+        connection->client = *peer;
+        connection->client_known = 1;
+        return;
+    }
+
+    forwarded = http_get_field(connection->header, "X-Forwarded-For");
+    if(forwarded == NULL) {
+        return;
+    }
+    last = strrchr(forwarded, ',');
+    last = last == NULL ? forwarded : last + 1;
+    connection->client_known = sock_parse_address(last, strlen(last),
+            &connection->client);
+}
+
+/*! \brief Returns the client of the current request, or NULL if a trusted
+ * proxy didn't tell it */
+const PeerAddress* hc_client(HttpConnection* connection) {
+    return connection->client_known ? &connection->client : NULL;
+}
+
+/*! \brief Take a token for a new session from the limit of the client
+ *
+ * Returns 0 if the client creates sessions too fast, the request should be
+ * refused with a 429. */
+int hc_allow_session(HttpConnection* connection) {
+    char text[PEER_ADDRESS_LEN];
+
+    if(!connection->client_known ||
+            rl_session(connection->server->limiter, &connection->client)) {
+        return 1;
+    }
+
+    metric_inc(METRIC_RATE_LIMITED_SESSIONS);
+    log(WARNING, "Too many sessions from %s",
+            sock_format_address(&connection->client, text));
+    return 0;
+}
+
+/*! \brief Send a websocket frame, the ownership of payload is passed */
+static void hc_ws_send_frame(HttpConnection* connection, int opcode,
+        char* payload, size_t size) {
+    unsigned char* header = malloc(10);
+    size_t n;
+    int i;
+
+    header[0] = 0x80 | opcode;
+    if(size < 126) {
+        header[1] = size;
+        n = 2;
+    } else if(size < 65536) {
+        header[1] = 126;
+        header[2] = size >> 8;
+        header[3] = size;
+        n = 4;
+    } else {
+        header[1] = 127;
+        for(i = 0; i < 8; ++i) {
+            header[2 + i] = (uint64_t)size >> (56 - 8 * i);
+        }
+        n = 10;
+    }
+
+    sock_send(connection->sock, header, n, size > 0);
+    if(size > 0) {
+        sock_send(connection->sock, payload, size, 0);
+    } else {
+        free(payload);
+    }
+}
+
+/*! \brief Send a text message on a websocket
+ *
+ * The ownership of msg is passed to the connection. */
+void hc_ws_send(HttpConnection* connection, char* msg, size_t size) {
+    if(connection->ws_closing) {
+        free(msg);
+        return;
+    }
+    hc_ws_send_frame(connection, WS_TEXT, msg, size);
+}
+
+/*! \brief Start the closing handshake of a websocket
+ *
+ * No more messages are delivered, and the message and writable callbacks are
+ * cleared. The close callback is kept, it is still called when the
+ * connection goes away. The connection is closed when the client answers. */
+void hc_ws_close(HttpConnection* connection, int code) {
+    char* payload;
+
+    if(connection->ws_closing) {
+        return;
+    }
+
+    payload = malloc(2);
+    payload[0] = code >> 8;
+    payload[1] = code;
+    hc_ws_send_frame(connection, WS_CLOSE, payload, 2);
+
+    connection->ws_closing = 1;
+    connection->message_callback = NULL;
+    connection->message_data = NULL;
+    connection->writable_callback = NULL;
+    connection->writable_data = NULL;
+    hc_update_timer(connection);
+}
+
+/*! \brief Handle a complete websocket frame
+ *
+ * Returns 0 if the connection must be deleted, 1 otherwise */
+static int hc_ws_frame(HttpConnection* connection, int fin, int opcode,
+        char* payload, size_t size) {
+    char* copy;
+
+    switch(opcode) {
+        case WS_TEXT:
+        case WS_CONTINUATION:
+            if((opcode == WS_TEXT) != (connection->ws_message == NULL)) {
+                hc_ws_close(connection, WS_CLOSE_PROTOCOL_ERROR);
+                return 0;
+            }
+            if(connection->ws_closing) {
+                break;
+            }
+
+            /* a single frame is delivered from the read buffer, fragments
+             * are put together on the side */
+            if(fin && connection->ws_message == NULL) {
+                if(connection->message_callback != NULL) {
+                    connection->message_callback(connection->message_data,
+                            connection, payload, size);
+                }
+                break;
+            }
+            if(connection->ws_message_size + size > MAX_BUFFER_SIZE) {
+                hc_ws_close(connection, WS_CLOSE_TOO_BIG);
+                return 0;
+            }
+            connection->ws_message = realloc(connection->ws_message,
+                    connection->ws_message_size + size + 1);
+            memcpy(connection->ws_message + connection->ws_message_size,
+                    payload, size);
+            connection->ws_message_size += size;
+            if(fin) {
+                if(connection->message_callback != NULL) {
+                    connection->message_callback(connection->message_data,
+                            connection, connection->ws_message,
+                            connection->ws_message_size);
+                }
+                free(connection->ws_message);
+                connection->ws_message = NULL;
+                connection->ws_message_size = 0;
+            }
+            break;
+        case WS_PING:
+            copy = malloc(size + 1);
+            memcpy(copy, payload, size);
+            hc_ws_send_frame(connection, WS_PONG, copy, size);
+            break;
+        case WS_PONG:
+            break;
+        case WS_CLOSE:
+            /* answer the close and hang up, or hang up if it is the answer */
+            log(INFO, "Websocket closed by the client socket=%p",
+                    connection->sock);
+            hc_ws_close(connection, WS_CLOSE_NORMAL);
+            return 0;
+        default:
+            /* xmpp is always sent as text */
+            hc_ws_close(connection, WS_CLOSE_UNSUPPORTED);
+            return 0;
+    }
+
+    return 1;
+}
+
+/*! \brief Decode the websocket frames in the buffer
+ *
+ * Returns 0 if the connection must be deleted, 1 otherwise */
+static int hc_ws_feed(HttpConnection* connection) {
+    unsigned char* p;
+    uint64_t size;
+    size_t header_size, i;
+    unsigned char* mask;
+    int fin, opcode, frames = 0, ret = 1;
+
+    while(ret && connection->buffer_size >= 2) {
+        p = (unsigned char*)connection->buffer;
+        fin = p[0] & 0x80;
+        opcode = p[0] & 0x0f;
+        size = p[1] & 0x7f;
+        header_size = 2;
+
+        if(size == 126) {
+            if(connection->buffer_size < 4) {
+                break;
+            }
+            size = (p[2] << 8) | p[3];
+            header_size = 4;
+        } else if(size == 127) {
+            if(connection->buffer_size < 10) {
+                break;
+            }
+            for(size = 0, i = 0; i < 8; ++i) {
+                size = (size << 8) | p[2 + i];
+            }
+            header_size = 10;
+        }
+
+        /* the client must mask its frames, no extension was negotiated
+         * and control frames are short and not fragmented */
+        if(!(p[1] & 0x80) || (p[0] & 0x70) ||
+                ((opcode & 0x08) && (!fin || size > 125))) {
+            log(WARNING, "Invalid websocket frame");
+            hc_ws_close(connection, WS_CLOSE_PROTOCOL_ERROR);
+            return 0;
+        }
+        mask = p + header_size;
+        header_size += 4;
+
+        if(size > MAX_BUFFER_SIZE - header_size) {
+            log(WARNING, "Websocket frame is too big");
+            hc_ws_close(connection, WS_CLOSE_TOO_BIG);
+            return 0;
+        }
+        if(connection->buffer_size < header_size + size) {
+            break;
+        }
+
+        for(i = 0; i < size; ++i) {
+            p[header_size + i] ^= mask[i & 3];
+        }
+
+        ret = hc_ws_frame(connection, fin, opcode,
+                connection->buffer + header_size, size);
+        frames++;
+
+        /* remove the frame from the buffer */
+        connection->buffer_size -= header_size + size;
+        memmove(connection->buffer, connection->buffer + header_size + size,
+                connection->buffer_size);
+    }
+
+    /* the client is alive, its deadline starts again */
+    if(ret && frames > 0 && connection->timer == HC_TIMER_WEBSOCKET) {
+        connection->ws_pinged = 0;
+        hc_stop_timer(connection);
+        hc_update_timer(connection);
+    }
+
+    return ret;
+}
+
+/*! \brief Process an incoming message
+ *
+ * Returns 0 if the connection was passed to another process and must be
+ * deleted, 1 otherwise */
+static int hc_process(HttpConnection* connection) {
     const char* tmp;
     const char* data;
     int content_size, header_size;
 	HttpRequest hr;
     HttpServer* server = connection->server;
+    char text[PEER_ADDRESS_LEN];
+
+    /* the connection closes after the last response, the requests
+     * pipelined behind it are dropped */
+    if(hc_last_request(connection)) {
+        return 1;
+    }
 
     /* get the content lenght */
     tmp = http_get_field(connection->header, "Content-Length");
@@ -171,8 +861,8 @@ static void hc_process(HttpConnection* connection) {
     /* check if the message is bigger than current buffer size */
     if(content_size + header_size >= MAX_BUFFER_SIZE) {
         log(WARNING, "Message is too big");
-        hc_report_error(connection, "Message is too big");
-        return;
+        hs_report_error(connection, 500, "Message is too big");
+        return 1;
     }
 
     /* check if everything is here */
@@ -180,12 +870,45 @@ static void hc_process(HttpConnection* connection) {
 
         log(INFO, "Processing request Content-Length=%d", content_size);
 
-        /* inform the request */
-		hr.connection = connection;
-		hr.header = connection->header;
-		hr.data = data;
-		hr.data_size = content_size;
-		server->callback(server->user_data, &hr);
+        /* the deadlines start again for the next request */
+        hc_stop_timer(connection);
+        connection->requests++;
+
+        if(strcmp(connection->header->type, "POST") == 0) {
+            metric_inc(METRIC_HTTP_REQUESTS_POST);
+        } else if(strcmp(connection->header->type, "GET") == 0) {
+            metric_inc(METRIC_HTTP_REQUESTS_GET);
+        } else {
+            metric_inc(METRIC_HTTP_REQUESTS_OTHER);
+        }
+        metric_observe(HISTOGRAM_REQUEST_BYTES, content_size);
+
+        hc_find_client(connection);
+        if(connection->client_known && !connection->charged &&
+                !rl_request(server->limiter, &connection->client)) {
+            metric_inc(METRIC_RATE_LIMITED_REQUESTS);
+            log(WARNING, "Too many requests from %s",
+                    sock_format_address(&connection->client, text));
+            hs_report_retry(connection, 429, 1, "Too many requests");
+        } else {
+            /* inform the request */
+            hr.connection = connection;
+            hr.header = connection->header;
+            hr.data = data;
+            hr.data_size = content_size;
+            connection->processing = 1;
+            server->callback(server->user_data, &hr);
+            connection->processing = 0;
+        }
+        connection->charged = 0;
+
+        /* the request belongs to another process, give it everything */
+        if(connection->forward_channel != -1) {
+            handoff_send(connection->forward_channel, HS_FORWARD_MESSAGE,
+                    connection->buffer, connection->buffer_size,
+                    sock_fd(connection->sock));
+            return 0;
+        }
 
         /* free the header, we don't need it anymore */
 		http_delete(connection->header);
@@ -201,6 +924,42 @@ static void hc_process(HttpConnection* connection) {
             connection->buffer_size = 0;
         }
     }
+
+    return 1;
+}
+
+/*! \brief Parse and process the data in the buffer
+ *
+ * Returns 0 if the connection must be deleted, 1 otherwise */
+static int hc_feed(HttpConnection* connection) {
+    int64_t start;
+
+    if(connection->websocket) {
+        return hc_ws_feed(connection);
+    }
+
+    /* parse the header */
+    if(connection->header == NULL) {
+        start = get_time_ns();
+        connection->header = http_parse(connection->buffer);
+        if(connection->header != NULL) {
+            latency_record(LATENCY_HTTP_PARSE, get_time_ns() - start);
+        }
+    }
+
+    /* if the header is complete, parser the content */
+    if(connection->header != NULL) {
+        if(!hc_process(connection)) {
+            return 0;
+        }
+
+        /* frames sent right after the handshake */
+        if(connection->websocket) {
+            return hc_ws_feed(connection);
+        }
+    }
+
+    return 1;
 }
 
 /*! \brief Read the header of a request */
@@ -209,6 +968,11 @@ static void hc_read(void* _connection) {
     int remaining_buffer;
     ssize_t ret;
 
+    /* a closing connection drops what comes, until the end of the stream */
+    if(connection->closing) {
+        connection->buffer_size = 0;
+    }
+
     /* compute the remaining buffer space */
     remaining_buffer = MAX_BUFFER_SIZE - connection->buffer_size;
 
@@ -217,25 +981,52 @@ static void hc_read(void* _connection) {
                  connection->buffer + connection->buffer_size,
                  remaining_buffer);
 
-    if(ret > 0) {
+    if(connection->closing) {
+        /* nothing to process */
+    } else if(ret > 0) {
         /* update the buffer */
         connection->buffer_size += ret;
         connection->buffer[connection->buffer_size] = 0;
 
-        /* parse the header */
-        if(connection->header == NULL) {
-            connection->header = http_parse(connection->buffer);
-        }
-
-        /* if the header is complete, parser the content */
-        if(connection->header != NULL) {
-            hc_process(connection);
+        if(!hc_feed(connection)) {
+            /* a passed socket belongs to the other process now */
+            if(connection->forward_channel != -1) {
+                hc_delete(connection);
+            } else {
+                hc_close(connection);
+            }
+            return;
         }
     } else {
         log(INFO, "No data in socket\n");
     }
     if(sock_status(connection->sock) != SOCKET_CONNECTED) {
         hc_delete(connection);
+        return;
+    } else if(connection->closing) {
+        return;
+    } else if(!sock_writable(connection->sock)) {
+        log(INFO, "Http connection is slow, pausing socket=%p",
+                connection->sock);
+        sock_pause_recv(connection->sock);
+    }
+    hc_update_timer(connection);
+}
+
+/*! \brief The client read the responses, accept new requests */
+static void hc_writable(void* _connection) {
+    HttpConnection* connection = _connection;
+
+    /* a closing connection reads again once everything is sent */
+    if(connection->closing) {
+        return;
+    }
+
+    if(sock_recv_paused(connection->sock)) {
+        sock_resume_recv(connection->sock);
+    }
+    if(connection->writable_callback != NULL) {
+        connection->writable_callback(connection->writable_data);
     }
 }
 
@@ -248,10 +1039,69 @@ static void hc_handle_error(void* _connection, int code) {
     hc_delete(connection);
 }
 
+/*! \brief Take a connection passed by another process */
+static void hs_read_inbox(int events, void* _server) {
+    static char data[MAX_BUFFER_SIZE];
+    HttpServer* server = _server;
+    HttpConnection* connection;
+    Socket* sock;
+    char text[PEER_ADDRESS_LEN];
+    ssize_t len;
+    int type, fd, counted;
+
+    len = handoff_recv(server->inbox, &type, data, sizeof(data), &fd, 0);
+    if(len < 0 || fd == -1) {
+        return;
+    }
+    if(type != HS_FORWARD_MESSAGE) {
+        close(fd);
+        return;
+    }
+
+    sock = sock_new();
+    sock_adopt(sock, fd, SOCKET_CONNECTED);
+
+    /* the other process stopped counting it, now it is ours */
+    counted = !hs_trusted_peer(server, sock_peer(sock));
+    if(counted && !rl_connect(server->limiter, sock_peer(sock))) {
+        metric_inc(METRIC_RATE_LIMITED_CONNECTIONS);
+        log(WARNING, "Too many connections from %s",
+                sock_format_address(sock_peer(sock), text));
+        sock_delete(sock);
+        return;
+    }
+
+    connection = hc_create(server, sock);
+    connection->counted = counted;
+    connection->charged = 1;
+
+    log(INFO, "Http connection passed by another process socket=%p", sock);
+
+    /* continue where the other process stopped */
+    memcpy(connection->buffer, data, len);
+    connection->buffer_size = len;
+    connection->buffer[len] = 0;
+    if(!hc_feed(connection) ||
+            sock_status(connection->sock) != SOCKET_CONNECTED) {
+        hc_delete(connection);
+        return;
+    }
+    hc_update_timer(connection);
+}
+
+/*! \brief Accept connections passed by other processes on the channel */
+void hs_set_inbox(HttpServer* server, int channel) {
+    server->inbox = channel;
+    server->inbox_si = sm_add_socket(channel, hs_read_inbox, server, EPOLLIN);
+}
+
 /*! \breif Receive an incoming connection */
 static void hs_accept(void* _server) {
     Socket* client;
+    HttpConnection* connection;
     HttpServer* server = _server;
+    char text[PEER_ADDRESS_LEN];
+    int counted;
 
     /* accept the conenction */
     client = sock_accept(server->sock);
@@ -263,26 +1113,45 @@ static void hs_accept(void* _server) {
 
     log(INFO, "New connection accepted %p", server->sock);
 
+    /* refuse before the connection buffer is allocated, a proxy carries
+     * many clients */
+    counted = !hs_trusted_peer(server, sock_peer(client));
+    if(counted && !rl_connect(server->limiter, sock_peer(client))) {
+        metric_inc(METRIC_RATE_LIMITED_CONNECTIONS);
+        log(WARNING, "Too many connections from %s",
+                sock_format_address(sock_peer(client), text));
+        sock_delete(client);
+        return;
+    }
+
     /* create the http connection */
-    hc_create(server, client);
+    connection = hc_create(server, client);
+    connection->counted = counted;
+
+    /* the requests are read after the handshake */
+    if(server->tls != NULL && !sock_start_tls(client, server->tls)) {
+        hc_delete(connection);
+    }
 
 }
 
 /*! \brief Create a new HTTP server
  *
  * \param config the configuratin from config file
- * \param monitor the monitor to be used
+ * \param listen_fd a listening socket to use, or -1 to create one
  * \param callback the function to be called when a request arrives
  * \param user_data the parameter to the callback
  *
  * \return A instance of the server
  */
-HttpServer* hs_new(iks* config, hs_request_callback callback,
+HttpServer* hs_new(iks* config, int listen_fd, hs_request_callback callback,
         void* user_data) {
     HttpServer* server;
     Socket* sock;
     const char* str;
-    int port, ret;
+    const char* path;
+    char* worker_path;
+    int port, ret, i;
 
     /* get the port to listen */
     if((str = iks_find_attrib(config, "port")) != NULL) {
@@ -291,31 +1160,150 @@ HttpServer* hs_new(iks* config, hs_request_callback callback,
         port = HTTP_PORT;
     }
 
+    /* alloc memomry for the server struct */
+    server = malloc(sizeof(HttpServer));
+
     /* create the socket */
     sock = sock_new();
-    ret = sock_listen(sock, port);
+    sock_options_init(&server->tcp_options, config);
+    sock_set_options(sock, &server->tcp_options);
+    path = iks_find_attrib(config, "path");
+    if(listen_fd != -1) {
+        /* the socket came from the previous process, with the old options */
+        sock_adopt(sock, listen_fd, SOCKET_LISTENING);
+        sock_set_options(sock, &server->tcp_options);
+        ret = 1;
+    } else if(path != NULL) {
+        /* a unix socket can't be shared, each worker has its own path */
+        if(workers_count() > 1) {
+            asprintf(&worker_path, "%s.%d", path, workers_index());
+            ret = sock_listen_unix(sock, worker_path);
+            free(worker_path);
+        } else {
+            ret = sock_listen_unix(sock, path);
+        }
+    } else {
+        /* the workers share the port */
+        if((str = iks_find_attrib(config, "workers")) != NULL &&
+                atoi(str) > 1) {
+            sock_set_reuse_port(sock, 1);
+        }
+        ret = sock_listen(sock, port);
+    }
     if(ret == 0) {
-        log(ERROR, "Failed to listen http server port %d", port);
+        if(path != NULL) {
+            log(ERROR, "Failed to listen http server path %s", path);
+        } else {
+            log(ERROR, "Failed to listen http server port %d", port);
+        }
+        sock_delete(sock);
+        free(server);
         return NULL;
     }
 
-    /* alloc memomry for the server struct */
-    server = malloc(sizeof(HttpServer));
+    if(path == NULL) {
+        sock_options_report(&server->tcp_options, "http", 1);
+    }
+
+    /* terminate TLS if there is a certificate */
+    server->tls = NULL;
+    if((str = iks_find_attrib(config, "tls_certificate")) != NULL) {
+        server->tls = tls_new(str, iks_find_attrib(config, "tls_key") != NULL ?
+                iks_find_attrib(config, "tls_key") : str);
+        if(server->tls == NULL) {
+            log(ERROR, "Failed to load the TLS certificate %s", str);
+            sock_delete(sock);
+            free(server);
+            return NULL;
+        }
+
+        /* only a kTLS socket can be passed to the worker owning a session,
+         * and only the ciphers offloaded both ways keep it in the kernel */
+        if(workers_count() > 1 && (!tls_kernel_available() ||
+                    !tls_restrict_offload(server->tls))) {
+            log(ERROR, "TLS with several workers needs kTLS, load the tls "
+                    "kernel module or run a single worker");
+            tls_delete(server->tls);
+            sock_delete(sock);
+            free(server);
+            return NULL;
+        }
+    }
 
     /* init values */
     server->sock = sock;
+    server->inbox = -1;
+    server->inbox_si = NULL;
     server->http_connections = list_new();
 	server->callback = callback;
 	server->user_data = user_data;
 
+    /* get the water marks of the responses queue */
+    if((str = iks_find_attrib(config, "send_high_water")) != NULL) {
+        server->high_water = atoi(str);
+    } else {
+        server->high_water = SOCK_HIGH_WATER;
+    }
+    if((str = iks_find_attrib(config, "send_low_water")) != NULL) {
+        server->low_water = atoi(str);
+    } else {
+        server->low_water = SOCK_LOW_WATER;
+    }
+
+    /* the deadlines of the connections */
+    server->timeouts[HC_TIMER_HEADER] = HEADER_TIMEOUT;
+    if((str = iks_find_attrib(config, "header_timeout")) != NULL) {
+        server->timeouts[HC_TIMER_HEADER] = atoi(str);
+    }
+    server->timeouts[HC_TIMER_BODY] = BODY_TIMEOUT;
+    if((str = iks_find_attrib(config, "body_timeout")) != NULL) {
+        server->timeouts[HC_TIMER_BODY] = atoi(str);
+    }
+    server->timeouts[HC_TIMER_IDLE] = KEEPALIVE_TIMEOUT;
+    if((str = iks_find_attrib(config, "keepalive_timeout")) != NULL) {
+        server->timeouts[HC_TIMER_IDLE] = atoi(str);
+    }
+    server->timeouts[HC_TIMER_LINGER] = LINGER_TIMEOUT;
+    if((str = iks_find_attrib(config, "linger_timeout")) != NULL) {
+        server->timeouts[HC_TIMER_LINGER] = atoi(str);
+    }
+    server->timeouts[HC_TIMER_WEBSOCKET] = WEBSOCKET_TIMEOUT;
+    if((str = iks_find_attrib(config, "websocket_timeout")) != NULL) {
+        server->timeouts[HC_TIMER_WEBSOCKET] = atoi(str);
+    }
+    for(i = 0; i < HC_TIMER_COUNT; ++i) {
+        server->timers[i] = list_new();
+    }
+    server->max_requests = 0;
+    if((str = iks_find_attrib(config, "max_requests")) != NULL) {
+        server->max_requests = atoi(str);
+    }
+
+    /* the limits per client address */
+    server->limiter = rl_new(config);
+    server->has_trusted_proxy = 0;
+    if((str = iks_find_attrib(config, "trusted_proxy")) != NULL) {
+        if(sock_parse_address(str, strlen(str), &server->trusted_proxy)) {
+            server->has_trusted_proxy = 1;
+        } else {
+            log(WARNING, "Invalid trusted_proxy address %s", str);
+        }
+    }
+
     /* monitor the server socket for conenctions */
     sock_set_accept_callback(sock, hs_accept, server);
 
     return server;
 }
 
+/*! \brief Fill the pool of connections before they are needed */
+void hs_reserve(size_t connections) {
+    HttpConnection_reserve(connections);
+}
+
 /*! \brief Close an http server */
 void hs_delete(HttpServer* server) {
+    int i;
 
     /* close ann connections */
     while(!list_empty(server->http_connections)) {
@@ -325,8 +1313,21 @@ void hs_delete(HttpServer* server) {
     /* close the server socket */
     sock_delete(server->sock);
 
+    if(server->inbox_si != NULL) {
+        sm_del_socket(server->inbox_si);
+    }
+
+    if(server->tls != NULL) {
+        tls_delete(server->tls);
+    }
+
+    rl_delete(server->limiter);
+
     /* free the list */
     list_delete(server->http_connections, NULL);
+    for(i = 0; i < HC_TIMER_COUNT; ++i) {
+        list_delete(server->timers[i], NULL);
+    }
 
     /* free the serverstruct */
     free(server);
@@ -340,17 +1341,137 @@ void hs_delete(HttpServer* server) {
  */
 void hs_answer_request(HttpConnection* connection,
                        char* msg, size_t size, const char* content_type) {
+    hs_answer_request_ref(connection, msg, size, content_type, NULL, NULL);
+}
+
+/*! \brief Answer a pending request with a shared content
+ *
+ * The content is not freed, release is called with user_data when the
+ * connection doesn't need it anymore.
+ */
+void hs_answer_request_ref(HttpConnection* connection, const char* msg,
+        size_t size, const char* content_type, ReleaseCallback release,
+        void* user_data) {
     char* header;
 
     /* create the header */
-    header = make_http_head(200, size, content_type);
+    header = hc_make_head(connection, 200, size, content_type);
 
     /* send the header and the content */
     sock_send(connection->sock, header, strlen(header), 1);
+    sock_send_ref(connection->sock, msg, size, 0, release, user_data);
+
+    /* clear the callback */
+    connection->close_callback = NULL;
+    connection->close_data = NULL;
+
+    /* a held request was answered, the connection waits for the next */
+    if(!connection->processing) {
+        hc_update_timer(connection);
+    }
+}
+
+/*! \brief Answer a pending request with a complete http response
+ *
+ * msg has the header and the content, as relayed from another server. The
+ * ownership of msg is passed to the connection. */
+void hs_answer_raw(HttpConnection* connection, char* msg, size_t size) {
     sock_send(connection->sock, msg, size, 0);
 
     /* clear the callback */
     connection->close_callback = NULL;
     connection->close_data = NULL;
+
+    if(!connection->processing) {
+        hc_update_timer(connection);
+    }
+}
+
+/*! \brief Returns the fd of the listening socket */
+int hs_listen_fd(HttpServer* server) {
+    return sock_fd(server->sock);
 }
 
+/*! \brief Stop accepting new connections */
+void hs_stop_accepting(HttpServer* server) {
+    sock_pause_recv(server->sock);
+}
+
+/*! \brief Accept new connections again after hs_stop_accepting */
+void hs_start_accepting(HttpServer* server) {
+    sock_resume_recv(server->sock);
+}
+
+/*! \brief Returns the time until the next deadline of a connection, or
+ * max_time if it is further */
+time_type hs_closest_timeout(HttpServer* server, time_type max_time) {
+    HttpConnection* connection;
+    time_type now = get_time();
+    int i;
+
+    for(i = 0; i < HC_TIMER_COUNT; ++i) {
+        if(!list_empty(server->timers[i])) {
+            connection = list_front(server->timers[i]);
+            if(connection->deadline - now < max_time) {
+                max_time = connection->deadline - now;
+            }
+        }
+    }
+
+    return max_time < 0 ? 0 : max_time;
+}
+
+/*! \brief Close the connections past their deadline */
+void hs_check_timeout(HttpServer* server) {
+    static const MetricId metrics[HC_TIMER_COUNT] = {
+        METRIC_HTTP_CLOSED_HEADER_TIMEOUT,
+        METRIC_HTTP_CLOSED_BODY_TIMEOUT,
+        METRIC_HTTP_CLOSED_IDLE_TIMEOUT,
+        METRIC_HTTP_CLOSED_LINGER_TIMEOUT,
+        METRIC_HTTP_CLOSED_WEBSOCKET_TIMEOUT
+    };
+    HttpConnection* connection;
+    time_type now = get_time();
+    int i;
+
+    for(i = 0; i < HC_TIMER_COUNT; ++i) {
+        while(!list_empty(server->timers[i])) {
+            connection = list_front(server->timers[i]);
+            if(connection->deadline > now) {
+                break;
+            }
+
+            if(i == HC_TIMER_LINGER) {
+                metric_inc(metrics[i]);
+                log(INFO, "Http connection didn't close socket=%p",
+                        connection->sock);
+                hc_delete(connection);
+                continue;
+            }
+
+            /* a silent websocket gets a ping before it is given up */
+            if(i == HC_TIMER_WEBSOCKET && !connection->ws_pinged) {
+                hc_ws_send_frame(connection, WS_PING, NULL, 0);
+                connection->ws_pinged = 1;
+                hc_stop_timer(connection);
+                hc_update_timer(connection);
+                continue;
+            }
+
+            if(!connection->websocket && hc_last_request(connection)) {
+                metric_inc(METRIC_HTTP_CLOSED_MAX_REQUESTS);
+            } else {
+                metric_inc(metrics[i]);
+                log(INFO, "Http connection timed out socket=%p",
+                        connection->sock);
+            }
+
+            /* an answered connection may still be sending its responses */
+            if(i == HC_TIMER_IDLE) {
+                hc_close(connection);
+            } else {
+                hc_delete(connection);
+            }
+        }
+    }
+}
@@ -21,6 +21,7 @@
 #define HTTP_SERVER_H
 
 #include "socket_monitor.h"
+#include "socket.h"
 #include "http.h"
 //#include "http_header.h"
 #include "list.h"
@@ -43,13 +44,75 @@ typedef void(*hs_request_callback)(void* user_data, const HttpRequest* request);
 
 typedef void(*hc_close_callback)(void* user_data);
 
-HttpServer* hs_new(iks* config, hs_request_callback callback, void* user_data);
+typedef void(*hc_message_callback)(void* user_data, HttpConnection* connection,
+        const char* data, size_t size);
+
+typedef void(*hc_writable_callback)(void* user_data);
+
+/* websocket close codes (RFC 6455) */
+#define WS_CLOSE_NORMAL 1000
+#define WS_CLOSE_GOING_AWAY 1001
+#define WS_CLOSE_PROTOCOL_ERROR 1002
+#define WS_CLOSE_UNSUPPORTED 1003
+#define WS_CLOSE_TOO_BIG 1009
+#define WS_CLOSE_INTERNAL_ERROR 1011
+
+/* type of the messages passing connections between processes */
+#define HS_FORWARD_MESSAGE 100
+
+HttpServer* hs_new(iks* config, int listen_fd, hs_request_callback callback,
+        void* user_data);
+
+int hs_listen_fd(HttpServer* server);
+
+void hs_stop_accepting(HttpServer* server);
+
+void hs_start_accepting(HttpServer* server);
+
+time_type hs_closest_timeout(HttpServer* server, time_type max_time);
+
+void hs_check_timeout(HttpServer* server);
 
 void hc_set_close_callback(HttpConnection* connection,
         hc_close_callback callback, void* user_data);
 
+void hc_forward(HttpConnection* connection, int channel);
+
+int hc_accept_websocket(const HttpRequest* request, const char* protocol);
+
+void hc_set_message_callback(HttpConnection* connection,
+        hc_message_callback callback, void* user_data);
+
+void hc_set_writable_callback(HttpConnection* connection,
+        hc_writable_callback callback, void* user_data);
+
+int hc_is_writable(HttpConnection* connection);
+
+int hc_allow_session(HttpConnection* connection);
+
+const PeerAddress* hc_client(HttpConnection* connection);
+
+void hc_ws_send(HttpConnection* connection, char* msg, size_t size);
+
+void hc_ws_close(HttpConnection* connection, int code);
+
+void hs_set_inbox(HttpServer* server, int channel);
+
 void hs_delete(HttpServer* server);
 
+void hs_reserve(size_t connections);
+
 void hs_answer_request(HttpConnection* connection, char* msg, size_t size, const char* content_type);
 
+void hs_answer_request_ref(HttpConnection* connection, const char* msg,
+        size_t size, const char* content_type, ReleaseCallback release,
+        void* user_data);
+
+void hs_answer_raw(HttpConnection* connection, char* msg, size_t size);
+
+void hs_report_error(HttpConnection* connection, int code, const char* msg);
+
+void hs_report_retry(HttpConnection* connection, int code, int retry_after,
+        const char* msg);
+
 #endif
@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <malloc.h>
 
 #include <unistd.h>
 #include <sys/socket.h>
@@ -37,6 +38,10 @@
 #include "log.h"
 #include "allocator.h"
 #include "socket.h"
+#include "metrics.h"
+#include "handoff.h"
+#include "workers.h"
+#include "router.h"
 
 #define JABBER_PORT 5222
 
@@ -44,24 +49,82 @@
 
 #define DEFAULT_REQUEST_TIMEOUT (30000)
 
+#define HIBERNATE_TIMEOUT (30000)
+
+#define MAX_HOLD (2)
+
+/* seconds between the empty requests that push out a held one */
+#define POLLING (2)
+
+/* longest pause a client can ask for, in seconds */
+#define MAX_PAUSE (120)
+
+/* loop lag, in ms, above which new sessions are refused and above which
+ * no connection is accepted */
+#define SHED_SESSION_LAG (250)
+#define SHED_ACCEPT_LAG (1000)
+
+/* seconds a refused client is told to wait */
+#define RETRY_AFTER (5)
+
+/* how often the lag is measured while shedding, in ms */
+#define OVERLOAD_CHECK_INTERVAL (100)
+
+/* how long an upgrade waits for the sessions to finish their stanzas */
+#define UPGRADE_DRAIN_TIMEOUT (5000)
+
+/* how long the processes wait for each other during an upgrade */
+#define HANDOFF_TIMEOUT (10000)
+
+/* number of responses kept for retransmission, hold + 1 are used */
+#define RESPONSE_WINDOW (8)
+
+/* list nodes taken by a session: its requests, its queued stanzas, its
+ * connections and their output queues */
+#define RESERVE_LIST_NODES (8)
+
+#define QUEUE_BUDGET (256 * 1024)
+
+#define QUEUE_LOW_WATER (64 * 1024)
+
+/* queued bytes that are answered without waiting for the batch window */
+#define BATCH_BYTES (16 * 1024)
+
 #define JABBER_HEADER "<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' to='%s' xml:lang='en'>"
 //#define JABBER_HEADER "<stream:stream xmlns='jabber:client' version='1.0' xmlns:stream='http://etherx.jabber.org/streams' to='%s' xml:lang='en'>"
 
+/* fed to a new parser when a hibernated session wakes up */
+#define RESUME_HEADER "<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>"
+
 #define MESSAGE_WRAPPER "<body xmlns:stream='http://etherx.jabber.org/streams' xmlns='http://jabber.org/protocol/httpbind'>%s</body>"
 
 #define EMPTY_RESPONSE "<body xmlns='http://jabber.org/protocol/httpbind'/>"
 
-#define SESSION_RESPONSE "<body sid='%" PRId64 "' ver='1.6' xmlns='http://jabber.org/protocol/httpbind'/>"
+#define SESSION_RESPONSE "<body sid='%" PRId64 "' hold='%d' requests='%d' polling='%d' inactivity='%d' maxpause='%d' ver='1.6' xmlns='http://jabber.org/protocol/httpbind'/>"
 
 #define TERMINATE_SESSION_RESPONSE "<body type='terminate' xmlns='http://jabber.org/protocol/httpbind'/>"
 
 #define ERROR_RESPONSE "<body type='%s' condition='%s' xmlns='http://jabber.org/protocol/httpbind'/>"
 
-#define STATUS_HTML "<html><body>" \
-                        "<p>Uptime: %s</p>" \
-                        "<p>Clients: %d</p>" \
-                        "<p>Maximum clients: %d</p>" \
-                    "</body></html>"
+#define METRICS_PATH "/metrics"
+
+#define MEMORY_PATH "/memory"
+
+#define WEBSOCKET_PATH "/xmpp-websocket"
+
+/* XMPP over WebSocket (RFC 7395) */
+#define WEBSOCKET_PROTOCOL "xmpp"
+
+#define FRAMING_NS "urn:ietf:params:xml:ns:xmpp-framing"
+
+#define STREAM_NS "http://etherx.jabber.org/streams"
+
+/* websocket clients negotiate the stream features themselves */
+#define WEBSOCKET_JABBER_HEADER "<stream:stream xmlns='jabber:client' version='1.0' xmlns:stream='http://etherx.jabber.org/streams' to='%s' xml:lang='en'>"
+
+#define WEBSOCKET_CLOSE "<close xmlns='urn:ietf:params:xml:ns:xmpp-framing'/>"
+
+#define JABBER_STREAM_END "</stream:stream>"
 
 static inline int compare_sid(uint64_t s1, uint64_t s2) {
     return s1 == s2;
@@ -78,28 +141,113 @@ IMPLEMENT_HASH(uint64);
 enum BIND_ERROR_CODE {
     SID_NOT_FOUND = 0,
     BAD_FORMAT = 1,
-    CONNECTION_FAILED = 2
+    CONNECTION_FAILED = 2,
+    BAD_RID = 3,
+    POLICY_VIOLATION = 4
 };
 
 const char ERROR_TABLE[][2][64] = {
     {"terminate", "item-not-found"},
     {"terminate", "bad-request"},
-    {"terminate", "host-gone"}
+    {"terminate", "host-gone"},
+    {"terminate", "item-not-found"},
+    {"terminate", "policy-violation"}
 };
 
 volatile int running;
 
+volatile int upgrade_requested;
+
+/* Messages sent to the new process on an upgrade */
+enum HANDOFF_MESSAGE {
+    HANDOFF_LISTEN,             /* the listening socket                       */
+    HANDOFF_SESSION,            /* a HandoffSession and the jabber socket     */
+    HANDOFF_QUEUE,              /* queued stanzas of the last session         */
+    HANDOFF_END,                /* no more sessions                           */
+    HANDOFF_READY               /* the new process took everything            */
+};
+
+/* Layout of HandoffSession, bump it when the struct changes */
+#define HANDOFF_VERSION (1)
+
+/* State of a session sent to the new process */
+typedef struct HandoffSession {
+    uint32_t version;           /* HANDOFF_VERSION of the sender              */
+    uint32_t size;              /* sizeof(HandoffSession) of the sender       */
+    uint64_t sid, rid;
+    time_type wait;
+    int hold;
+    time_type idle;             /* time since the last activity               */
+    time_type upstream_idle;    /* time since the last data from the server   */
+} HandoffSession;
+
+enum STREAM_TRACKER_STATE {
+    TRACKER_TEXT,
+    TRACKER_TAG_OPEN,
+    TRACKER_START_TAG,
+    TRACKER_END_TAG,
+    TRACKER_DECLARATION,
+    TRACKER_LOST
+};
+
+/* Follows the depth of the jabber stream, so we know when the parser is
+ * between two stanzas and can be thrown away. It only looks at the tag
+ * delimiters and quotes. If it sees anything it doesn't understand, like a
+ * CDATA section, it gives up and the session is never hibernated. */
+typedef struct StreamTracker {
+    int depth;                  /* 1 means between stanzas                */
+    char state;                 /* one of STREAM_TRACKER_STATE            */
+    char quote;                 /* quote of the current attribute value   */
+    char last;                  /* last char of the tag outside quotes    */
+} StreamTracker;
+
+/* A request held by the connection manager until there is data to send */
+typedef struct HeldRequest {
+    HttpConnection* connection; /* http connection of the request             */
+    uint64_t rid;               /* rid of the request                         */
+    time_type timestamp;        /* when the request arrived                   */
+    int64_t start;              /* when the request arrived, in nanoseconds   */
+    list_iterator it;           /* pointer to this request in the session     */
+    struct JabberClient* j_client; /* the session of the request              */
+} HeldRequest;
+
+/* A response kept in case the client repeats the rid. It is shared by the
+ * session and the sockets sending it, and freed by the last one. */
+typedef struct CachedResponse {
+    uint64_t rid;               /* rid of the answered request                */
+    int refs;                   /* number of references                       */
+    char* body;                 /* the serialized response                    */
+    size_t len;                 /* length of the response                     */
+} CachedResponse;
+
 typedef struct JabberClient {
     iksparser* parser;          /* jabber stream parser from iksemel          */
     Socket* sock;               /* socket of the jabber connection            */
     uint64_t sid, rid;          /* rid and sid of the BOSH session            */
-    HttpConnection* connection; /* http connection of the pending request     */
+    list* requests;             /* held requests, sorted by rid               */
+    int hold;                   /* maximum number of held requests            */
     list* output_queue;         /* queue of messages to be sent to the client */
     int alive;                  /* 1 if the connection is alive, 0 otherwise  */
     time_type timestamp;        /* last activity in the session               */
     time_type wait;             /* maximum time to hold a request             */
 	list_iterator it;           /* pointer to this client in the client list  */
 	struct JabberBind* bind;    /* pointer to the bund struct                 */
+    int64_t connect_start;      /* when the connection to the server started  */
+    int64_t queue_start;        /* when the oldest queued stanza arrived      */
+    time_type upstream_timestamp; /* last data from the jabber server         */
+    StreamTracker tracker;      /* position of the parser in the stream       */
+    size_t memory;              /* memory of the parser and stanzas           */
+    size_t queued_bytes;        /* memory used by the queued stanzas          */
+    int over_budget;            /* 1 if queued_bytes went over the budget     */
+    CachedResponse* responses[RESPONSE_WINDOW]; /* recent responses, by rid   */
+    HttpConnection* websocket;  /* the client connection of a websocket
+                                   session, NULL for bosh                     */
+    time_type last_poll;        /* last empty request over the hold           */
+    time_type pause_until;      /* the session is paused until then           */
+    uint64_t forwarded;         /* last rid whose payload was processed       */
+    list* early;                /* bodies ahead of a missing rid, by rid, NULL
+                                   until one comes                            */
+    list_iterator batch_it;     /* position in the batch windows, or NULL     */
 } JabberClient;
 
 
@@ -109,49 +257,467 @@ struct JabberBind {
 	HttpServer* server;          /* pointer to the http server                */
 
     int jabber_port;             /* port to connect to the jabber server      */
+    char* jabber_path;           /* unix socket of the jabber server or NULL  */
+    SocketOptions tcp_options;   /* tcp options of the jabber connections     */
     int session_timeout;         /* bosh session timeout                      */
     time_type start_time;        /* the time when the server started          */
     int client_count;            /* number of active connections              */
     int max_client_count;        /* the maximum number of clients achieved    */
+    char* metrics_path;          /* http path of the metrics page             */
+    char* memory_path;           /* http path of the memory breakdown         */
+    time_type hibernate_timeout; /* idle time before a session hibernates     */
+    int max_hold;                /* maximum hold accepted from the clients    */
+    int polling;                 /* seconds between empty requests, 0 is off  */
+    int max_pause;               /* longest pause accepted, in seconds        */
+    time_type shed_session_lag;  /* refuse new sessions above this loop lag   */
+    time_type shed_accept_lag;   /* stop accepting above this loop lag        */
+    int retry_after;             /* seconds a refused client should wait      */
+    int overload;                /* 0 normal, 1 refusing sessions, 2 not
+                                    accepting either                          */
+    int upgrading;               /* 1 if waiting to hand off the sessions     */
+    time_type upgrade_deadline;  /* when to hand off the sessions anyway      */
+    size_t queue_budget;         /* stop reading the server above this        */
+    size_t queue_low_water;      /* start reading again below this            */
+    time_type batch_delay;       /* wait for more stanzas before answering    */
+    size_t batch_bytes;          /* answer right away above this              */
+    list* batches;               /* sessions in their batch window, oldest
+                                    first                                     */
+    int node;                    /* node id put in the sids, -1 if none       */
+    char* websocket_path;        /* http path of the websocket endpoint       */
 };
 
 /* Allocators */
 DECLARE_ALLOCATOR(JabberClient);
 IMPLEMENT_ALLOCATOR(JabberClient);
 
+DECLARE_ALLOCATOR(HeldRequest);
+IMPLEMENT_ALLOCATOR(HeldRequest);
+
+DECLARE_ALLOCATOR(CachedResponse);
+IMPLEMENT_ALLOCATOR(CachedResponse);
+
+/* The owner of the memory allocated by iksemel, all allocations made while
+ * it is set are accounted to that session. */
+static JabberClient* iks_owner = NULL;
+
+/*! \brief Allocate memory for iksemel */
+static void* jb_iks_malloc(size_t size) {
+    void* ptr = malloc(size);
+
+    if(iks_owner != NULL && ptr != NULL) {
+        size = malloc_usable_size(ptr);
+        iks_owner->memory += size;
+        metric_add(METRIC_SESSION_MEMORY_BYTES, size);
+    }
+
+    return ptr;
+}
+
+/*! \brief Free memory allocated by iksemel */
+static void jb_iks_free(void* ptr) {
+    size_t size;
+
+    if(iks_owner != NULL && ptr != NULL) {
+        size = malloc_usable_size(ptr);
+        iks_owner->memory -= size;
+        metric_add(METRIC_SESSION_MEMORY_BYTES, -(int64_t)size);
+    }
+
+    free(ptr);
+}
+
+/*! \brief Account the next iksemel allocations to the given session
+ *
+ * Returns the previous owner, to be restored with jc_release_memory. */
+static inline JabberClient* jc_own_memory(JabberClient* j_client) {
+    JabberClient* previous = iks_owner;
+    iks_owner = j_client;
+    return previous;
+}
+
+/*! \brief Restore the previous owner of the iksemel allocations */
+static inline void jc_release_memory(JabberClient* previous) {
+    iks_owner = previous;
+}
+
+/*! \brief Returns the memory used by a stanza */
+static size_t jc_stanza_size(iks* stanza) {
+    size_t allocated, used;
+
+    iks_stack_stat(iks_stack(stanza), &allocated, &used);
+
+    return allocated;
+}
+
+/*! \brief Follow the depth of the jabber stream */
+static void jc_track_stream(StreamTracker* tracker, const char* buffer,
+        size_t len) {
+    const char* end = buffer + len;
+    char c;
+
+    while(buffer != end && tracker->state != TRACKER_LOST) {
+        if(tracker->state == TRACKER_TEXT) {
+            /* skip the text until the next tag */
+            buffer = memchr(buffer, '<', end - buffer);
+            if(buffer == NULL) {
+                break;
+            }
+            tracker->state = TRACKER_TAG_OPEN;
+            ++buffer;
+            continue;
+        }
+
+        c = *buffer++;
+        switch(tracker->state) {
+            case TRACKER_TAG_OPEN:
+                if(c == '/') {
+                    tracker->state = TRACKER_END_TAG;
+                } else if(c == '?') {
+                    tracker->state = TRACKER_DECLARATION;
+                } else if(c == '!') {
+                    /* comments and CDATA sections */
+                    tracker->state = TRACKER_LOST;
+                } else {
+                    tracker->state = TRACKER_START_TAG;
+                    tracker->quote = 0;
+                    tracker->last = c;
+                }
+                break;
+            case TRACKER_START_TAG:
+                if(tracker->quote != 0) {
+                    if(c == tracker->quote) {
+                        tracker->quote = 0;
+                    }
+                } else if(c == '\'' || c == '"') {
+                    tracker->quote = c;
+                } else if(c == '>') {
+                    if(tracker->last != '/') {
+                        tracker->depth++;
+                    }
+                    tracker->state = TRACKER_TEXT;
+                } else {
+                    tracker->last = c;
+                }
+                break;
+            case TRACKER_END_TAG:
+                if(c == '>') {
+                    tracker->depth--;
+                    tracker->state = TRACKER_TEXT;
+                }
+                break;
+            case TRACKER_DECLARATION:
+                if(c == '>') {
+                    tracker->state = TRACKER_TEXT;
+                }
+                break;
+        }
+    }
+}
+
+/*! \brief Returns 1 if the jabber stream is between two stanzas */
+static int jc_between_stanzas(JabberClient* j_client) {
+    return j_client->websocket == NULL &&
+        sock_status(j_client->sock) == SOCKET_CONNECTED &&
+        j_client->tracker.depth == 1 &&
+        j_client->tracker.state == TRACKER_TEXT;
+}
+
+/*! \brief Returns 1 if the session can be handed to another process
+ *
+ * It must be between two stanzas, so the new process can resume the stream
+ * with a new parser, and everything we queued to the jabber server must be
+ * sent, the queue is not handed over. */
+static int jc_handoff_ready(JabberClient* j_client) {
+    return jc_between_stanzas(j_client) &&
+        sock_queued_bytes(j_client->sock) == 0 &&
+        (j_client->early == NULL || list_empty(j_client->early));
+}
+
+/*! \brief Pause or resume reading the jabber server
+ *
+ * We don't read while the session queue is over budget. When upgrading, we
+ * read until the end of the current stanza and stop. */
+static void jc_update_recv(JabberClient* j_client) {
+    int pause;
+
+    if(j_client->bind->upgrading) {
+        pause = jc_between_stanzas(j_client);
+    } else {
+        pause = j_client->over_budget;
+    }
+
+    if(pause && !sock_recv_paused(j_client->sock)) {
+        sock_pause_recv(j_client->sock);
+    } else if(!pause && sock_recv_paused(j_client->sock)) {
+        sock_resume_recv(j_client->sock);
+    }
+}
+
+/*! \brief Read data from the jabber server
+ *
+ * When upgrading, never read past the end of the current stanza. */
+static ssize_t jc_recv(JabberClient* j_client, char* buffer, size_t len) {
+    StreamTracker tracker;
+    ssize_t bytes, i;
+
+    if(j_client->bind->upgrading) {
+        bytes = sock_peek(j_client->sock, buffer, len);
+        tracker = j_client->tracker;
+        for(i = 0; i < bytes && tracker.state != TRACKER_LOST; ++i) {
+            jc_track_stream(&tracker, buffer + i, 1);
+            if(tracker.depth == 1 && tracker.state == TRACKER_TEXT) {
+                len = i + 1;
+                break;
+            }
+        }
+    }
+
+    return sock_recv(j_client->sock, buffer, len);
+}
+
+/*! \brief Handle the upgrade signal */
+void handle_upgrade_signal(int signal) {
+    upgrade_requested = 1;
+}
+
 /*! \brief Handle exit signals */
 void handle_signal(int signal) {
     log(INFO, "signal caught %d", signal);
     running = 0;
 }
 
+/*! \brief Returns the ms the queued stanzas can still wait for more
+ *
+ * Returns 0 if they should be sent now, when there is no batch window, the
+ * window is over or enough is queued already. */
+static time_type jc_batch_remaining(JabberClient* j_client, int64_t now) {
+    JabberBind* bind = j_client->bind;
+    int64_t waited;
+
+    if(bind->batch_delay == 0 || j_client->websocket != NULL ||
+            j_client->output_queue == NULL ||
+            list_empty(j_client->output_queue) ||
+            j_client->queued_bytes >= bind->batch_bytes) {
+        return 0;
+    }
+
+    waited = now - j_client->queue_start;
+    if(waited >= bind->batch_delay * 1000000ll) {
+        return 0;
+    }
+
+    /* round up, the window must be over when the poll returns */
+    return bind->batch_delay - waited / 1000000ll;
+}
+
+/*! \brief Start the batch window, the queue of the session just got a stanza
+ *
+ * The window has a fixed length, so the sessions are kept in the order they
+ * start it and only the first one is checked. */
+static void jc_batch_start(JabberClient* j_client) {
+    JabberBind* bind = j_client->bind;
+
+    if(bind->batch_delay == 0 || j_client->websocket != NULL ||
+            j_client->batch_it != NULL) {
+        return;
+    }
+    j_client->batch_it = list_push_back(bind->batches, j_client);
+}
+
+/*! \brief End the batch window of a session */
+static void jc_batch_stop(JabberClient* j_client) {
+    if(j_client->batch_it != NULL) {
+        list_erase(j_client->batch_it);
+        j_client->batch_it = NULL;
+    }
+}
+
 /*! \brief Return the time remaning to the nearest possible timeout  */
 time_type jb_closest_timeout(JabberBind* bind) {
-    list_iterator it;
+    list_iterator it, req_it;
     JabberClient* j_client;
+    HeldRequest* request;
     time_type closest, tmp, current;
+    int64_t now;
 
     closest = bind->session_timeout;
     current = get_time();
+    now = get_time_ns();
+
+    /* the first batch window to end */
+    if(!list_empty(bind->batches)) {
+        tmp = jc_batch_remaining(list_front(bind->batches), now);
+        if(tmp < closest) {
+            closest = tmp;
+        }
+    }
 
     /* check each connection */
     list_foreach(it, bind->jabber_connections) {
         j_client = list_iterator_value(it);
-        if(j_client->connection != NULL) {
-            /* we have a request, so the timeout is the request timeout */
-            tmp = (j_client->timestamp + j_client->wait) - current;
-        } else {
+        if(!list_empty(j_client->requests)) {
+            /* we have requests, so the timeout is the oldest request
+             * timeout */
+            list_foreach(req_it, j_client->requests) {
+                request = list_iterator_value(req_it);
+                tmp = (request->timestamp + j_client->wait) - current;
+                if(tmp < closest) {
+                    closest = tmp;
+                }
+            }
+        } else if(j_client->websocket == NULL) {
             /* we don't have a request, so the timeout is the session timeout */
             tmp = (j_client->timestamp + bind->session_timeout) - current;
-        }
-        if(tmp < closest) {
-            closest = tmp;
+            if(j_client->pause_until - current > tmp) {
+                tmp = j_client->pause_until - current;
+            }
+            if(tmp < closest) {
+                closest = tmp;
+            }
         }
     }
 
     return closest;
 }
 
+/*! \brief Remove a request from the session and free it
+ *
+ * Returns the http connection of the request */
+static HttpConnection* jc_release_request(HeldRequest* request) {
+    HttpConnection* connection = request->connection;
+
+    list_erase(request->it);
+    HeldRequest_free(request);
+    metric_dec(METRIC_HELD_REQUESTS);
+
+    return connection;
+}
+
+/*! \brief Drop a reference to a cached response */
+static void jc_response_unref(void* _response) {
+    CachedResponse* response = _response;
+
+    if(--response->refs == 0) {
+        free(response->body);
+        CachedResponse_free(response);
+    }
+}
+
+/*! \brief Answer a held request and keep the response in the window
+ *
+ * The ownership of the body is passed to the window. */
+static void jc_answer_request(HeldRequest* request, char* body) {
+    JabberClient* j_client = request->j_client;
+    CachedResponse* response;
+    CachedResponse** slot;
+
+    /* one reference for the window and one for the socket */
+    response = CachedResponse_alloc();
+    response->rid = request->rid;
+    response->refs = 2;
+    response->body = body;
+    response->len = strlen(body);
+
+    /* replace the response hold + 1 rids ago */
+    slot = &j_client->responses[request->rid % (j_client->hold + 1)];
+    if(*slot != NULL) {
+        jc_response_unref(*slot);
+    }
+    *slot = response;
+
+    hs_answer_request_ref(jc_release_request(request), response->body,
+            response->len, HTTP_XML_CONTENT, jc_response_unref, response);
+}
+
+/*! \brief Answer a repeated rid from the window
+ *
+ * Returns 1 if the response was found and sent, 0 otherwise */
+static int jc_resend_response(JabberClient* j_client,
+        HttpConnection* connection, uint64_t rid) {
+    CachedResponse* response;
+
+    response = j_client->responses[rid % (j_client->hold + 1)];
+    if(response == NULL || response->rid != rid) {
+        return 0;
+    }
+
+    log(INFO, "Resending response sid=%" PRId64 " rid=%" PRId64,
+            j_client->sid, rid);
+    metric_inc(METRIC_RESPONSES_RESENT);
+
+    response->refs++;
+    hs_answer_request_ref(connection, response->body, response->len,
+            HTTP_XML_CONTENT, jc_response_unref, response);
+
+    return 1;
+}
+
+/*! \brief Let the server send more once the queue drained */
+static void jc_queue_drained(JabberClient* j_client) {
+    if(j_client->over_budget &&
+            j_client->queued_bytes <= j_client->bind->queue_low_water) {
+        j_client->over_budget = 0;
+        jc_update_recv(j_client);
+        metric_dec(METRIC_UPSTREAM_PAUSED);
+        log(DEBUG, "Resumed reading the jabber server sid=%" PRId64,
+                j_client->sid);
+    }
+}
+
+/*! \brief Put the namespaces of the stream on a stanza sent on its own */
+static void jc_qualify_stanza(iks* stanza) {
+    if(strncmp(iks_name(stanza), "stream:", 7) == 0) {
+        iks_insert_attrib(stanza, "xmlns:stream", STREAM_NS);
+    } else if(iks_find_attrib(stanza, "xmlns") == NULL) {
+        iks_insert_attrib(stanza, "xmlns", "jabber:client");
+    }
+}
+
+/*! \brief Send the queued stanzas on the websocket, one message each */
+static void jc_flush_websocket(JabberClient* j_client) {
+    JabberClient* owner;
+    iks* stanza;
+    char* xml;
+    char* msg;
+    size_t n;
+
+    if(j_client->output_queue == NULL || list_empty(j_client->output_queue)) {
+        return;
+    }
+
+    latency_record(LATENCY_QUEUE, get_time_ns() - j_client->queue_start);
+
+    /* a slow client keeps the rest queued, the budget stops the server */
+    owner = jc_own_memory(j_client);
+    while(!list_empty(j_client->output_queue) &&
+            hc_is_writable(j_client->websocket)) {
+        stanza = list_pop_front(j_client->output_queue);
+        metric_dec(METRIC_OUTPUT_QUEUE_STANZAS);
+        n = jc_stanza_size(stanza);
+        j_client->queued_bytes -= n;
+        metric_add(METRIC_OUTPUT_QUEUE_BYTES, -(int64_t)n);
+
+        jc_qualify_stanza(stanza);
+        xml = iks_string(NULL, stanza);
+        n = strlen(xml);
+        msg = malloc(n);
+        memcpy(msg, xml, n);
+        iks_free(xml);
+        iks_delete(stanza);
+
+        hc_ws_send(j_client->websocket, msg, n);
+    }
+    jc_release_memory(owner);
+
+    if(!list_empty(j_client->output_queue)) {
+        j_client->queue_start = get_time_ns();
+    }
+
+    jc_queue_drained(j_client);
+
+    j_client->timestamp = get_time();
+}
+
 /*! \brief Flush pending messages to the client */
 void jc_flush_messages(JabberClient* j_client) {
     char* xml;
@@ -161,9 +727,20 @@ void jc_flush_messages(JabberClient* j_client) {
     iks* msg;
     list* xmls;
     int size, n;
+    int64_t now;
+    JabberClient* owner;
+    HeldRequest* request;
+
+    if(j_client->websocket != NULL) {
+        jc_flush_websocket(j_client);
+        return;
+    }
 
     /* check if there is a pending request and if there is any data to send */
-    if(j_client->connection != NULL && !list_empty(j_client->output_queue)) {
+    if(!list_empty(j_client->requests) && j_client->output_queue != NULL &&
+            !list_empty(j_client->output_queue)) {
+
+        owner = jc_own_memory(j_client);
 
         size = 0;
         xmls = list_new();
@@ -171,6 +748,10 @@ void jc_flush_messages(JabberClient* j_client) {
         /* foreach message, convert to string and sum the size */
         while(!list_empty(j_client->output_queue)) {
             msg = list_pop_front(j_client->output_queue);
+            metric_dec(METRIC_OUTPUT_QUEUE_STANZAS);
+            n = jc_stanza_size(msg);
+            j_client->queued_bytes -= n;
+            metric_add(METRIC_OUTPUT_QUEUE_BYTES, -(int64_t)n);
             xml = iks_string(NULL, msg);
             list_push_back(xmls, xml);
             size += strlen(xml);
@@ -191,16 +772,27 @@ void jc_flush_messages(JabberClient* j_client) {
         *ptr = 0;
         list_delete(xmls, NULL);
 
+        jc_release_memory(owner);
+
+        /* the queue drained, let the server send more */
+        jc_queue_drained(j_client);
+        jc_batch_stop(j_client);
+
         /* create http content */
         asprintf(&body, MESSAGE_WRAPPER, buffer);
 
         log(INFO, "Request response sid=%" PRId64 " message: %s",
                 j_client->sid, body);
 
-        /* send messages */
-        hs_answer_request(j_client->connection, body, strlen(body),
-                HTTP_XML_CONTENT);
-        j_client->connection = NULL;
+        metric_inc(METRIC_RESPONSES_DATA);
+        metric_observe(HISTOGRAM_RESPONSE_BYTES, strlen(body));
+        now = get_time_ns();
+        latency_record(LATENCY_QUEUE, now - j_client->queue_start);
+
+        /* send messages on the request with the lowest rid */
+        request = list_front(j_client->requests);
+        latency_record(LATENCY_HOLD_DATA, now - request->start);
+        jc_answer_request(request, body);
 
         /* update last activity */
         j_client->timestamp = get_time();
@@ -210,24 +802,27 @@ void jc_flush_messages(JabberClient* j_client) {
 }
 
 /*! \brief Answer a request with an empty body */
-void jc_drop_request(JabberClient* j_client, int terminate) {
+void jc_drop_request(HeldRequest* request, int terminate) {
+    JabberClient* j_client = request->j_client;
     char* body;
 
     /* if terminate is true, send a notification that the session
      * is been closed */
     if(terminate) {
         asprintf(&body, TERMINATE_SESSION_RESPONSE);
+        metric_inc(METRIC_RESPONSES_TERMINATE);
     } else {
         asprintf(&body, EMPTY_RESPONSE);
+        metric_inc(METRIC_RESPONSES_EMPTY);
     }
+    metric_observe(HISTOGRAM_RESPONSE_BYTES, strlen(body));
+    latency_record(LATENCY_HOLD_EMPTY, get_time_ns() - request->start);
 
     log(INFO, "Request response sid=%" PRId64 " message: %s", j_client->sid,
             body);
 
     /* answer the request */
-    hs_answer_request(j_client->connection, body, strlen(body),
-            HTTP_XML_CONTENT);
-    j_client->connection = NULL;
+    jc_answer_request(request, body);
 
     /* update last activity */
     j_client->timestamp = get_time();
@@ -242,17 +837,52 @@ static void _iks_delete(void* _iks) {
 /*! \brief Close a connection to the jabber server */
 void jb_close_client(JabberClient* j_client) {
     JabberBind* bind = j_client->bind;
+    JabberClient* owner;
+    int i;
 
     log(INFO, "Connection closed sid=%" PRId64, j_client->sid);
 
-    /* drop the request if we have one */
-    if(j_client->connection != NULL) {
-        jc_drop_request(j_client, 1);
+    /* drop the requests we are holding */
+    while(!list_empty(j_client->requests)) {
+        jc_drop_request(list_front(j_client->requests), 1);
+    }
+    list_delete(j_client->requests, NULL);
+
+    /* end the websocket stream, the connection outlives the session */
+    if(j_client->websocket != NULL) {
+        hc_set_close_callback(j_client->websocket, NULL, NULL);
+        hc_ws_send(j_client->websocket, strdup(WEBSOCKET_CLOSE),
+                strlen(WEBSOCKET_CLOSE));
+        hc_ws_close(j_client->websocket, WS_CLOSE_NORMAL);
+        metric_dec(METRIC_WEBSOCKET_SESSIONS);
     }
 
-    /* free iks struct */
-    iks_disconnect(j_client->parser);
-    iks_parser_delete(j_client->parser);
+    /* release the responses window */
+    for(i = 0; i < RESPONSE_WINDOW; ++i) {
+        if(j_client->responses[i] != NULL) {
+            jc_response_unref(j_client->responses[i]);
+        }
+    }
+
+    jc_batch_stop(j_client);
+
+    /* the bodies waiting for a missing rid were parsed without an owner */
+    if(j_client->early != NULL) {
+        list_delete(j_client->early, _iks_delete);
+    }
+
+    owner = jc_own_memory(j_client);
+
+    /* free iks struct, it is NULL if the session is hibernated */
+    if(j_client->parser != NULL) {
+        iks_parser_delete(j_client->parser);
+    } else {
+        metric_dec(METRIC_SESSIONS_HIBERNATED);
+    }
+
+    if(j_client->over_budget) {
+        metric_dec(METRIC_UPSTREAM_PAUSED);
+    }
 
     if(j_client->sock != NULL) {
         sock_delete(j_client->sock);
@@ -261,20 +891,58 @@ void jb_close_client(JabberClient* j_client) {
     /* erase the client from the list of clients */
     list_erase(j_client->it);
     bind->client_count --;
+    metric_dec(METRIC_SESSIONS);
 
     /* erase the client's sid */
     uint64_hash_erase(bind->sids, j_client->sid);
 
     /* free client struct */
-    list_delete(j_client->output_queue, _iks_delete);
+    if(j_client->output_queue != NULL) {
+        metric_add(METRIC_OUTPUT_QUEUE_STANZAS,
+                -list_size(j_client->output_queue));
+        metric_add(METRIC_OUTPUT_QUEUE_BYTES, -(int64_t)j_client->queued_bytes);
+        list_delete(j_client->output_queue, _iks_delete);
+    }
+    jc_release_memory(owner);
+    metric_add(METRIC_SESSION_MEMORY_BYTES, -(int64_t)j_client->memory);
     JabberClient_free(j_client);
 }
 
+/*! \brief Release the parser and the queue of an idle session
+ *
+ * This is only done between two stanzas, so a new parser can pick up the
+ * stream when the server sends more data. */
+void jc_hibernate(JabberClient* j_client) {
+    JabberClient* owner;
+    size_t memory = j_client->memory;
+
+    if(j_client->tracker.depth != 1 ||
+            j_client->tracker.state != TRACKER_TEXT) {
+        return;
+    }
+
+    owner = jc_own_memory(j_client);
+    iks_parser_delete(j_client->parser);
+    jc_release_memory(owner);
+    j_client->parser = NULL;
+
+    list_delete(j_client->output_queue, NULL);
+    j_client->output_queue = NULL;
+
+    metric_inc(METRIC_SESSIONS_HIBERNATED);
+    metric_inc(METRIC_HIBERNATIONS);
+
+    log(DEBUG, "Session hibernated sid=%" PRId64 " memory=%zu->%zu",
+            j_client->sid, memory, j_client->memory);
+}
+
 /*! \brief Check timeouts and handle them */
 void jb_check_timeout(JabberBind* bind) {
     JabberClient* j_client;
-    list_iterator it;
+    list_iterator it, req_it;
+    HeldRequest* request;
     time_type init, idle;
+    int64_t now;
     list* to_close;
 
     /* list of connections that are to be closed */
@@ -282,24 +950,56 @@ void jb_check_timeout(JabberBind* bind) {
 
     /* get current time */
     init = get_time();
+    now = get_time_ns();
+
+    /* answer with the stanzas that waited for the batch window, without a
+     * request they go with the next one */
+    while(!list_empty(bind->batches)) {
+        j_client = list_front(bind->batches);
+        if(jc_batch_remaining(j_client, now) > 0) {
+            break;
+        }
+        jc_batch_stop(j_client);
+        if(!list_empty(j_client->requests)) {
+            metric_inc(METRIC_TIMEOUTS_BATCH);
+            jc_flush_messages(j_client);
+        }
+    }
 
     /* check each connection for a timeout */
     list_foreach(it, bind->jabber_connections) {
         j_client = list_iterator_value(it);
 
+        /* drop the timedout requests */
+        req_it = list_begin(j_client->requests);
+        while(req_it != list_end(j_client->requests)) {
+            request = list_iterator_value(req_it);
+            req_it = list_next(req_it);
+            if(init - request->timestamp >= j_client->wait) {
+                metric_inc(METRIC_TIMEOUTS_REQUEST);
+                jc_drop_request(request, 0);
+            }
+        }
+
         idle = init - j_client->timestamp;
-        if(j_client->connection != NULL && idle >= j_client->wait) {
-            /* we have a timedout request, drop it */
-            jc_drop_request(j_client, 0);
-        } else if(j_client->connection == NULL &&
-                  idle >= bind->session_timeout) {
+        if(list_empty(j_client->requests) && j_client->websocket == NULL &&
+                  idle >= bind->session_timeout &&
+                  init >= j_client->pause_until) {
             /* we don't have a request and the session is idle for too long,
              * close the session */
             log(WARNING, "timeout on sid=%" PRId64, j_client->sid);
+            metric_inc(METRIC_TIMEOUTS_SESSION);
             /* don't really close it right now, because our pointer to the list
              * will became invalid if we do so, put it on a list so we can
              * close it after we check all clients */
             list_push_back(to_close, j_client);
+        } else if(j_client->parser != NULL && bind->hibernate_timeout > 0 &&
+                  list_empty(j_client->output_queue) &&
+                  idle >= bind->hibernate_timeout &&
+                  init - j_client->upstream_timestamp >=
+                  bind->hibernate_timeout) {
+            /* nothing happened for a while, release the parser */
+            jc_hibernate(j_client);
         }
     }
 
@@ -313,15 +1013,70 @@ void jb_check_timeout(JabberBind* bind) {
     list_delete(to_close, NULL);
 }
 
+/*! \brief Send the stream header of the server to a websocket client */
+static void jc_websocket_open(JabberClient* j_client, iks* stream) {
+    static const char* attribs[] = {"from", "id", "version", "xml:lang"};
+    iks* open;
+    char* xml;
+    char* msg;
+    size_t n;
+    int i;
+
+    open = iks_new("open");
+    iks_insert_attrib(open, "xmlns", FRAMING_NS);
+    for(i = 0; i < sizeof(attribs) / sizeof(attribs[0]); ++i) {
+        if(iks_find_attrib(stream, attribs[i]) != NULL) {
+            iks_insert_attrib(open, attribs[i],
+                    iks_find_attrib(stream, attribs[i]));
+        }
+    }
+
+    xml = iks_string(NULL, open);
+    n = strlen(xml);
+    msg = malloc(n);
+    memcpy(msg, xml, n);
+    iks_free(xml);
+    iks_delete(open);
+
+    hc_ws_send(j_client->websocket, msg, n);
+}
+
 /*! Handle an incoming message from the jabber server */
 int jc_handle_stanza(void* _j_client, int type, iks* stanza) {
     JabberClient* j_client = _j_client;
+    size_t size;
+
     /* no message ? */
     if(stanza == NULL) {
         /* do nothing */
     } else if(type == IKS_NODE_NORMAL) {
         /* queue up a normal message */
+        if(list_empty(j_client->output_queue)) {
+            j_client->queue_start = get_time_ns();
+            jc_batch_start(j_client);
+        }
         list_push_back(j_client->output_queue, stanza);
+        metric_inc(METRIC_OUTPUT_QUEUE_STANZAS);
+        metric_inc(METRIC_UPSTREAM_STANZAS_RECEIVED);
+
+        /* the client is not polling, leave the rest in the kernel buffers
+         * so the server feels the backpressure */
+        size = jc_stanza_size(stanza);
+        j_client->queued_bytes += size;
+        metric_add(METRIC_OUTPUT_QUEUE_BYTES, size);
+        if(j_client->queued_bytes > j_client->bind->queue_budget &&
+                !j_client->over_budget) {
+            j_client->over_budget = 1;
+            jc_update_recv(j_client);
+            metric_inc(METRIC_UPSTREAM_PAUSED);
+            metric_inc(METRIC_UPSTREAM_PAUSES);
+            log(INFO, "Paused reading the jabber server sid=%" PRId64
+                    " queued=%zu", j_client->sid, j_client->queued_bytes);
+        }
+    } else if(type == IKS_NODE_START && j_client->websocket != NULL) {
+        /* websocket clients get the stream header as an open element */
+        jc_websocket_open(j_client, stanza);
+        iks_delete(stanza);
     } else if(type == IKS_NODE_ERROR || type == IKS_NODE_STOP) {
         /* close the connection in case of error or stop */
         log(WARNING, "Jabber connection ended sid=%" PRId64, j_client->sid);
@@ -334,22 +1089,81 @@ int jc_handle_stanza(void* _j_client, int type, iks* stanza) {
     return IKS_OK;
 }
 
+/*! \brief Create the parser of a session
+ *
+ * Returns 1 on success, 0 otherwise */
+int jc_create_parser(JabberClient* j_client) {
+    JabberClient* owner;
+
+    owner = jc_own_memory(j_client);
+    j_client->parser = iks_stream_new("jabber:client", j_client,
+            jc_handle_stanza);
+    jc_release_memory(owner);
+
+    return j_client->parser != NULL;
+}
+
+/*! \brief Rebuild the parser and the queue of a hibernated session */
+int jc_wake(JabberClient* j_client) {
+    JabberClient* owner;
+    HttpConnection* websocket;
+    int ret;
+
+    if(!jc_create_parser(j_client)) {
+        return IKS_NOMEM;
+    }
+    j_client->output_queue = list_new();
+
+    /* put the new parser inside the stream, this is not a new stream for a
+     * websocket client */
+    websocket = j_client->websocket;
+    j_client->websocket = NULL;
+    owner = jc_own_memory(j_client);
+    ret = iks_parse(j_client->parser, RESUME_HEADER, strlen(RESUME_HEADER), 0);
+    jc_release_memory(owner);
+    j_client->websocket = websocket;
+
+    metric_dec(METRIC_SESSIONS_HIBERNATED);
+
+    log(DEBUG, "Session woke up sid=%" PRId64, j_client->sid);
+
+    return ret;
+}
+
 /*! \brief Handle activity in the jabber connection */
 void jc_read_jabber(void* _j_client) {
     ssize_t bytes;
     int ret = IKS_OK;
     char buffer[8192];
     JabberClient* j_client = _j_client;
+    JabberClient* owner;
 
     /* read the socket and feed the parser */
-    while(ret == IKS_OK &&
-            (bytes = sock_recv(j_client->sock,
-                          buffer, sizeof(buffer))) > 0) {
+    while(ret == IKS_OK && !sock_recv_paused(j_client->sock) &&
+            (bytes = jc_recv(j_client, buffer, sizeof(buffer))) > 0) {
+        metric_add(METRIC_UPSTREAM_BYTES_RECEIVED, bytes);
+        j_client->upstream_timestamp = get_time();
+        if(j_client->parser == NULL) {
+            ret = jc_wake(j_client);
+            if(ret != IKS_OK) {
+                break;
+            }
+        }
+        jc_track_stream(&j_client->tracker, buffer, bytes);
+        owner = jc_own_memory(j_client);
         ret = iks_parse(j_client->parser, buffer, bytes, 0);
+        jc_release_memory(owner);
+
+        /* when upgrading, stop at the end of the stanza */
+        if(j_client->bind->upgrading) {
+            jc_update_recv(j_client);
+        }
     }
 
-    /* flush the messages */
-    jc_flush_messages(j_client);
+    /* flush the messages, unless they wait for more in the batch window */
+    if(jc_batch_remaining(j_client, get_time_ns()) == 0) {
+        jc_flush_messages(j_client);
+    }
 
     /* check if the connection was closed */
     if(sock_status(j_client->sock) != SOCKET_CONNECTED || ret != IKS_OK ||
@@ -375,14 +1189,29 @@ void jc_report_error(HttpConnection* connection, enum BIND_ERROR_CODE code) {
 
     /* create the message */
     asprintf(&body, ERROR_RESPONSE, ERROR_TABLE[code][0], ERROR_TABLE[code][1]);
+    metric_inc(METRIC_RESPONSES_ERROR);
 
     /* send the message */
     hs_answer_request(connection, body, strlen(body), HTTP_XML_CONTENT);
 }
 
-/*! \brief Returns a random sid */
-uint64_t gen_sid() {
-    return lrand48() | (((uint64_t)lrand48())<<32);
+/*! \brief Returns a random sid
+ *
+ * The sid modulo the number of workers is the worker that owns the
+ * session. */
+uint64_t gen_sid(int node) {
+    uint64_t sid = lrand48() | (((uint64_t)lrand48())<<32);
+    int count = workers_count();
+
+    /* keep the node id in the top bits for the router, the random part stays
+     * far from both ends so the worker adjustment can't spill into it */
+    if(node >= 0) {
+        sid &= (1ull << (SID_NODE_SHIFT - 1)) - 1;
+        sid |= 1ull << (SID_NODE_SHIFT - 8);
+        sid |= (uint64_t)node << SID_NODE_SHIFT;
+    }
+
+    return sid - sid % count + workers_index();
 }
 
 void jc_answer_creation(int code, void* user_data) {
@@ -392,77 +1221,58 @@ void jc_answer_creation(int code, void* user_data) {
         /* connection has failed */
         log(WARNING, "Could not connect to the jabber server sid=%" PRId64
                 ": %s" , j_client->sid, strerror(code));
+        metric_inc(METRIC_UPSTREAM_CONNECT_FAILURES);
 
         /* close the client */
         jb_close_client(j_client);
+    } else {
+        latency_record(LATENCY_CONNECT, get_time_ns() - j_client->connect_start);
     }
 }
 
-/*! \brief Create a new connection to the jabber server */
-void jb_connect_client(JabberBind* bind, HttpConnection* connection,
-        iks* body) {
-
+/*! \brief Create a session and start the connection to the jabber server
+ *
+ * header is the stream header sent to the server, with the host in it.
+ * Returns NULL if the connection could not be started. */
+static JabberClient* jc_new(JabberBind* bind, const char* host,
+        const char* header) {
     char* tmp;
-    char* host;
     JabberClient* j_client;
-    uint64_t rid;
+    JabberClient* owner;
 
     /* alloc memory */
     j_client = JabberClient_alloc();
 
-    /* get wait parameter */
-    tmp = iks_find_attrib(body, "wait");
-    if(tmp == NULL) {
-        log(WARNING, "No wait attribute in the header");
+    /* create the parser */
+    j_client->memory = 0;
+    j_client->queued_bytes = 0;
+    j_client->over_budget = 0;
+    if(!jc_create_parser(j_client)) {
+        log(WARNING, "Could not create the jabber parser");
         JabberClient_free(j_client);
-        jc_report_error(connection, BAD_FORMAT);
-        return;
+        return NULL;
     }
-    j_client->wait = atoi(tmp) * 1000;
 
-    /* get to parameter */
-    host = iks_find_attrib(body, "to");
-    if(host == NULL) {
-        log(WARNING, "No to attribute in the header");
+    /* connect to host */
+    j_client->connect_start = get_time_ns();
+    j_client->sock = sock_new();
+    sock_set_options(j_client->sock, &bind->tcp_options);
+    if((bind->jabber_path != NULL ?
+                sock_connect_unix(j_client->sock, bind->jabber_path) :
+                sock_connect(j_client->sock, host, bind->jabber_port)) == 0) {
+        log(WARNING, "Could not connect to the jabber server");
+        metric_inc(METRIC_UPSTREAM_CONNECT_FAILURES);
+        sock_delete(j_client->sock);
+        owner = jc_own_memory(j_client);
+        iks_parser_delete(j_client->parser);
+        jc_release_memory(owner);
         JabberClient_free(j_client);
-        jc_report_error(connection, BAD_FORMAT);
-        return;
+        return NULL;
     }
 
-    /* get rid parameter */
-    tmp = iks_find_attrib(body, "rid");
-    if(tmp == NULL) {
-        log(WARNING, "Wrong header");
-        JabberClient_free(j_client);
-        jc_report_error(connection, BAD_FORMAT);
-        return;
-    }
-    sscanf(tmp, "%" PRId64, &rid);
-
-    /* create the parser */
-    j_client->parser = iks_stream_new("jabber:client", j_client,
-            jc_handle_stanza);
-    if(j_client->parser == NULL) {
-        log(WARNING, "Could not create the jabber parser");
-        JabberClient_free(j_client);
-        jc_report_error(connection, CONNECTION_FAILED);
-        return;
-    }
-
-    /* connect to host */
-    j_client->sock = sock_new();
-    if(sock_connect(j_client->sock, host, bind->jabber_port) == 0) {
-        log(WARNING, "Could not connect to the jabber server");
-        sock_delete(j_client->sock);
-        JabberClient_free(j_client);
-        jc_report_error(connection, CONNECTION_FAILED);
-        return;
-    }
-    iks_connect_fd(j_client->parser, sock_fd(j_client->sock));
-
     /* pick a random sid */
     do {
-        j_client->sid = gen_sid();
+        j_client->sid = gen_sid(bind->node);
     } while(uint64_hash_has_key(bind->sids, j_client->sid));
 
     /* insert the sid value into the hash */
@@ -471,17 +1281,32 @@ void jb_connect_client(JabberBind* bind, HttpConnection* connection,
     /* init client values */
     j_client->output_queue = list_new();
     j_client->bind = bind;
-    j_client->connection = NULL;
+    j_client->requests = list_new();
+    memset(j_client->responses, 0, sizeof(j_client->responses));
+    j_client->rid = 0;
+    j_client->wait = DEFAULT_REQUEST_TIMEOUT;
+    j_client->hold = 1;
+    j_client->websocket = NULL;
+    j_client->last_poll = 0;
+    j_client->pause_until = 0;
+    j_client->forwarded = 0;
+    j_client->early = NULL;
+    j_client->batch_it = NULL;
     j_client->alive = 1;
     j_client->timestamp = get_time();
+    j_client->upstream_timestamp = j_client->timestamp;
+    j_client->tracker.depth = 0;
+    j_client->tracker.state = TRACKER_TEXT;
     j_client->it = list_push_back(bind->jabber_connections, j_client);
     bind->client_count ++;
     if(bind->client_count > bind->max_client_count) {
         bind->max_client_count = bind->client_count;
     }
+    metric_inc(METRIC_SESSIONS);
+    metric_inc(METRIC_SESSIONS_CREATED);
 
     /* send jabber header */
-    asprintf(&tmp, JABBER_HEADER, host);
+    asprintf(&tmp, header, host);
     sock_send(j_client->sock, tmp, strlen(tmp), 0);
 
     /* set callbacks */
@@ -489,57 +1314,376 @@ void jb_connect_client(JabberBind* bind, HttpConnection* connection,
     sock_set_connect_callback(j_client->sock, jc_answer_creation, j_client);
     sock_set_error_callback(j_client->sock, jc_handle_error, j_client);
 
+    return j_client;
+}
+
+/*! \brief Create a new connection to the jabber server */
+void jb_connect_client(JabberBind* bind, HttpConnection* connection,
+        iks* body) {
+
+    char* tmp;
+    char* host;
+    JabberClient* j_client;
+    time_type wait;
+    uint64_t rid;
+    int hold;
+
+    /* the existing sessions come first when the loop is lagging */
+    if(bind->overload > 0) {
+        metric_inc(METRIC_OVERLOAD_SHED_SESSIONS);
+        hs_report_retry(connection, 503, bind->retry_after,
+                "The server is overloaded");
+        return;
+    }
+
+    /* get wait parameter */
+    tmp = iks_find_attrib(body, "wait");
+    if(tmp == NULL) {
+        log(WARNING, "No wait attribute in the header");
+        jc_report_error(connection, BAD_FORMAT);
+        return;
+    }
+    wait = atoi(tmp) * 1000;
+
+    /* get hold parameter, we hold at most max_hold requests */
+    tmp = iks_find_attrib(body, "hold");
+    hold = tmp != NULL ? atoi(tmp) : 1;
+    if(hold < 1) {
+        hold = 1;
+    } else if(hold > bind->max_hold) {
+        hold = bind->max_hold;
+    }
+
+    /* get to parameter */
+    host = iks_find_attrib(body, "to");
+    if(host == NULL) {
+        log(WARNING, "No to attribute in the header");
+        jc_report_error(connection, BAD_FORMAT);
+        return;
+    }
+
+    /* get rid parameter */
+    tmp = iks_find_attrib(body, "rid");
+    if(tmp == NULL) {
+        log(WARNING, "Wrong header");
+        jc_report_error(connection, BAD_FORMAT);
+        return;
+    }
+    sscanf(tmp, "%" PRId64, &rid);
+
+    j_client = jc_new(bind, host, JABBER_HEADER);
+    if(j_client == NULL) {
+        jc_report_error(connection, CONNECTION_FAILED);
+        return;
+    }
+    j_client->wait = wait;
+    j_client->hold = hold;
+    j_client->rid = rid;
+    j_client->forwarded = rid;
+
     /* send response */
-    asprintf(&tmp, SESSION_RESPONSE, j_client->sid);
+    asprintf(&tmp, SESSION_RESPONSE, j_client->sid, j_client->hold,
+            j_client->hold + 1, bind->polling, bind->session_timeout / 1000,
+            bind->max_pause);
     hs_answer_request(connection, tmp, strlen(tmp), HTTP_XML_CONTENT);
 
     log(INFO, "New bosh session: sid=%" PRId64 " socket=%p",
             j_client->sid, j_client->sock);
 }
 
-
 /*! \brief Remove the http connection.
  *
  * This function is called by the http server to notify that the connection was
  * closed before sending a response */
-void jc_clear_http(void* _j_client) {
+void jc_clear_http(void* _request) {
+    HeldRequest* request = _request;
+    JabberClient* j_client = request->j_client;
 
-    JabberClient* j_client = _j_client;
+    log(WARNING, "Cleared http connection on sid=%" PRId64 " rid=%" PRId64,
+            j_client->sid, request->rid);
 
-    log(WARNING, "Cleared http connection on sid=%" PRId64, j_client->sid);
-
-    j_client->connection = NULL;
+    jc_release_request(request);
     j_client->timestamp = get_time();
 }
 
-/*! \brief Set the client request */
+/*! \brief Hold a client request
+ *
+ * The requests are kept in rid order and the data is always sent on the
+ * lowest rid. If there are more than hold requests left, the one with the
+ * lowest rid is answered right away. */
 void jc_set_http(JabberClient* j_client, HttpConnection* connection, uint64_t rid) {
-    /* if we already have one, drop it */
-    if(j_client->connection != NULL) {
-        jc_drop_request(j_client, 0);
+    HeldRequest* request;
+    list_iterator it;
+
+    /* create the request */
+    request = HeldRequest_alloc();
+    request->connection = connection;
+    request->rid = rid;
+    request->timestamp = get_time();
+    request->start = get_time_ns();
+    request->j_client = j_client;
+    metric_inc(METRIC_HELD_REQUESTS);
+
+    /* insert before the first request with a greater rid */
+    list_foreach(it, j_client->requests) {
+        if(((HeldRequest*)list_iterator_value(it))->rid > rid) {
+            break;
+        }
     }
+    request->it = list_insert(it, request);
 
     /* update values */
-    j_client->connection = connection;
-    j_client->timestamp = get_time();
-    j_client->rid = rid;
+    j_client->timestamp = request->timestamp;
+    if(rid > j_client->rid) {
+        j_client->rid = rid;
+    }
 
     /* set thew close callback */
-    hc_set_close_callback(connection, jc_clear_http, j_client);
+    hc_set_close_callback(connection, jc_clear_http, request);
 
     /* flush messages */
     jc_flush_messages(j_client);
+
+    /* if we are still holding too many, answer the oldest */
+    if(list_size(j_client->requests) > j_client->hold) {
+        jc_drop_request(list_front(j_client->requests), 0);
+    }
+}
+
+/*! \brief Returns the rid of a request body */
+static uint64_t jc_body_rid(iks* message) {
+    const char* rid = iks_find_attrib(message, "rid");
+
+    return rid != NULL ? strtoull(rid, NULL, 10) : 0;
+}
+
+/*! \brief Send the payload of a body to the jabber server and apply its
+ * pause and terminate attributes
+ *
+ * Returns 0 if the session was closed. The message is deleted. */
+static int jc_process_body(JabberClient* j_client, iks* message) {
+    iks* stanza;
+    char* tmp;
+
+    /* send stanzas to the server */
+    for(stanza = iks_first_tag(message);
+            stanza != NULL; stanza = iks_next_tag(stanza)) {
+        tmp = iks_string(NULL, stanza);
+        sock_send(j_client->sock, tmp, strlen(tmp), 1);
+        metric_inc(METRIC_UPSTREAM_STANZAS_SENT);
+    }
+    sock_send(j_client->sock, NULL, 0, 0);
+    j_client->forwarded = jc_body_rid(message);
+
+    /* a paused session answers all its requests, and is kept for the
+     * pause instead of the inactivity timeout */
+    tmp = iks_find_attrib(message, "pause");
+    if(tmp != NULL) {
+        j_client->pause_until = get_time() + atoi(tmp) * 1000;
+        while(!list_empty(j_client->requests)) {
+            jc_drop_request(list_front(j_client->requests), 0);
+        }
+    }
+
+    /* close the connection if the type is terminate */
+    if(iks_strcmp(iks_find_attrib(message, "type"), "terminate") == 0) {
+        iks_delete(message);
+        jb_close_client(j_client);
+        return 0;
+    }
+
+    iks_delete(message);
+    return 1;
+}
+
+/*! \brief Process the bodies of a session in rid order
+ *
+ * XEP-0124 wants the payloads in rid order, the requests can come in any
+ * order over several connections. A body ahead of a missing rid waits until
+ * the gap is filled. The message is owned by the session afterwards. */
+static void jc_forward_body(JabberClient* j_client, uint64_t rid,
+        iks* message) {
+    list_iterator it;
+
+    if(rid != j_client->forwarded + 1) {
+        if(j_client->early == NULL) {
+            j_client->early = list_new();
+        }
+        list_foreach(it, j_client->early) {
+            if(jc_body_rid(list_iterator_value(it)) > rid) {
+                break;
+            }
+        }
+        list_insert(it, message);
+        log(INFO, "Request ahead of a missing rid sid=%" PRId64 " rid=%"
+                PRId64 " last=%" PRId64, j_client->sid, rid,
+                j_client->forwarded);
+        return;
+    }
+
+    if(!jc_process_body(j_client, message)) {
+        return;
+    }
+
+    /* the gap is filled, the bodies that waited follow */
+    while(j_client->early != NULL && !list_empty(j_client->early) &&
+            jc_body_rid(list_front(j_client->early)) ==
+            j_client->forwarded + 1) {
+        if(!jc_process_body(j_client, list_pop_front(j_client->early))) {
+            return;
+        }
+    }
+}
+
+/*! \brief Returns 1 if the payload of the rid was taken already
+ *
+ * It was processed, or it waits for a missing rid. */
+static int jc_rid_received(JabberClient* j_client, uint64_t rid) {
+    list_iterator it;
+
+    if(rid <= j_client->forwarded) {
+        return 1;
+    }
+    if(j_client->early != NULL) {
+        list_foreach(it, j_client->early) {
+            if(jc_body_rid(list_iterator_value(it)) == rid) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*! \brief Move a held request to the connection that repeated its rid
+ *
+ * The client gave up on the first connection, it gets an empty body.
+ * Returns 1 if the rid was held, 0 otherwise. */
+static int jc_swap_http(JabberClient* j_client, HttpConnection* connection,
+        uint64_t rid) {
+    HeldRequest* request;
+    HttpConnection* previous;
+    list_iterator it;
+    char* body;
+
+    list_foreach(it, j_client->requests) {
+        request = list_iterator_value(it);
+        if(request->rid == rid) {
+            break;
+        }
+    }
+    if(it == list_end(j_client->requests)) {
+        return 0;
+    }
+
+    log(INFO, "Repeated held rid sid=%" PRId64 " rid=%" PRId64,
+            j_client->sid, rid);
+
+    previous = request->connection;
+    hc_set_close_callback(previous, NULL, NULL);
+    asprintf(&body, EMPTY_RESPONSE);
+    hs_answer_request(previous, body, strlen(body), HTTP_XML_CONTENT);
+
+    request->connection = connection;
+    hc_set_close_callback(connection, jc_clear_http, request);
+    j_client->timestamp = get_time();
+
+    return 1;
+}
+
+/*! \brief Returns 1 if the request repeats a rid the session has seen
+ *
+ * A client retransmits after losing a response, that is not polling. */
+static int jc_repeated_rid(JabberClient* j_client, const HttpRequest* request) {
+    char value[32];
+
+    return rt_find_attrib(request->data, request->data_size, "rid", value,
+            sizeof(value)) &&
+        strtoull(value, NULL, 10) <= j_client->rid;
+}
+
+/*! \brief Check the throttling limits of XEP-0124 on a request
+ *
+ * Only the start tag of the body is scanned, so an abusive client costs no
+ * xml parsing. An empty request is allowed to push out a held request once
+ * per polling interval, a client that keeps doing it, or asks for a pause
+ * longer than max_pause, gets a policy-violation and the session ends. A
+ * request for a new session takes a token of the client's session rate.
+ * Returns 1 if the request was answered. */
+static int jb_check_policy(JabberBind* bind, const HttpRequest* request) {
+    JabberClient* j_client;
+    char value[32];
+    uint64_t sid;
+    time_type now;
+
+    if(!rt_find_attrib(request->data, request->data_size, "sid", value,
+                sizeof(value))) {
+        /* a new session, refused before its body is parsed */
+        if(!hc_allow_session(request->connection)) {
+            hs_report_retry(request->connection, 429, 1,
+                    "Too many sessions");
+            return 1;
+        }
+        return 0;
+    }
+
+    /* pass the request to the worker that owns the session, unparsed */
+    sid = strtoull(value, NULL, 10);
+    if(sid % workers_count() != workers_index()) {
+        hc_forward(request->connection,
+                workers_channel(sid % workers_count()));
+        return 1;
+    }
+    j_client = uint64_hash_find(bind->sids, sid);
+    if(j_client == NULL || j_client->websocket != NULL) {
+        return 0;
+    }
+
+    if(rt_find_attrib(request->data, request->data_size, "pause", value,
+                sizeof(value))) {
+        if(atoi(value) <= bind->max_pause) {
+            return 0;
+        }
+        log(WARNING, "Pause too long sid=%" PRId64 " pause=%s", sid, value);
+    } else if(bind->polling > 0 &&
+            list_size(j_client->requests) >= j_client->hold &&
+            !jc_repeated_rid(j_client, request) &&
+            !rt_find_attrib(request->data, request->data_size, "type", value,
+                sizeof(value)) &&
+            rt_body_empty(request->data, request->data_size)) {
+        now = get_time();
+        if(now - j_client->last_poll >= bind->polling * 1000) {
+            j_client->last_poll = now;
+            return 0;
+        }
+        log(WARNING, "Polling too fast sid=%" PRId64, sid);
+    } else {
+        return 0;
+    }
+
+    metric_inc(METRIC_POLICY_VIOLATIONS);
+    jc_report_error(request->connection, POLICY_VIOLATION);
+    jb_close_client(j_client);
+
+    return 1;
 }
 
 /*! \brief Handle an incoming http post */
 void jb_handle_http_post(JabberBind* bind, const HttpRequest* request) {
     JabberClient* j_client;
-    iks* message, *stanza;
+    iks* message;
     char* tmp;
     uint64_t sid, rid;
+    int64_t start;
+
+    if(jb_check_policy(bind, request)) {
+        return;
+    }
 
     /* parse the content */
+    start = get_time_ns();
     message = iks_tree(request->data, request->data_size, NULL);
+    latency_record(LATENCY_XML_PARSE, get_time_ns() - start);
 
     /* return an error if the xml is malformed */
     if(message == NULL) {
@@ -575,27 +1719,50 @@ void jb_handle_http_post(JabberBind* bind, const HttpRequest* request) {
 
         /* get the client */
         j_client = uint64_hash_find(bind->sids, sid);
-        if(j_client == NULL) {
+        if(j_client == NULL || j_client->websocket != NULL) {
             log(WARNING, "Sid not found: %" PRId64, sid);
             jc_report_error(request->connection, SID_NOT_FOUND);
             iks_delete(message);
             return;
         }
-        jc_set_http(j_client, request->connection, rid);
 
-        /* send stanzas to the client */
-        for(stanza = iks_first_tag(message);
-                stanza != NULL; stanza = iks_next_tag(stanza)) {
-            tmp = iks_string(NULL, stanza);
-            sock_send(j_client->sock, tmp, strlen(tmp), 1);
+        /* a repeated rid is answered from the window, ignoring the payload,
+         * and a rid out of the window ends the session */
+        if(jc_resend_response(j_client, request->connection, rid)) {
+            iks_delete(message);
+            return;
         }
-        sock_send(j_client->sock, NULL, 0, 0);
-
-        /* close the connection if the type is terminate */
-        if(iks_strcmp(iks_find_attrib(message, "type"), "terminate") == 0) {
+        if(rid + j_client->hold + 1 <= j_client->rid ||
+                rid > j_client->forwarded + j_client->hold + 1) {
+            log(WARNING, "Rid out of the window sid=%" PRId64 " rid=%" PRId64
+                    " last=%" PRId64, sid, rid, j_client->rid);
+            jc_report_error(request->connection, BAD_RID);
             jb_close_client(j_client);
+            iks_delete(message);
+            return;
+        }
+
+        /* a repeated rid that is still held only changes connection */
+        if(jc_swap_http(j_client, request->connection, rid)) {
+            iks_delete(message);
+            return;
         }
 
+        /* its connection was lost before the answer, hold the new one but
+         * never send the payload twice */
+        if(jc_rid_received(j_client, rid)) {
+            log(INFO, "Repeated rid sid=%" PRId64 " rid=%" PRId64, sid, rid);
+            jc_set_http(j_client, request->connection, rid);
+            iks_delete(message);
+            return;
+        }
+
+        jc_set_http(j_client, request->connection, rid);
+
+        /* the payload goes to the server in rid order */
+        jc_forward_body(j_client, rid, message);
+        return;
+
     } else {
         /* if there is no sid, than it is a request to create a connection */
         jb_connect_client(bind, request->connection, message);
@@ -603,32 +1770,200 @@ void jb_handle_http_post(JabberBind* bind, const HttpRequest* request) {
     iks_delete(message);
 }
 
+/*! \brief Start a new stream on a websocket session
+ *
+ * The client opens a new stream after the authentication, so the server
+ * gets a new header and we start a new parser for its answer. Returns 1 on
+ * success, 0 otherwise. */
+static int jc_restart_stream(JabberClient* j_client, const char* host) {
+    iksparser* parser = j_client->parser;
+    JabberClient* owner;
+    char* tmp;
+
+    if(!jc_create_parser(j_client)) {
+        j_client->parser = parser;
+        return 0;
+    }
+
+    owner = jc_own_memory(j_client);
+    if(parser != NULL) {
+        iks_parser_delete(parser);
+    } else {
+        j_client->output_queue = list_new();
+        metric_dec(METRIC_SESSIONS_HIBERNATED);
+    }
+    jc_release_memory(owner);
+
+    j_client->tracker.depth = 0;
+    j_client->tracker.state = TRACKER_TEXT;
+
+    asprintf(&tmp, WEBSOCKET_JABBER_HEADER, host);
+    sock_send(j_client->sock, tmp, strlen(tmp), 0);
+
+    log(INFO, "Stream restarted sid=%" PRId64, j_client->sid);
+
+    return 1;
+}
+
+/*! \brief Handle a message of a websocket session */
+static void jc_handle_websocket(void* _j_client, HttpConnection* connection,
+        const char* data, size_t size) {
+    JabberClient* j_client = _j_client;
+    iks* message;
+    const char* name;
+    const char* host;
+    char* tmp;
+    int64_t start;
+
+    start = get_time_ns();
+    message = iks_tree(data, size, NULL);
+    latency_record(LATENCY_XML_PARSE, get_time_ns() - start);
+
+    if(message == NULL) {
+        log(WARNING, "Malformed xml on websocket sid=%" PRId64, j_client->sid);
+        jb_close_client(j_client);
+        return;
+    }
+
+    j_client->timestamp = get_time();
+    name = iks_name(message);
+    host = iks_find_attrib(message, "to");
+
+    if(strcmp(name, "open") == 0) {
+        if(host == NULL || !jc_restart_stream(j_client, host)) {
+            jb_close_client(j_client);
+        }
+    } else if(strcmp(name, "close") == 0) {
+        sock_send(j_client->sock, strdup(JABBER_STREAM_END),
+                strlen(JABBER_STREAM_END), 0);
+        jb_close_client(j_client);
+    } else {
+        /* the message is a single stanza, send it as it came */
+        tmp = malloc(size);
+        memcpy(tmp, data, size);
+        sock_send(j_client->sock, tmp, size, 0);
+        metric_inc(METRIC_UPSTREAM_STANZAS_SENT);
+    }
+
+    iks_delete(message);
+}
+
+/*! \brief The client can take more stanzas */
+static void jc_websocket_writable(void* _j_client) {
+    jc_flush_messages(_j_client);
+}
+
+/*! \brief The websocket of a session was closed by the client */
+static void jc_websocket_closed(void* _j_client) {
+    JabberClient* j_client = _j_client;
+
+    log(INFO, "Websocket closed sid=%" PRId64, j_client->sid);
+
+    /* the connection is going away, don't touch it */
+    j_client->websocket = NULL;
+    metric_dec(METRIC_WEBSOCKET_SESSIONS);
+    jb_close_client(j_client);
+}
+
+/*! \brief Handle the first message of a websocket, it opens the stream */
+static void jb_handle_websocket(void* _bind, HttpConnection* connection,
+        const char* data, size_t size) {
+    JabberBind* bind = _bind;
+    JabberClient* j_client;
+    iks* message;
+    const char* host;
+
+    message = iks_tree(data, size, NULL);
+    if(message == NULL || strcmp(iks_name(message), "open") != 0 ||
+            iks_strcmp(iks_find_attrib(message, "xmlns"), FRAMING_NS) != 0 ||
+            (host = iks_find_attrib(message, "to")) == NULL) {
+        log(WARNING, "Expected an open element on the websocket");
+        hc_ws_close(connection, WS_CLOSE_PROTOCOL_ERROR);
+        if(message != NULL) {
+            iks_delete(message);
+        }
+        return;
+    }
+
+    j_client = jc_new(bind, host, WEBSOCKET_JABBER_HEADER);
+    iks_delete(message);
+    if(j_client == NULL) {
+        hc_ws_close(connection, WS_CLOSE_INTERNAL_ERROR);
+        return;
+    }
+
+    /* the connection stays with the session until one of them ends */
+    j_client->websocket = connection;
+    metric_inc(METRIC_WEBSOCKET_SESSIONS);
+    hc_set_message_callback(connection, jc_handle_websocket, j_client);
+    hc_set_writable_callback(connection, jc_websocket_writable, j_client);
+    hc_set_close_callback(connection, jc_websocket_closed, j_client);
+
+    log(INFO, "New websocket session: sid=%" PRId64 " socket=%p",
+            j_client->sid, j_client->sock);
+}
+
 /*! \brief Handle an incoming http get */
 void jb_handle_http_get(JabberBind* bind, const HttpRequest* request) {
-    char* html;
-    char* uptime_str;
-    int days, hours, minutes, seconds;
-    time_type uptime;
+    const char* path = request->header->path;
+    const char* metrics;
+    char* msg;
+    size_t size, n;
+
+    /* ignore the query string */
+    n = strcspn(path, "?");
+
+    /* xmpp over websocket */
+    if(strlen(bind->websocket_path) == n &&
+            strncmp(path, bind->websocket_path, n) == 0) {
+        if(bind->overload > 0) {
+            metric_inc(METRIC_OVERLOAD_SHED_SESSIONS);
+            hs_report_retry(request->connection, 503, bind->retry_after,
+                    "The server is overloaded");
+        } else if(!hc_allow_session(request->connection)) {
+            hs_report_retry(request->connection, 429, 1,
+                    "Too many sessions");
+        } else if(hc_accept_websocket(request, WEBSOCKET_PROTOCOL)) {
+            hc_set_message_callback(request->connection, jb_handle_websocket,
+                    bind);
+        }
+        return;
+    }
 
-    uptime = (get_time() - bind->start_time)/1000;
-    seconds = uptime % 60;
-    uptime /= 60;
-    minutes = uptime % 60;
-    uptime /= 60;
-    hours = uptime % 24;
-    uptime /= 24;
-    days = uptime;
+    /* the memory breakdown */
+    if(strlen(bind->memory_path) == n &&
+            strncmp(path, bind->memory_path, n) == 0) {
+        metrics = metrics_render_memory(&size);
+        msg = malloc(size);
+        memcpy(msg, metrics, size);
+        hs_answer_request(request->connection, msg, size,
+                HTTP_METRICS_CONTENT);
+        return;
+    }
 
-    asprintf(&uptime_str, "%d days, %02d:%02d:%02d", days, hours, minutes,
-            seconds);
+    /* otherwise only the metrics page is served */
+    if(strlen(bind->metrics_path) != n ||
+            strncmp(path, bind->metrics_path, n) != 0) {
+        hs_report_error(request->connection, 404, "Page not found");
+        return;
+    }
 
-    asprintf(&html, STATUS_HTML, uptime_str, bind->client_count,
-            bind->max_client_count);
+    /* update the gauges that are not tracked incrementally */
+    metric_set(METRIC_UPTIME_SECONDS, (get_time() - bind->start_time)/1000);
+    metric_set(METRIC_SESSIONS_MAX, bind->max_client_count);
 
-    hs_answer_request(request->connection, html, strlen(html),
-            HTTP_HTML_CONTENT);
+    /* the socket takes ownership of the message, so copy the rendered page */
+    metrics = metrics_render(&size);
+    msg = malloc(size);
+    memcpy(msg, metrics, size);
 
-    free(uptime_str);
+    hs_answer_request(request->connection, msg, size, HTTP_METRICS_CONTENT);
+
+    /* the latency histograms can be cleared with a reset query */
+    if(strcmp(path + n, "?reset") == 0) {
+        log(INFO, "Latency histograms reset");
+        latency_reset();
+    }
 }
 
 /*! \brief Handle an incoming request */
@@ -648,6 +1983,318 @@ void jb_handle_request(void* _bind, const HttpRequest* request) {
     }
 }
 
+/*! \brief Send a session and its queued stanzas to the new process */
+static int jc_export(JabberClient* j_client, int channel) {
+    HandoffSession record;
+    char buffer[HANDOFF_MAX_MESSAGE];
+    list_iterator it;
+    time_type now = get_time();
+    size_t used, n, len, chunk;
+    char* xml;
+    int ok;
+
+    record.version = HANDOFF_VERSION;
+    record.size = sizeof(record);
+    record.sid = j_client->sid;
+    record.rid = j_client->rid;
+    record.wait = j_client->wait;
+    record.hold = j_client->hold;
+    record.idle = now - j_client->timestamp;
+    record.upstream_idle = now - j_client->upstream_timestamp;
+
+    ok = handoff_send(channel, HANDOFF_SESSION, &record, sizeof(record),
+            sock_fd(j_client->sock));
+
+    /* a hibernated session has nothing queued */
+    if(j_client->output_queue == NULL) {
+        return ok;
+    }
+
+    /* send the stanzas as xml, the new parser will queue them again */
+    used = 0;
+    list_foreach(it, j_client->output_queue) {
+        xml = iks_string(NULL, list_iterator_value(it));
+        len = strlen(xml);
+        for(n = 0; ok && n < len; n += chunk) {
+            chunk = sizeof(buffer) - used;
+            if(chunk > len - n) {
+                chunk = len - n;
+            }
+            memcpy(buffer + used, xml + n, chunk);
+            used += chunk;
+            if(used == sizeof(buffer)) {
+                ok = handoff_send(channel, HANDOFF_QUEUE, buffer, used, -1);
+                used = 0;
+            }
+        }
+        iks_free(xml);
+    }
+    if(ok && used > 0) {
+        ok = handoff_send(channel, HANDOFF_QUEUE, buffer, used, -1);
+    }
+
+    return ok;
+}
+
+/*! \brief Hand the listening socket and the sessions to a new process
+ *
+ * Returns 1 if the new process took them, 0 otherwise */
+static int jb_handoff(JabberBind* bind) {
+    list_iterator it;
+    JabberClient* j_client;
+    int channel, type, fd, ok, count = 0;
+    pid_t pid;
+
+    channel = handoff_spawn(&pid);
+    if(channel == -1) {
+        return 0;
+    }
+
+    ok = handoff_send(channel, HANDOFF_LISTEN, NULL, 0,
+            hs_listen_fd(bind->server));
+
+    /* the sessions in the middle of a stanza are left behind */
+    list_foreach(it, bind->jabber_connections) {
+        j_client = list_iterator_value(it);
+        if(!ok) {
+            break;
+        }
+        if(jc_handoff_ready(j_client)) {
+            ok = jc_export(j_client, channel);
+            count++;
+        }
+    }
+
+    if(ok) {
+        ok = handoff_send(channel, HANDOFF_END, NULL, 0, -1);
+    }
+
+    /* wait until the new process has taken everything */
+    if(ok) {
+        ok = handoff_recv(channel, &type, NULL, 0, &fd, HANDOFF_TIMEOUT) >= 0
+            && type == HANDOFF_READY;
+    }
+
+    /* don't leave a half started process holding our sockets */
+    if(ok) {
+        close(channel);
+    } else {
+        handoff_abort(channel, pid);
+    }
+
+    log(INFO, "Handed off %d of %d sessions: %s", count, bind->client_count,
+            ok ? "ok" : "failed");
+
+    return ok;
+}
+
+/*! \brief Create a session handed off by the previous process
+ *
+ * The session starts hibernated, the parser is created when the stream
+ * continues. */
+static JabberClient* jc_adopt(JabberBind* bind, const HandoffSession* record,
+        int fd) {
+    JabberClient* j_client;
+    time_type now = get_time();
+
+    j_client = JabberClient_alloc();
+
+    j_client->sid = record->sid;
+    j_client->rid = record->rid;
+    j_client->wait = record->wait;
+    j_client->hold = record->hold;
+    j_client->bind = bind;
+    j_client->parser = NULL;
+    j_client->output_queue = NULL;
+    j_client->websocket = NULL;
+    j_client->last_poll = 0;
+    j_client->pause_until = 0;
+    j_client->forwarded = record->rid;
+    j_client->early = NULL;
+    j_client->batch_it = NULL;
+    j_client->requests = list_new();
+    memset(j_client->responses, 0, sizeof(j_client->responses));
+    j_client->alive = 1;
+    j_client->timestamp = now - record->idle;
+    j_client->upstream_timestamp = now - record->upstream_idle;
+    j_client->tracker.depth = 1;
+    j_client->tracker.state = TRACKER_TEXT;
+    j_client->memory = 0;
+    j_client->queued_bytes = 0;
+    j_client->over_budget = 0;
+    j_client->connect_start = get_time_ns();
+
+    /* use the jabber connection of the previous process */
+    j_client->sock = sock_new();
+    sock_adopt(j_client->sock, fd, SOCKET_CONNECTED);
+
+    uint64_hash_insert(bind->sids, j_client->sid, j_client);
+    j_client->it = list_push_back(bind->jabber_connections, j_client);
+    bind->client_count ++;
+    if(bind->client_count > bind->max_client_count) {
+        bind->max_client_count = bind->client_count;
+    }
+    metric_inc(METRIC_SESSIONS);
+    metric_inc(METRIC_SESSIONS_HIBERNATED);
+
+    sock_set_data_callback(j_client->sock, jc_read_jabber, j_client);
+    sock_set_error_callback(j_client->sock, jc_handle_error, j_client);
+
+    return j_client;
+}
+
+/*! \brief Take the sessions handed off by the previous process
+ *
+ * Returns 1 if every session was taken, 0 if the import is incomplete and
+ * the previous process keeps them. */
+static int jb_import_sessions(JabberBind* bind, int channel) {
+    char data[HANDOFF_MAX_MESSAGE];
+    HandoffSession record;
+    JabberClient* j_client = NULL;
+    JabberClient* owner;
+    ssize_t len;
+    int type, fd, done = 0;
+
+    while((len = handoff_recv(channel, &type, data, sizeof(data), &fd,
+                    HANDOFF_TIMEOUT)) >= 0) {
+        if(type == HANDOFF_SESSION) {
+            /* refuse sessions from a binary with another layout */
+            memcpy(&record, data, len < (ssize_t)sizeof(record) ?
+                    (size_t)len : sizeof(record));
+            if(len != sizeof(record) || fd == -1 ||
+                    record.version != HANDOFF_VERSION ||
+                    record.size != sizeof(record)) {
+                log(ERROR, "Incompatible handoff session from the previous"
+                        " process");
+                if(fd != -1) {
+                    close(fd);
+                }
+                break;
+            }
+            j_client = jc_adopt(bind, &record, fd);
+        } else if(type == HANDOFF_QUEUE && j_client != NULL) {
+            /* feed the stanzas queued in the previous process */
+            if(j_client->parser == NULL && jc_wake(j_client) != IKS_OK) {
+                continue;
+            }
+            owner = jc_own_memory(j_client);
+            iks_parse(j_client->parser, data, len, 0);
+            jc_release_memory(owner);
+        } else if(type == HANDOFF_END) {
+            done = handoff_send(channel, HANDOFF_READY, NULL, 0, -1);
+            break;
+        } else if(fd != -1) {
+            close(fd);
+        }
+    }
+    close(channel);
+
+    if(done) {
+        log(INFO, "Took %d sessions from the previous process",
+                bind->client_count);
+    }
+
+    return done;
+}
+
+/*! \brief Move the server to a new process
+ *
+ * First we wait for every session to reach the end of a stanza, then the
+ * sockets are handed to the new process and we quit. */
+static void jb_upgrade(JabberBind* bind) {
+    list_iterator it;
+    JabberClient* j_client;
+    time_type now = get_time();
+    int ready = 1;
+
+    if(!bind->upgrading) {
+        log(INFO, "Upgrade requested");
+        bind->upgrading = 1;
+        bind->upgrade_deadline = now + UPGRADE_DRAIN_TIMEOUT;
+        list_foreach(it, bind->jabber_connections) {
+            jc_update_recv(list_iterator_value(it));
+        }
+    }
+
+    /* check if every session is between stanzas */
+    list_foreach(it, bind->jabber_connections) {
+        j_client = list_iterator_value(it);
+        if(!jc_handoff_ready(j_client) && j_client->websocket == NULL &&
+                j_client->tracker.state != TRACKER_LOST) {
+            ready = 0;
+            break;
+        }
+    }
+    if(!ready && now < bind->upgrade_deadline) {
+        return;
+    }
+
+    upgrade_requested = 0;
+    hs_stop_accepting(bind->server);
+
+    if(jb_handoff(bind)) {
+        /* answer the held requests, the clients will poll the new process */
+        list_foreach(it, bind->jabber_connections) {
+            j_client = list_iterator_value(it);
+            if(jc_handoff_ready(j_client)) {
+                while(!list_empty(j_client->requests)) {
+                    jc_drop_request(list_front(j_client->requests), 0);
+                }
+            }
+        }
+        running = 0;
+    } else {
+        log(ERROR, "Upgrade failed, resuming");
+        if(bind->overload < 2) {
+            hs_start_accepting(bind->server);
+        }
+        bind->upgrading = 0;
+        list_foreach(it, bind->jabber_connections) {
+            jc_update_recv(list_iterator_value(it));
+        }
+    }
+}
+
+/*! \brief Shed load according to the lag of the loop
+ *
+ * Above shed_session_lag the new sessions are refused, above
+ * shed_accept_lag the new connections are not accepted either. A level is
+ * left when the lag is below half its threshold, so it doesn't flap. */
+static void jb_update_overload(JabberBind* bind) {
+    time_type lag = sm_lag();
+    int level = bind->overload;
+
+    if(bind->shed_accept_lag > 0 && (lag >= bind->shed_accept_lag ||
+                (level == 2 && lag >= bind->shed_accept_lag / 2))) {
+        level = 2;
+    } else if(bind->shed_session_lag > 0 && (lag >= bind->shed_session_lag ||
+                (level >= 1 && lag >= bind->shed_session_lag / 2))) {
+        level = 1;
+    } else {
+        level = 0;
+    }
+
+    if(level == bind->overload) {
+        return;
+    }
+
+    log(WARNING, "Overload level %d -> %d, loop lag %" PRId64 "ms",
+            bind->overload, level, (int64_t)lag);
+
+    /* the upgrade decides when to accept */
+    if(!bind->upgrading) {
+        if(level == 2) {
+            metric_inc(METRIC_OVERLOAD_ACCEPT_PAUSES);
+            hs_stop_accepting(bind->server);
+        } else if(bind->overload == 2) {
+            hs_start_accepting(bind->server);
+        }
+    }
+
+    bind->overload = level;
+    metric_set(METRIC_OVERLOAD_LEVEL, level);
+}
+
 /*! \brief Run the server until a SIGINT or SIGTERM signal is caught */
 void jb_run(JabberBind* bind) {
     time_type max_time;
@@ -658,6 +2305,9 @@ void jb_run(JabberBind* bind) {
     /* set signal handlers */
     signal(SIGINT, handle_signal);
     signal(SIGTERM, handle_signal);
+    if(workers_count() == 1) {
+        signal(SIGUSR2, handle_upgrade_signal);
+    }
 
     log(INFO, "Server is running");
 
@@ -665,16 +2315,97 @@ void jb_run(JabberBind* bind) {
     while(running == 1) {
         /* take the nearest timeout */
         max_time = jb_closest_timeout(bind);
+        max_time = hs_closest_timeout(bind->server, max_time);
 
         /* some sanity test */
         if(max_time < 0)
             max_time = 0;
 
+        /* check the upgrade often */
+        if(upgrade_requested && max_time > 100)
+            max_time = 100;
+
+        /* while shedding, measure the lag often enough to stop soon */
+        if(bind->overload > 0 && max_time > OVERLOAD_CHECK_INTERVAL)
+            max_time = OVERLOAD_CHECK_INTERVAL;
+
         /* wait for any socket activity, don't wait more than max_time */
         sm_poll(max_time);
 
         /* check if any timeout went off */
         jb_check_timeout(bind);
+        hs_check_timeout(bind->server);
+
+        jb_update_overload(bind);
+
+        /* move to a new process */
+        if(upgrade_requested) {
+            jb_upgrade(bind);
+        }
+    }
+}
+
+/*! \brief Fill the object pools for the expected sessions
+ *
+ * After a restart the clients come back all at once, the pools are filled
+ * beforehand from huge pages, so they don't grow and fault in page by page
+ * under the load. */
+static void jb_reserve(JabberBind* bind, iks* bind_config) {
+    AllocatorPages pages = ALLOCATOR_PAGES_TRANSPARENT;
+    const char* str;
+    size_t sessions, connections;
+    time_type start;
+
+    if((str = iks_find_attrib(bind_config, "reserve_sessions")) == NULL ||
+            atoi(str) <= 0) {
+        return;
+    }
+
+    /* every worker takes its share */
+    sessions = (atoi(str) + workers_count() - 1) / workers_count();
+    connections = 0;
+    if((str = iks_find_attrib(bind_config, "reserve_connections")) != NULL &&
+            atoi(str) >= 0) {
+        connections = (atoi(str) + workers_count() - 1) / workers_count();
+    }
+
+    if((str = iks_find_attrib(bind_config, "reserve_pages")) != NULL) {
+        if(strcmp(str, "huge") == 0) {
+            pages = ALLOCATOR_PAGES_EXPLICIT;
+        } else if(strcmp(str, "normal") == 0) {
+            pages = ALLOCATOR_PAGES_NORMAL;
+        } else if(strcmp(str, "transparent") != 0) {
+            log(WARNING, "Invalid reserve_pages %s", str);
+        }
+    }
+    str = iks_find_attrib(bind_config, "reserve_lock");
+    allocator_set_pages(pages, str != NULL && atoi(str) != 0);
+
+    start = get_time();
+    JabberClient_reserve(sessions);
+    HeldRequest_reserve(sessions * bind->max_hold);
+    CachedResponse_reserve(sessions * (bind->max_hold + 1));
+    _uint64_hash_node_reserve(sessions);
+    list_reserve(sessions * 2);
+    _list_node_reserve(sessions * RESERVE_LIST_NODES);
+    hs_reserve(connections);
+    sock_reserve(sessions + connections);
+    sm_reserve(sessions + connections);
+
+    log(INFO, "Reserved %zu sessions and %zu connections in %" PRId64 " ms: "
+            "%zu MB on huge pages, %zu MB on transparent huge pages, %zu MB "
+            "on normal pages", sessions, connections, get_time() - start,
+            allocator_reserved(ALLOCATOR_PAGES_EXPLICIT) >> 20,
+            allocator_reserved(ALLOCATOR_PAGES_TRANSPARENT) >> 20,
+            allocator_reserved(ALLOCATOR_PAGES_NORMAL) >> 20);
+    if(pages == ALLOCATOR_PAGES_EXPLICIT &&
+            allocator_reserved(ALLOCATOR_PAGES_TRANSPARENT) +
+            allocator_reserved(ALLOCATOR_PAGES_NORMAL) > 0) {
+        log(WARNING, "Not enough huge pages, raise vm.nr_hugepages");
+    }
+    if(allocator_unlocked() > 0) {
+        log(WARNING, "Could not lock %zu MB of the reserved memory, raise "
+                "the memlock limit", allocator_unlocked() >> 20);
     }
 }
 
@@ -685,6 +2416,7 @@ JabberBind* jb_new(iks* config) {
     iks* http_config;
     iks* log_config;
     const char* str;
+    int channel, listen_fd, type;
 
     jb = malloc(sizeof(JabberBind));
 
@@ -706,6 +2438,16 @@ JabberBind* jb_new(iks* config) {
         jb->jabber_port = JABBER_PORT;
     }
 
+    /* a jabber server on the same host can be reached by a unix socket */
+    if((str = iks_find_attrib(bind_config, "jabber_path")) != NULL) {
+        jb->jabber_path = strdup(str);
+    } else {
+        jb->jabber_path = NULL;
+    }
+
+    /* set the tcp options of the jabber connections */
+    sock_options_init(&jb->tcp_options, bind_config);
+
     /* set session timeout */
     if((str = iks_find_attrib(bind_config, "session_timeout")) != NULL) {
         jb->session_timeout = atoi(str);
@@ -713,24 +2455,171 @@ JabberBind* jb_new(iks* config) {
         jb->session_timeout = SESSION_TIMEOUT;
     }
 
+    /* set the idle time before a session hibernates, 0 disables it */
+    if((str = iks_find_attrib(bind_config, "hibernate_timeout")) != NULL) {
+        jb->hibernate_timeout = atoi(str);
+    } else {
+        jb->hibernate_timeout = HIBERNATE_TIMEOUT;
+    }
+
+    /* set the maximum number of requests held per session */
+    if((str = iks_find_attrib(bind_config, "max_hold")) != NULL) {
+        jb->max_hold = atoi(str);
+    } else {
+        jb->max_hold = MAX_HOLD;
+    }
+    if(jb->max_hold >= RESPONSE_WINDOW) {
+        jb->max_hold = RESPONSE_WINDOW - 1;
+    }
+
+    /* set the throttling limits sent to the clients */
+    if((str = iks_find_attrib(bind_config, "polling")) != NULL) {
+        jb->polling = atoi(str);
+    } else {
+        jb->polling = POLLING;
+    }
+    if((str = iks_find_attrib(bind_config, "max_pause")) != NULL) {
+        jb->max_pause = atoi(str);
+    } else {
+        jb->max_pause = MAX_PAUSE;
+    }
+
+    /* set the loop lag thresholds of the load shedding, 0 disables them */
+    if((str = iks_find_attrib(bind_config, "shed_session_lag")) != NULL) {
+        jb->shed_session_lag = atoi(str);
+    } else {
+        jb->shed_session_lag = SHED_SESSION_LAG;
+    }
+    if((str = iks_find_attrib(bind_config, "shed_accept_lag")) != NULL) {
+        jb->shed_accept_lag = atoi(str);
+    } else {
+        jb->shed_accept_lag = SHED_ACCEPT_LAG;
+    }
+    if((str = iks_find_attrib(bind_config, "retry_after")) != NULL) {
+        jb->retry_after = atoi(str);
+    } else {
+        jb->retry_after = RETRY_AFTER;
+    }
+    jb->overload = 0;
+
+    /* set how much each session may queue before we stop reading the jabber
+     * server, and when we start again */
+    if((str = iks_find_attrib(bind_config, "queue_budget")) != NULL) {
+        jb->queue_budget = atoi(str);
+    } else {
+        jb->queue_budget = QUEUE_BUDGET;
+    }
+    if((str = iks_find_attrib(bind_config, "queue_low_water")) != NULL) {
+        jb->queue_low_water = atoi(str);
+    } else {
+        jb->queue_low_water = QUEUE_LOW_WATER;
+    }
+    if(jb->queue_low_water > jb->queue_budget) {
+        jb->queue_low_water = jb->queue_budget;
+    }
+
+    /* set how long the stanzas wait for more before a held request is
+     * answered, 0 answers right away, and how much is enough anyway */
+    if((str = iks_find_attrib(bind_config, "batch_delay")) != NULL) {
+        jb->batch_delay = atoi(str);
+    } else {
+        jb->batch_delay = 0;
+    }
+    if((str = iks_find_attrib(bind_config, "batch_bytes")) != NULL) {
+        jb->batch_bytes = atoi(str);
+    } else {
+        jb->batch_bytes = BATCH_BYTES;
+    }
+
+    /* set the node id put in the sids, for the router */
+    if((str = iks_find_attrib(bind_config, "node")) != NULL) {
+        jb->node = atoi(str);
+        if(jb->node < 0 || jb->node > SID_MAX_NODE) {
+            fprintf(stderr, "Invalid node id %d.\n", jb->node);
+            free(jb->jabber_path);
+            free(jb);
+            return NULL;
+        }
+    } else {
+        jb->node = -1;
+    }
+
+    /* set the path of the metrics page */
+    if((str = iks_find_attrib(bind_config, "metrics_path")) != NULL) {
+        jb->metrics_path = strdup(str);
+    } else {
+        jb->metrics_path = strdup(METRICS_PATH);
+    }
+
+    /* set the path of the memory breakdown */
+    if((str = iks_find_attrib(bind_config, "memory_path")) != NULL) {
+        jb->memory_path = strdup(str);
+    } else {
+        jb->memory_path = strdup(MEMORY_PATH);
+    }
+
+    /* set the path of the websocket endpoint */
+    if((str = iks_find_attrib(bind_config, "websocket_path")) != NULL) {
+        jb->websocket_path = strdup(str);
+    } else {
+        jb->websocket_path = strdup(WEBSOCKET_PATH);
+    }
+
     /* init log */
     log_init(log_config);
 
+    jb_reserve(jb, bind_config);
+
+    if(jb->jabber_path == NULL) {
+        sock_options_report(&jb->tcp_options, "jabber", 0);
+    }
+
+    /* take the listening socket from the previous process, if any */
+    listen_fd = -1;
+    if((channel = handoff_inherited()) != -1) {
+        if(handoff_recv(channel, &type, NULL, 0, &listen_fd,
+                    HANDOFF_TIMEOUT) < 0 || type != HANDOFF_LISTEN) {
+            log(ERROR, "Failed to take over from the previous process");
+            exit(1);
+        }
+    }
+
     /* create the http server */
-    jb->server = hs_new(http_config, jb_handle_request, jb);
+    jb->server = hs_new(http_config, listen_fd, jb_handle_request, jb);
 
     if(jb->server == NULL) {
         log(ERROR, "Failed to start HTTP server");
+        free(jb->jabber_path);
+        free(jb->metrics_path);
+        free(jb->memory_path);
+        free(jb->websocket_path);
         free(jb);
         return NULL;
     }
 
     /* set other values */
     jb->jabber_connections = list_new();
+    jb->batches = list_new();
     jb->sids = uint64_hash_new();
     jb->start_time = get_time();
     jb->client_count = 0;
     jb->max_client_count = 0;
+    jb->upgrading = 0;
+
+    /* account the memory used by iksemel to the sessions */
+    iks_set_mem_funcs(jb_iks_malloc, jb_iks_free);
+
+    /* take the requests of our sessions from the other workers */
+    if(workers_count() > 1) {
+        hs_set_inbox(jb->server, workers_inbox());
+    }
+
+    /* resume the sessions of the previous process */
+    if(channel != -1 && !jb_import_sessions(jb, channel)) {
+        /* the previous process resumes, we must not touch its sessions */
+        log(ERROR, "Failed to take over from the previous process");
+        exit(1);
+    }
 
     /* seed the random generator */
     srand48(get_time());
@@ -750,11 +2639,16 @@ void jb_delete(JabberBind* bind) {
 
     /* free all data structures */
     list_delete(bind->jabber_connections, NULL);
+    list_delete(bind->batches, NULL);
     uint64_hash_delete(bind->sids);
 
     /* delete the http server */
     hs_delete(bind->server);
 
+    free(bind->jabber_path);
+    free(bind->metrics_path);
+    free(bind->memory_path);
+    free(bind->websocket_path);
     free(bind);
 }
 
@@ -26,8 +26,13 @@
 #include <inttypes.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <glob.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 
 #include "log.h"
+#include "workers.h"
 
 const char VERBOSE_LEVEL_NAME[][64] = {
     "DEBUG",
@@ -36,15 +41,39 @@ const char VERBOSE_LEVEL_NAME[][64] = {
     "ERROR"
 };
 
+/* Log rotation is done by a helper thread so the event loop never blocks on
+ * file housekeeping. When the log file crosses the rotate size, _log raises
+ * rotate_pending. The helper renames the file, opens a new one and publishes
+ * it in new_file. The next _log call swaps the handles and gives the old one
+ * back in old_file. The helper closes it and then runs the compression
+ * command on the rotated file. Only the pointers are exchanged under the
+ * lock, all the I/O is done outside of it. */
 struct {
     char* filename;
     FILE* file;
     uint64_t rotate_size;
     char* compression_command;
     int level;
-} log_conf = {NULL, NULL, 0, NULL, ERROR};
+
+    pthread_t thread;           /* the rotation helper thread              */
+    pthread_mutex_t lock;       /* protects the fields below               */
+    pthread_cond_t cond;        /* wakes up the helper thread              */
+    int thread_running;         /* 1 if the helper thread was started      */
+    int rotate_pending;         /* 1 while a rotation is in progress       */
+    int rotate_request;         /* 1 if the helper must rotate the file    */
+    FILE* new_file;             /* new log file opened by the helper       */
+    FILE* old_file;             /* old log file to be closed by the helper */
+    int quit;                   /* 1 if the helper thread must exit        */
+} log_conf = {NULL, NULL, 0, NULL, ERROR, 0, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, 0, 0, 0, NULL, NULL, 0};
+
+static void log_start_rotation();
+static void log_stop_rotation();
 
 void log_quit() {
+    /* stop the helper thread before touching the files */
+    log_stop_rotation();
+
     if(log_conf.filename != NULL) {
         free(log_conf.filename);
     } 
@@ -129,8 +158,17 @@ void log_set_verbose(const char* level) {
 }
 
 void log_init(iks* config) {
-    /* set log file */
-    log_set_file(iks_find_attrib(config, "filename"));
+    const char* filename = iks_find_attrib(config, "filename");
+    char* worker_filename;
+
+    /* set log file, each worker has its own so they rotate on their own */
+    if(filename != NULL && workers_count() > 1) {
+        asprintf(&worker_filename, "%s.%d", filename, workers_index());
+        log_set_file(worker_filename);
+        free(worker_filename);
+    } else {
+        log_set_file(filename);
+    }
 
     /* set rotation parameters */
     log_set_rotate(iks_find_attrib(config, "rotate_size"),
@@ -138,47 +176,233 @@ void log_init(iks* config) {
 
     /* set log verbose level */
     log_set_verbose(iks_find_attrib(config, "verbose"));
+
+    /* start the rotation thread */
+    log_start_rotation();
+}
+
+/*! \brief Compress a rotated log file
+ *
+ * This runs in the helper thread, so it is fine to wait for the child. */
+static void log_compress(const char* filename) {
+    char* argument = NULL;
+    pid_t pid;
+    int status;
+    int fd;
+    int max_fd;
+
+    if(log_conf.compression_command == NULL) {
+        return;
+    }
+
+    /* prepare command line, the child may only call async-signal-safe
+     * functions since other threads are running */
+    asprintf(&argument, "%s '%s'", log_conf.compression_command, filename);
+    max_fd = sysconf(_SC_OPEN_MAX);
+    if(max_fd < 0) {
+        max_fd = 1024;
+    }
+
+    pid = fork();
+    if(pid == 0) {
+        /* don't leak sockets and log files to the compressor */
+        for(fd = STDERR_FILENO + 1; fd < max_fd; fd++) {
+            close(fd);
+        }
+        execl("/bin/sh", "sh", "-c", argument, (char*) NULL);
+        _exit(127);
+    } else if(pid == -1) {
+        fprintf(stderr, "Could not start log compression: %s\n",
+                strerror(errno));
+    } else {
+        /* reap the child */
+        while(waitpid(pid, &status, 0) == -1 && errno == EINTR);
+        if(WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+            fprintf(stderr, "Could not run log compression: %s\n",
+                    argument);
+        } else if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Log compression failed: %s\n", argument);
+        }
+    }
+
+    free(argument);
+}
+
+/*! \brief Check if a rotated file name is in use
+ *
+ * The name is taken if the file exists or if there is a compressed version of
+ * it, like name.gz */
+static int log_name_taken(const char* name) {
+    char* pattern = NULL;
+    glob_t matches;
+    int ret;
+
+    if(access(name, F_OK) == 0) {
+        return 1;
+    }
+
+    asprintf(&pattern, "%s.*", name);
+    ret = glob(pattern, GLOB_NOSORT, NULL, &matches);
+    if(ret == 0) {
+        globfree(&matches);
+    }
+    free(pattern);
+
+    return ret == 0;
 }
 
-void log_rotate() {
+/*! \brief Rename the current log file and open a new one
+ *
+ * Returns the name of the rotated file, it must be freed by the caller. */
+static char* log_rotate(FILE** new_file) {
     time_t t;
+    struct tm tm;
     char* new_name = NULL;
     char time_str[512];
-
-    /* close current log file */
-    fclose(log_conf.file);
-    log_conf.file = NULL;
+    int i;
 
     /* put the date in the log filename */
     t = time(NULL);
-    strftime(time_str, sizeof(time_str), "%Y-%m-%d-%H-%M-%S", localtime(&t));
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d-%H-%M-%S",
+            localtime_r(&t, &tm));
     asprintf(&new_name, "%s-%s", log_conf.filename, time_str);
-    rename(log_conf.filename, new_name);
 
-    /* compress the log file */
-#if 0
-    char* argument = NULL;
-    if(log_conf.compression_command != NULL) {
-        if(fork() == 0) {
-            /* prepare command line */
-            asprintf(&argument, "%s '%s'", log_conf.compression_command,
-                    new_name);
-            execlp("sh", "sh", "-c", argument, NULL);
-            perror("Error compressing log file");
-            exit(1);
-        }
+    /* don't overwrite a file rotated in the same second */
+    for(i = 1; log_name_taken(new_name); ++i) {
+        free(new_name);
+        asprintf(&new_name, "%s-%s.%d", log_conf.filename, time_str, i);
+    }
+
+    /* the event loop still writes to the renamed file until the new one is
+     * handed to it */
+    if(rename(log_conf.filename, new_name) == -1) {
+        fprintf(stderr, "Could not rename %s: %s\n", log_conf.filename,
+                strerror(errno));
+        free(new_name);
+        new_name = NULL;
     }
-#endif
 
     /* open a new log file */
-    log_conf.file = fopen(log_conf.filename, "aw");
-    if(log_conf.file == NULL) {
+    *new_file = fopen(log_conf.filename, "a");
+    if(*new_file == NULL) {
         fprintf(stderr, "Could not open %s: %s\n", log_conf.filename,
                 strerror(errno));
-        log_conf.file = stdout;
+        *new_file = stdout;
+    }
+
+    return new_name;
+}
+
+/*! \brief The log rotation helper thread */
+static void* log_rotation_thread(void* arg) {
+    FILE* file;
+    char* rotated_name = NULL;
+
+    pthread_mutex_lock(&log_conf.lock);
+    while(!log_conf.quit) {
+        if(log_conf.rotate_request) {
+            /* rename and open the new file */
+            log_conf.rotate_request = 0;
+            pthread_mutex_unlock(&log_conf.lock);
+            rotated_name = log_rotate(&file);
+            pthread_mutex_lock(&log_conf.lock);
+            log_conf.new_file = file;
+        } else if(log_conf.old_file != NULL) {
+            /* the event loop is done with the old file */
+            file = log_conf.old_file;
+            log_conf.old_file = NULL;
+            pthread_mutex_unlock(&log_conf.lock);
+            fclose(file);
+            if(rotated_name != NULL) {
+                log_compress(rotated_name);
+                free(rotated_name);
+                rotated_name = NULL;
+            }
+            pthread_mutex_lock(&log_conf.lock);
+            log_conf.rotate_pending = 0;
+        } else {
+            pthread_cond_wait(&log_conf.cond, &log_conf.lock);
+        }
+    }
+    pthread_mutex_unlock(&log_conf.lock);
+
+    free(rotated_name);
+
+    return NULL;
+}
+
+/*! \brief Start the log rotation helper thread */
+static void log_start_rotation() {
+    if(log_conf.rotate_size == 0 || log_conf.filename == NULL) {
+        return;
+    }
+
+    if(pthread_create(&log_conf.thread, NULL, log_rotation_thread,
+                NULL) != 0) {
+        fprintf(stderr, "Could not start the log rotation thread, log"
+                " rotation is disabled\n");
+        return;
+    }
+
+    log_conf.thread_running = 1;
+}
+
+/*! \brief Stop the log rotation helper thread */
+static void log_stop_rotation() {
+    if(!log_conf.thread_running) {
+        return;
+    }
+
+    pthread_mutex_lock(&log_conf.lock);
+    log_conf.quit = 1;
+    pthread_cond_signal(&log_conf.cond);
+    pthread_mutex_unlock(&log_conf.lock);
+
+    pthread_join(log_conf.thread, NULL);
+    log_conf.thread_running = 0;
+
+    /* close any file that was not handed over */
+    if(log_conf.old_file != NULL) {
+        fclose(log_conf.old_file);
+        log_conf.old_file = NULL;
+    }
+    if(log_conf.new_file != NULL) {
+        if(log_conf.file != NULL && log_conf.file != stdout) {
+            fclose(log_conf.file);
+        }
+        log_conf.file = log_conf.new_file;
+        log_conf.new_file = NULL;
+    }
+}
+
+/*! \brief Ask the helper thread to rotate the log file
+ *
+ * This never blocks on file operations, the new file is picked up by a later
+ * call to log_check_rotation. */
+static void log_check_rotation() {
+    FILE* old_file;
+
+    if(!log_conf.thread_running || log_conf.file == stdout) {
+        return;
     }
 
-    free(new_name);
+    pthread_mutex_lock(&log_conf.lock);
+    if(log_conf.rotate_pending) {
+        /* check if the helper has the new file ready */
+        if(log_conf.new_file != NULL) {
+            old_file = log_conf.file;
+            log_conf.file = log_conf.new_file;
+            log_conf.new_file = NULL;
+            log_conf.old_file = old_file;
+            pthread_cond_signal(&log_conf.cond);
+        }
+    } else if(ftell(log_conf.file) >= log_conf.rotate_size) {
+        /* request a rotation */
+        log_conf.rotate_pending = 1;
+        log_conf.rotate_request = 1;
+        pthread_cond_signal(&log_conf.cond);
+    }
+    pthread_mutex_unlock(&log_conf.lock);
 }
 
 void _log(const char* function_name, int level, const char* format, ...) {
@@ -214,10 +438,6 @@ void _log(const char* function_name, int level, const char* format, ...) {
     free(new_format);
 
     /* check if the file size reached the rotate size */
-    if(log_conf.file != stdout && log_conf.rotate_size > 0) {
-        if(ftell(log_conf.file) >= log_conf.rotate_size) {
-            log_rotate();
-        }
-    }
+    log_check_rotation();
 }
 
@@ -27,17 +27,27 @@
 
 
 #include "jabber_bind.h"
+#include "router.h"
 #include "socket_monitor.h"
 #include "log.h"
+#include "metrics.h"
+#include "handoff.h"
+#include "workers.h"
 
 int main(int argc, char** argv) {
     iks* config = 0;
 	JabberBind* bind = 0;
-    int ret;
+    Router* router = 0;
+    iks* http_config;
+    int ret, workers;
     char* config_file;
+    char* str;
 
     config_file = (argc<2) ? "config.xml" : argv[1];
 
+    /* an upgrade starts the new binary with the same arguments */
+    handoff_init(argv);
+
     /* check if it is ok ti read the file */
     if(access(config_file, R_OK) != 0) {
         fprintf(stderr, "Could not read %s: %s.\n", config_file, strerror(errno));
@@ -51,9 +61,48 @@ int main(int argc, char** argv) {
         return 1;
     }
 
+    /* fork the workers, the master process only waits for them */
+    workers = 1;
+    http_config = iks_find(config, "http_server");
+    if(http_config != NULL &&
+            (str = iks_find_attrib(http_config, "workers")) != NULL) {
+        workers = atoi(str);
+    }
+    ret = workers_start(workers);
+    if(ret != 1) {
+        iks_delete(config);
+        return ret == 0 ? 0 : 1;
+    }
+
     /* init the socket monitor */
     sm_init();
 
+    /* a router only forwards the requests to other instances */
+    if(iks_find(config, "router") != NULL) {
+        router = rt_new(config);
+
+        iks_delete(config);
+
+        if(router == NULL) {
+            fprintf(stderr, "Failed to start router.\n");
+            return 1;
+        }
+
+        workers_ready();
+
+        rt_run(router);
+
+        rt_delete(router);
+
+        sm_quit();
+
+        metrics_quit();
+
+        log_quit();
+
+        return 0;
+    }
+
     bind = jb_new(config);
 
     iks_delete(config);
@@ -63,12 +112,16 @@ int main(int argc, char** argv) {
 		return 1;
 	}
 
+    workers_ready();
+
 	jb_run(bind);
 
 	jb_delete(bind);
 
     sm_quit();
 
+    metrics_quit();
+
     log_quit();
 
     return 0;
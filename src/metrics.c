@@ -0,0 +1,500 @@
+/*
+ *   Copyright (c) 2007-2008 C3SL.
+ *
+ *   This file is part of Bosh.
+ *
+ *   Bosh is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   any later version.
+ *
+ *   Bosh is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "allocator.h"
+
+#define INITIAL_RENDER_BUFFER_SIZE (16*1024)
+
+typedef struct MetricInfo {
+    const char* name;       /* name of the metric family             */
+    const char* labels;     /* labels of this metric, NULL if none   */
+    const char* type;       /* prometheus type                       */
+    const char* help;       /* description of the family             */
+} MetricInfo;
+
+typedef struct HistogramInfo {
+    const char* name;
+    const char* help;
+    int n_bounds;
+    int64_t bounds[MAX_HISTOGRAM_BUCKETS];
+} HistogramInfo;
+
+static const MetricInfo METRIC_TABLE[METRIC_COUNT] = {
+    [METRIC_SOCKET_BYTES_RECEIVED] = {"bosh_socket_received_bytes_total", NULL,
+        "counter", "Bytes received on all sockets."},
+    [METRIC_SOCKET_BYTES_SENT] = {"bosh_socket_sent_bytes_total", NULL,
+        "counter", "Bytes sent on all sockets."},
+    [METRIC_SOCKET_ACCEPTED] = {"bosh_socket_accepted_total", NULL,
+        "counter", "Connections accepted."},
+    [METRIC_SOCKET_ERRORS] = {"bosh_socket_errors_total", NULL,
+        "counter", "Sockets closed because of an error."},
+    [METRIC_SOCKET_QUEUE_ITEMS] = {"bosh_socket_queue_items", NULL,
+        "gauge", "Buffers waiting to be sent on all sockets."},
+    [METRIC_SOCKET_QUEUE_BYTES] = {"bosh_socket_queue_bytes", NULL,
+        "gauge", "Bytes held in the socket output queues."},
+    [METRIC_SOCKET_WRITE_BLOCKED] = {"bosh_socket_write_blocked", NULL,
+        "gauge", "Sockets whose output queue is above the high water mark."},
+    [METRIC_SOCKET_SEND_CALLS] = {"bosh_socket_send_calls_total", NULL,
+        "counter", "System calls that wrote to a socket."},
+    [METRIC_SOCKET_DEFERRED_FLUSHES] = {"bosh_socket_deferred_flushes_total",
+        NULL, "counter", "Output queues flushed at the end of a poll batch."},
+    [METRIC_TLS_HANDSHAKES_KERNEL] = {"bosh_tls_handshakes_total",
+        "record_layer=\"kernel\"", "counter", "TLS handshakes completed, by "
+        "where the records are encrypted."},
+    [METRIC_TLS_HANDSHAKES_USER] = {"bosh_tls_handshakes_total",
+        "record_layer=\"user\"", "counter", "TLS handshakes completed, by "
+        "where the records are encrypted."},
+    [METRIC_TLS_HANDSHAKE_FAILURES] = {"bosh_tls_handshake_failures_total",
+        NULL, "counter", "TLS handshakes that failed."},
+
+    [METRIC_POLL_ITERATIONS] = {"bosh_poll_iterations_total", NULL,
+        "counter", "Iterations of the event loop."},
+    [METRIC_POLL_EVENTS] = {"bosh_poll_events_total", NULL,
+        "counter", "Socket events dispatched by the event loop."},
+    [METRIC_OVERLOAD_LEVEL] = {"bosh_overload_level", NULL,
+        "gauge", "Load shedding: 0 none, 1 new sessions refused, 2 accept "
+        "paused."},
+    [METRIC_OVERLOAD_SHED_SESSIONS] = {"bosh_overload_shed_sessions_total",
+        NULL, "counter", "New sessions refused because the loop lagged."},
+    [METRIC_OVERLOAD_ACCEPT_PAUSES] = {"bosh_overload_accept_pauses_total",
+        NULL, "counter", "Times the http listener stopped accepting because "
+        "the loop lagged."},
+
+    [METRIC_HTTP_CONNECTIONS] = {"bosh_http_connections", NULL,
+        "gauge", "Open HTTP connections."},
+    [METRIC_HTTP_CONNECTIONS_TOTAL] = {"bosh_http_connections_created_total",
+        NULL, "counter", "HTTP connections created."},
+    [METRIC_HTTP_REQUESTS_POST] = {"bosh_http_requests_total",
+        "method=\"POST\"", "counter", "HTTP requests processed."},
+    [METRIC_HTTP_REQUESTS_GET] = {"bosh_http_requests_total",
+        "method=\"GET\"", "counter", "HTTP requests processed."},
+    [METRIC_HTTP_REQUESTS_OTHER] = {"bosh_http_requests_total",
+        "method=\"other\"", "counter", "HTTP requests processed."},
+    [METRIC_HTTP_ERRORS] = {"bosh_http_errors_total", NULL,
+        "counter", "HTTP requests answered with an error page."},
+    [METRIC_WEBSOCKET_CONNECTIONS] = {"bosh_websocket_connections", NULL,
+        "gauge", "Open WebSocket connections."},
+    [METRIC_HTTP_CLOSED_HEADER_TIMEOUT] = {"bosh_http_closed_total",
+        "reason=\"header_timeout\"", "counter", "HTTP connections closed by "
+        "the server."},
+    [METRIC_HTTP_CLOSED_BODY_TIMEOUT] = {"bosh_http_closed_total",
+        "reason=\"body_timeout\"", "counter", "HTTP connections closed by "
+        "the server."},
+    [METRIC_HTTP_CLOSED_IDLE_TIMEOUT] = {"bosh_http_closed_total",
+        "reason=\"idle_timeout\"", "counter", "HTTP connections closed by "
+        "the server."},
+    [METRIC_HTTP_CLOSED_LINGER_TIMEOUT] = {"bosh_http_closed_total",
+        "reason=\"linger_timeout\"", "counter", "HTTP connections closed by "
+        "the server."},
+    [METRIC_HTTP_CLOSED_WEBSOCKET_TIMEOUT] = {"bosh_http_closed_total",
+        "reason=\"websocket_timeout\"", "counter", "HTTP connections closed "
+        "by the server."},
+    [METRIC_HTTP_CLOSED_MAX_REQUESTS] = {"bosh_http_closed_total",
+        "reason=\"max_requests\"", "counter", "HTTP connections closed by "
+        "the server."},
+    [METRIC_RATE_LIMITED_CONNECTIONS] = {"bosh_rate_limited_total",
+        "limit=\"connections\"", "counter", "Connections and requests "
+        "refused by the per address limits."},
+    [METRIC_RATE_LIMITED_REQUESTS] = {"bosh_rate_limited_total",
+        "limit=\"requests\"", "counter", "Connections and requests "
+        "refused by the per address limits."},
+    [METRIC_RATE_LIMITED_SESSIONS] = {"bosh_rate_limited_total",
+        "limit=\"sessions\"", "counter", "Connections and requests "
+        "refused by the per address limits."},
+    [METRIC_RATE_LIMIT_TABLE_FULL] = {"bosh_rate_limit_table_full_total",
+        NULL, "counter", "Addresses let through because the rate limit "
+        "table had no free entry."},
+    [METRIC_RATE_LIMIT_TABLE_BYTES] = {"bosh_rate_limit_table_bytes", NULL,
+        "gauge", "Memory of the rate limit table."},
+
+    [METRIC_SESSIONS] = {"bosh_sessions", NULL,
+        "gauge", "Active BOSH sessions."},
+    [METRIC_SESSIONS_MAX] = {"bosh_sessions_max", NULL,
+        "gauge", "Maximum number of simultaneous BOSH sessions."},
+    [METRIC_SESSIONS_CREATED] = {"bosh_sessions_created_total", NULL,
+        "counter", "BOSH sessions created."},
+    [METRIC_UPSTREAM_CONNECT_FAILURES] = {
+        "bosh_upstream_connect_failures_total", NULL,
+        "counter", "Failed connections to the XMPP server."},
+    [METRIC_HELD_REQUESTS] = {"bosh_held_requests", NULL,
+        "gauge", "Requests held waiting for data."},
+    [METRIC_OUTPUT_QUEUE_STANZAS] = {"bosh_output_queue_stanzas", NULL,
+        "gauge", "Stanzas waiting for a request to be delivered."},
+    [METRIC_OUTPUT_QUEUE_BYTES] = {"bosh_output_queue_bytes", NULL,
+        "gauge", "Memory of the stanzas waiting to be delivered."},
+    [METRIC_UPSTREAM_BYTES_RECEIVED] = {"bosh_upstream_received_bytes_total",
+        NULL, "counter", "Bytes received from the XMPP server."},
+    [METRIC_UPSTREAM_STANZAS_RECEIVED] = {"bosh_upstream_stanzas_total",
+        "direction=\"in\"", "counter", "Stanzas exchanged with the XMPP "
+        "server."},
+    [METRIC_UPSTREAM_STANZAS_SENT] = {"bosh_upstream_stanzas_total",
+        "direction=\"out\"", "counter", "Stanzas exchanged with the XMPP "
+        "server."},
+    [METRIC_RESPONSES_DATA] = {"bosh_responses_total", "type=\"data\"",
+        "counter", "BOSH responses sent."},
+    [METRIC_RESPONSES_EMPTY] = {"bosh_responses_total", "type=\"empty\"",
+        "counter", "BOSH responses sent."},
+    [METRIC_RESPONSES_TERMINATE] = {"bosh_responses_total",
+        "type=\"terminate\"", "counter", "BOSH responses sent."},
+    [METRIC_RESPONSES_ERROR] = {"bosh_responses_total", "type=\"error\"",
+        "counter", "BOSH responses sent."},
+    [METRIC_RESPONSES_RESENT] = {"bosh_responses_total", "type=\"resent\"",
+        "counter", "BOSH responses sent."},
+    [METRIC_TIMEOUTS_REQUEST] = {"bosh_timeouts_total", "type=\"request\"",
+        "counter", "Timeouts fired."},
+    [METRIC_TIMEOUTS_SESSION] = {"bosh_timeouts_total", "type=\"session\"",
+        "counter", "Timeouts fired."},
+    [METRIC_TIMEOUTS_BATCH] = {"bosh_timeouts_total", "type=\"batch\"",
+        "counter", "Timeouts fired."},
+    [METRIC_POLICY_VIOLATIONS] = {"bosh_policy_violations_total", NULL,
+        "counter", "Sessions ended for polling too fast or pausing too long."},
+    [METRIC_UPTIME_SECONDS] = {"bosh_uptime_seconds", NULL,
+        "gauge", "Time since the server started."},
+    [METRIC_SESSION_MEMORY_BYTES] = {"bosh_session_memory_bytes", NULL,
+        "gauge", "Memory used by the parsers and the queued stanzas of the "
+        "sessions, the sessions themselves are counted by their allocator."},
+    [METRIC_SESSIONS_HIBERNATED] = {"bosh_sessions_hibernated", NULL,
+        "gauge", "Idle sessions whose parser was released."},
+    [METRIC_HIBERNATIONS] = {"bosh_hibernations_total", NULL,
+        "counter", "Sessions put into hibernation."},
+    [METRIC_UPSTREAM_PAUSED] = {"bosh_upstream_paused", NULL,
+        "gauge", "Jabber connections not being read because the session "
+        "queue is over budget."},
+    [METRIC_UPSTREAM_PAUSES] = {"bosh_upstream_pauses_total", NULL,
+        "counter", "Times a session queue went over budget."},
+    [METRIC_WEBSOCKET_SESSIONS] = {"bosh_websocket_sessions", NULL,
+        "gauge", "Sessions bridged over a WebSocket instead of BOSH."},
+
+    [METRIC_ROUTER_REQUESTS] = {"bosh_router_requests_total", NULL,
+        "counter", "Requests forwarded to a backend."},
+    [METRIC_ROUTER_UNKNOWN_NODE] = {"bosh_router_unknown_node_total", NULL,
+        "counter", "Requests whose sid names no configured backend."},
+    [METRIC_ROUTER_BACKEND_LINKS] = {"bosh_router_backend_connections", NULL,
+        "gauge", "Open connections to the backends, busy or idle."},
+    [METRIC_ROUTER_BACKEND_ERRORS] = {"bosh_router_backend_errors_total",
+        NULL, "counter", "Backend connections lost while a request was "
+        "forwarded."},
+};
+
+static const HistogramInfo HISTOGRAM_TABLE[HISTOGRAM_COUNT] = {
+    [HISTOGRAM_REQUEST_BYTES] = {"bosh_http_request_body_bytes",
+        "Size of the HTTP request bodies.", 10,
+        {64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 65536}},
+    [HISTOGRAM_RESPONSE_BYTES] = {"bosh_response_body_bytes",
+        "Size of the BOSH response bodies.", 10,
+        {64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 65536}},
+};
+
+static const char* LATENCY_STAGES[LATENCY_COUNT] = {
+    [LATENCY_QUEUE] = "queue",
+    [LATENCY_HOLD_DATA] = "hold_data",
+    [LATENCY_HOLD_EMPTY] = "hold_empty",
+    [LATENCY_HTTP_PARSE] = "http_parse",
+    [LATENCY_XML_PARSE] = "xml_parse",
+    [LATENCY_CONNECT] = "connect",
+    [LATENCY_DISPATCH] = "dispatch",
+    [LATENCY_LOOP_LAG] = "loop_lag",
+};
+
+static const double LATENCY_QUANTILES[] = {0.5, 0.99, 0.999};
+
+int64_t metric_values[METRIC_COUNT];
+
+LatencyHistogram metric_latencies[LATENCY_COUNT];
+
+Histogram metric_histograms[HISTOGRAM_COUNT];
+
+/* the render buffer is kept between calls */
+static struct {
+    char* data;
+    size_t size;
+    size_t capacity;
+} render_buffer = {NULL, 0, 0};
+
+void metric_observe(HistogramId id, int64_t value) {
+    const HistogramInfo* info = &HISTOGRAM_TABLE[id];
+    Histogram* histogram = &metric_histograms[id];
+    int i;
+
+    /* find the bucket, the last one is +Inf */
+    for(i = 0; i < info->n_bounds && value > info->bounds[i]; ++i);
+
+    histogram->buckets[i]++;
+    histogram->sum += value;
+    histogram->count++;
+}
+
+/*! \brief Returns the highest value that falls in the given bucket */
+static int64_t latency_bucket_max(int bucket) {
+    int shift;
+
+    if(bucket < LATENCY_SUB_COUNT) {
+        return bucket;
+    }
+
+    shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    return (((int64_t)(bucket & (LATENCY_SUB_COUNT - 1)) + LATENCY_SUB_COUNT)
+            << shift) + (1ll << shift) - 1;
+}
+
+int64_t latency_quantile(LatencyId id, double quantile) {
+    LatencyHistogram* histogram = &metric_latencies[id];
+    uint64_t rank, total;
+    int i;
+
+    if(histogram->count == 0) {
+        return 0;
+    }
+
+    /* find the first bucket that covers the rank */
+    rank = quantile * histogram->count;
+    if(rank == 0) {
+        rank = 1;
+    }
+    total = 0;
+    for(i = 0; i < LATENCY_BUCKETS; ++i) {
+        total += histogram->buckets[i];
+        if(total >= rank) {
+            break;
+        }
+    }
+
+    /* don't report more than what was really seen */
+    return i < LATENCY_BUCKETS && latency_bucket_max(i) < histogram->max ?
+        latency_bucket_max(i) : histogram->max;
+}
+
+void latency_reset() {
+    memset(metric_latencies, 0, sizeof(metric_latencies));
+}
+
+/*! \brief Append formated text to the render buffer */
+static void metrics_printf(const char* format, ...)
+    __attribute__ ((format (printf, 1, 2)));
+
+static void metrics_printf(const char* format, ...) {
+    va_list args;
+    int n;
+
+    for(;;) {
+        va_start(args, format);
+        n = vsnprintf(render_buffer.data + render_buffer.size,
+                render_buffer.capacity - render_buffer.size, format, args);
+        va_end(args);
+
+        if(n < 0) {
+            return;
+        } else if(render_buffer.size + n < render_buffer.capacity) {
+            render_buffer.size += n;
+            return;
+        }
+
+        /* not enough space, grow the buffer and try again */
+        render_buffer.capacity *= 2;
+        render_buffer.data = realloc(render_buffer.data,
+                render_buffer.capacity);
+    }
+}
+
+/*! \brief Write the help and type lines of a family */
+static void metrics_render_family(const char* name, const char* help,
+        const char* type) {
+    metrics_printf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+const char* metrics_render(size_t* size) {
+    const MetricInfo* info;
+    const HistogramInfo* h_info;
+    Histogram* histogram;
+    uint64_t cumulative;
+    int i, j;
+
+    /* reuse the buffer from the last call */
+    if(render_buffer.data == NULL) {
+        render_buffer.capacity = INITIAL_RENDER_BUFFER_SIZE;
+        render_buffer.data = malloc(render_buffer.capacity);
+    }
+    render_buffer.size = 0;
+    render_buffer.data[0] = 0;
+
+    /* counters and gauges, metrics of the same family are contiguous */
+    for(i = 0; i < METRIC_COUNT; ++i) {
+        info = &METRIC_TABLE[i];
+        if(i == 0 || strcmp(info->name, METRIC_TABLE[i-1].name) != 0) {
+            metrics_render_family(info->name, info->help, info->type);
+        }
+        if(info->labels != NULL) {
+            metrics_printf("%s{%s} %" PRId64 "\n", info->name, info->labels,
+                    metric_values[i]);
+        } else {
+            metrics_printf("%s %" PRId64 "\n", info->name, metric_values[i]);
+        }
+    }
+
+    /* histograms */
+    for(i = 0; i < HISTOGRAM_COUNT; ++i) {
+        h_info = &HISTOGRAM_TABLE[i];
+        histogram = &metric_histograms[i];
+
+        metrics_render_family(h_info->name, h_info->help, "histogram");
+
+        cumulative = 0;
+        for(j = 0; j < h_info->n_bounds; ++j) {
+            cumulative += histogram->buckets[j];
+            metrics_printf("%s_bucket{le=\"%" PRId64 "\"} %" PRIu64 "\n",
+                    h_info->name, h_info->bounds[j], cumulative);
+        }
+        metrics_printf("%s_bucket{le=\"+Inf\"} %" PRIu64 "\n"
+                "%s_sum %" PRId64 "\n%s_count %" PRIu64 "\n",
+                h_info->name, histogram->count,
+                h_info->name, histogram->sum,
+                h_info->name, histogram->count);
+    }
+
+    /* latencies are exported as summaries in seconds */
+    metrics_render_family("bosh_latency_seconds", "Latency of each stage "
+            "of a request.", "summary");
+    for(i = 0; i < LATENCY_COUNT; ++i) {
+        for(j = 0; j < sizeof(LATENCY_QUANTILES)/sizeof(double); ++j) {
+            metrics_printf("bosh_latency_seconds{stage=\"%s\",quantile=\"%g\"}"
+                    " %.9f\n", LATENCY_STAGES[i], LATENCY_QUANTILES[j],
+                    latency_quantile(i, LATENCY_QUANTILES[j]) / 1e9);
+        }
+        metrics_printf("bosh_latency_seconds_sum{stage=\"%s\"} %.9f\n"
+                "bosh_latency_seconds_count{stage=\"%s\"} %" PRIu64 "\n",
+                LATENCY_STAGES[i], metric_latencies[i].sum / 1e9,
+                LATENCY_STAGES[i], metric_latencies[i].count);
+    }
+
+    metrics_render_family("bosh_latency_max_seconds", "Highest latency of "
+            "each stage of a request.", "gauge");
+    for(i = 0; i < LATENCY_COUNT; ++i) {
+        metrics_printf("bosh_latency_max_seconds{stage=\"%s\"} %.9f\n",
+                LATENCY_STAGES[i], metric_latencies[i].max / 1e9);
+    }
+
+    *size = render_buffer.size;
+
+    return render_buffer.data;
+}
+
+/*! \brief Returns the resident memory of the process, 0 if unknown */
+static int64_t metrics_resident_bytes() {
+    FILE* file;
+    long pages = 0;
+
+    file = fopen("/proc/self/statm", "r");
+    if(file == NULL) {
+        return 0;
+    }
+    if(fscanf(file, "%*s %ld", &pages) != 1) {
+        pages = 0;
+    }
+    fclose(file);
+
+    return (int64_t)pages * sysconf(_SC_PAGESIZE);
+}
+
+const char* metrics_render_memory(size_t* size) {
+    static const char* STATES[] = {"live", "free"};
+    AllocatorStats* stats;
+    int64_t allocators = 0, tracked, resident, sessions;
+    size_t count;
+    int i;
+
+    if(render_buffer.data == NULL) {
+        render_buffer.capacity = INITIAL_RENDER_BUFFER_SIZE;
+        render_buffer.data = malloc(render_buffer.capacity);
+    }
+    render_buffer.size = 0;
+    render_buffer.data[0] = 0;
+
+    metrics_render_family("bosh_allocator_objects", "Objects of each "
+            "allocator, handed out or kept for reuse.", "gauge");
+    for(stats = allocator_stats; stats != NULL; stats = stats->next) {
+        for(i = 0; i < 2; ++i) {
+            count = i == 0 ? stats->live : stats->free;
+            metrics_printf("bosh_allocator_objects{type=\"%s\",state=\"%s\"} "
+                    "%zu\n", stats->name, STATES[i], count);
+        }
+    }
+
+    metrics_render_family("bosh_allocator_bytes", "Memory of each "
+            "allocator: its objects and the nodes of its free list.", "gauge");
+    for(stats = allocator_stats; stats != NULL; stats = stats->next) {
+        for(i = 0; i < 2; ++i) {
+            count = i == 0 ? stats->live : stats->free;
+            metrics_printf("bosh_allocator_bytes{type=\"%s\",state=\"%s\"} "
+                    "%zu\n", stats->name, STATES[i],
+                    count * stats->object_size);
+        }
+        metrics_printf("bosh_allocator_bytes{type=\"%s\",state=\"overhead\"} "
+                "%zu\n", stats->name, stats->overhead);
+        allocators += (stats->live + stats->free) * stats->object_size +
+            stats->overhead;
+    }
+
+    /* the session memory includes the queued stanzas */
+    tracked = allocators + metric_values[METRIC_SOCKET_QUEUE_BYTES] +
+        metric_values[METRIC_SESSION_MEMORY_BYTES] +
+        metric_values[METRIC_RATE_LIMIT_TABLE_BYTES];
+    resident = metrics_resident_bytes();
+
+    metrics_render_family("bosh_memory_bytes", "Memory by where it is held, "
+            "tracked is the sum of allocators, socket_queues, sessions and "
+            "rate_limit.", "gauge");
+    metrics_printf("bosh_memory_bytes{area=\"allocators\"} %" PRId64 "\n"
+            "bosh_memory_bytes{area=\"socket_queues\"} %" PRId64 "\n"
+            "bosh_memory_bytes{area=\"sessions\"} %" PRId64 "\n"
+            "bosh_memory_bytes{area=\"stanza_queues\"} %" PRId64 "\n"
+            "bosh_memory_bytes{area=\"rate_limit\"} %" PRId64 "\n"
+            "bosh_memory_bytes{area=\"tracked\"} %" PRId64 "\n"
+            "bosh_memory_bytes{area=\"resident\"} %" PRId64 "\n",
+            allocators, metric_values[METRIC_SOCKET_QUEUE_BYTES],
+            metric_values[METRIC_SESSION_MEMORY_BYTES],
+            metric_values[METRIC_OUTPUT_QUEUE_BYTES],
+            metric_values[METRIC_RATE_LIMIT_TABLE_BYTES], tracked, resident);
+
+    sessions = metric_values[METRIC_SESSIONS];
+    if(sessions > 0) {
+        metrics_render_family("bosh_memory_session_bytes", "Memory divided "
+                "by the number of sessions.", "gauge");
+        metrics_printf("bosh_memory_session_bytes{area=\"tracked\"} %" PRId64
+                "\nbosh_memory_session_bytes{area=\"resident\"} %" PRId64
+                "\n", tracked / sessions, resident / sessions);
+    }
+
+    *size = render_buffer.size;
+
+    return render_buffer.data;
+}
+
+void metrics_quit() {
+    free(render_buffer.data);
+    render_buffer.data = NULL;
+    render_buffer.size = render_buffer.capacity = 0;
+}
@@ -0,0 +1,238 @@
+/*
+ *   Copyright (c) 2007-2008 C3SL.
+ *
+ *   This file is part of Bosh.
+ *
+ *   Bosh is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   any later version.
+ *
+ *   Bosh is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ */
+
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* The metrics registry. Every metric is a slot in a global array, so
+ * updating it is a single memory operation. The names, types and help
+ * strings live in a table in metrics.c and are only used when rendering.
+ *
+ * Everything runs on the event loop thread, so no locking is done. */
+
+/*! \brief The counters and gauges */
+typedef enum MetricId {
+    /* socket layer */
+    METRIC_SOCKET_BYTES_RECEIVED,
+    METRIC_SOCKET_BYTES_SENT,
+    METRIC_SOCKET_ACCEPTED,
+    METRIC_SOCKET_ERRORS,
+    METRIC_SOCKET_QUEUE_ITEMS,
+    METRIC_SOCKET_QUEUE_BYTES,
+    METRIC_SOCKET_WRITE_BLOCKED,
+    METRIC_SOCKET_SEND_CALLS,
+    METRIC_SOCKET_DEFERRED_FLUSHES,
+    METRIC_TLS_HANDSHAKES_KERNEL,
+    METRIC_TLS_HANDSHAKES_USER,
+    METRIC_TLS_HANDSHAKE_FAILURES,
+
+    /* event loop */
+    METRIC_POLL_ITERATIONS,
+    METRIC_POLL_EVENTS,
+    METRIC_OVERLOAD_LEVEL,
+    METRIC_OVERLOAD_SHED_SESSIONS,
+    METRIC_OVERLOAD_ACCEPT_PAUSES,
+
+    /* http server */
+    METRIC_HTTP_CONNECTIONS,
+    METRIC_HTTP_CONNECTIONS_TOTAL,
+    METRIC_HTTP_REQUESTS_POST,
+    METRIC_HTTP_REQUESTS_GET,
+    METRIC_HTTP_REQUESTS_OTHER,
+    METRIC_HTTP_ERRORS,
+    METRIC_WEBSOCKET_CONNECTIONS,
+    METRIC_HTTP_CLOSED_HEADER_TIMEOUT,
+    METRIC_HTTP_CLOSED_BODY_TIMEOUT,
+    METRIC_HTTP_CLOSED_IDLE_TIMEOUT,
+    METRIC_HTTP_CLOSED_LINGER_TIMEOUT,
+    METRIC_HTTP_CLOSED_WEBSOCKET_TIMEOUT,
+    METRIC_HTTP_CLOSED_MAX_REQUESTS,
+    METRIC_RATE_LIMITED_CONNECTIONS,
+    METRIC_RATE_LIMITED_REQUESTS,
+    METRIC_RATE_LIMITED_SESSIONS,
+    METRIC_RATE_LIMIT_TABLE_FULL,
+    METRIC_RATE_LIMIT_TABLE_BYTES,
+
+    /* bosh sessions */
+    METRIC_SESSIONS,
+    METRIC_SESSIONS_MAX,
+    METRIC_SESSIONS_CREATED,
+    METRIC_UPSTREAM_CONNECT_FAILURES,
+    METRIC_HELD_REQUESTS,
+    METRIC_OUTPUT_QUEUE_STANZAS,
+    METRIC_OUTPUT_QUEUE_BYTES,
+    METRIC_UPSTREAM_BYTES_RECEIVED,
+    METRIC_UPSTREAM_STANZAS_RECEIVED,
+    METRIC_UPSTREAM_STANZAS_SENT,
+    METRIC_RESPONSES_DATA,
+    METRIC_RESPONSES_EMPTY,
+    METRIC_RESPONSES_TERMINATE,
+    METRIC_RESPONSES_ERROR,
+    METRIC_RESPONSES_RESENT,
+    METRIC_TIMEOUTS_REQUEST,
+    METRIC_TIMEOUTS_SESSION,
+    METRIC_TIMEOUTS_BATCH,
+    METRIC_POLICY_VIOLATIONS,
+    METRIC_UPTIME_SECONDS,
+    METRIC_SESSION_MEMORY_BYTES,
+    METRIC_SESSIONS_HIBERNATED,
+    METRIC_HIBERNATIONS,
+    METRIC_UPSTREAM_PAUSED,
+    METRIC_UPSTREAM_PAUSES,
+    METRIC_WEBSOCKET_SESSIONS,
+
+    /* router */
+    METRIC_ROUTER_REQUESTS,
+    METRIC_ROUTER_UNKNOWN_NODE,
+    METRIC_ROUTER_BACKEND_LINKS,
+    METRIC_ROUTER_BACKEND_ERRORS,
+
+    METRIC_COUNT
+} MetricId;
+
+/*! \brief The histograms */
+typedef enum HistogramId {
+    HISTOGRAM_REQUEST_BYTES,
+    HISTOGRAM_RESPONSE_BYTES,
+
+    HISTOGRAM_COUNT
+} HistogramId;
+
+#define MAX_HISTOGRAM_BUCKETS 16
+
+typedef struct Histogram {
+    uint64_t buckets[MAX_HISTOGRAM_BUCKETS + 1];
+    int64_t sum;
+    uint64_t count;
+} Histogram;
+
+/*! \brief The latency histograms of each stage of a request */
+typedef enum LatencyId {
+    LATENCY_QUEUE,          /* stanza arrival until it is sent to the client */
+    LATENCY_HOLD_DATA,      /* request hold time when answered with data     */
+    LATENCY_HOLD_EMPTY,     /* request hold time when answered empty         */
+    LATENCY_HTTP_PARSE,     /* http header parsing                           */
+    LATENCY_XML_PARSE,      /* request body parsing                          */
+    LATENCY_CONNECT,        /* connection to the XMPP server                 */
+    LATENCY_DISPATCH,       /* handling of a single event in sm_poll         */
+    LATENCY_LOOP_LAG,       /* late wakeup plus dispatch of a poll batch     */
+
+    LATENCY_COUNT
+} LatencyId;
+
+/* Latencies are kept in log-linear histograms: each power of two is split in
+ * 2^LATENCY_SUB_BITS linear buckets, so the relative error is below 1/16.
+ * Values are in nanoseconds and are clamped to 2^LATENCY_MAX_BITS (about 18
+ * minutes), so each histogram has a fixed size of a few kilobytes. */
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_COUNT (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS 40
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) \
+        * LATENCY_SUB_COUNT)
+
+typedef struct LatencyHistogram {
+    uint64_t buckets[LATENCY_BUCKETS];
+    uint64_t count;
+    int64_t sum;
+    int64_t max;
+} LatencyHistogram;
+
+extern int64_t metric_values[METRIC_COUNT];
+
+extern LatencyHistogram metric_latencies[LATENCY_COUNT];
+
+extern Histogram metric_histograms[HISTOGRAM_COUNT];
+
+/*! \brief Increment a counter or a gauge */
+static inline void metric_inc(MetricId id) {
+    metric_values[id]++;
+}
+
+/*! \brief Decrement a gauge */
+static inline void metric_dec(MetricId id) {
+    metric_values[id]--;
+}
+
+/*! \brief Add a value to a counter or a gauge */
+static inline void metric_add(MetricId id, int64_t value) {
+    metric_values[id] += value;
+}
+
+/*! \brief Set the value of a gauge */
+static inline void metric_set(MetricId id, int64_t value) {
+    metric_values[id] = value;
+}
+
+/*! \brief Record a value in a histogram */
+void metric_observe(HistogramId id, int64_t value);
+
+/*! \brief Returns the bucket of a latency value */
+static inline int latency_bucket(int64_t value) {
+    int shift;
+
+    if(value < LATENCY_SUB_COUNT) {
+        return value < 0 ? 0 : value;
+    } else if(value >= (1ll << LATENCY_MAX_BITS)) {
+        return LATENCY_BUCKETS - 1;
+    }
+
+    /* the highest bits select the power of two, the next LATENCY_SUB_BITS
+     * select the linear bucket inside it */
+    shift = 63 - __builtin_clzll(value) - LATENCY_SUB_BITS;
+    return ((shift + 1) << LATENCY_SUB_BITS) +
+        (int)(value >> shift) - LATENCY_SUB_COUNT;
+}
+
+/*! \brief Record the latency of a stage in nanoseconds */
+static inline void latency_record(LatencyId id, int64_t ns) {
+    LatencyHistogram* histogram = &metric_latencies[id];
+
+    histogram->buckets[latency_bucket(ns)]++;
+    histogram->count++;
+    histogram->sum += ns;
+    if(ns > histogram->max) {
+        histogram->max = ns;
+    }
+}
+
+/*! \brief Returns the value at the given quantile of a latency histogram */
+int64_t latency_quantile(LatencyId id, double quantile);
+
+/*! \brief Clear all latency histograms */
+void latency_reset();
+
+/*! \brief Render all metrics in the prometheus text format.
+ *
+ * The returned buffer is owned by the registry and is reused by the next
+ * call. */
+const char* metrics_render(size_t* size);
+
+/*! \brief Render the memory held by each allocator and subsystem, in the
+ * prometheus text format.
+ *
+ * The buffer is the one of metrics_render. */
+const char* metrics_render_memory(size_t* size);
+
+/*! \brief Free the memory used by the registry */
+void metrics_quit();
+
+#endif
@@ -0,0 +1,320 @@
+/*
+ *   Copyright (c) 2007-2008 C3SL.
+ *
+ *   This file is part of Bosh.
+ *
+ *   Bosh is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   any later version.
+ *
+ *   Bosh is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rate_limit.h"
+#include "time.h"
+#include "log.h"
+#include "metrics.h"
+
+/* slots looked at for an address before giving up */
+#define RL_PROBES 8
+
+/* the buckets count thousandths of a token, so a rate of r tokens per second
+ * adds r of them every ms */
+#define RL_TOKEN 1000
+
+/* An address, or rather its prefix. An entry with no connection and full
+ * buckets holds no information, it is free to take for another address. */
+typedef struct RateEntry {
+    PeerAddress key;
+    uint32_t connections;
+    int32_t requests;           /* tokens left, in thousandths  */
+    int32_t sessions;
+    uint32_t refill;            /* ms of the last refill, wraps */
+} RateEntry;
+
+struct RateLimiter {
+    RateEntry* entries;
+    size_t mask;                /* the size is a power of two   */
+    uint64_t seed;              /* keeps the slots unpredictable */
+    uint32_t max_connections;   /* 0 for no limit               */
+    int request_rate;           /* tokens per second, 0 for no limit */
+    int32_t request_burst;      /* in thousandths of a token    */
+    int session_rate;
+    int32_t session_burst;
+    int prefix_v4;
+    int prefix_v6;
+};
+
+/* Reads a positive integer attribute */
+static int rl_attrib(iks* config, const char* name, int value) {
+    const char* str;
+
+    if(config != NULL && (str = iks_find_attrib(config, name)) != NULL &&
+            atoi(str) >= 0) {
+        value = atoi(str);
+    }
+    return value;
+}
+
+/*! \brief Create the limiter configured on the http server
+ *
+ * Returns NULL if no limit is set. */
+RateLimiter* rl_new(iks* config) {
+    RateLimiter* limiter;
+    size_t size, i;
+    int burst;
+
+    limiter = malloc(sizeof(RateLimiter));
+
+    limiter->max_connections = rl_attrib(config, "ip_max_connections", 0);
+    limiter->request_rate = rl_attrib(config, "ip_request_rate", 0);
+    burst = rl_attrib(config, "ip_request_burst", 2 * limiter->request_rate);
+    if(burst < 1) {
+        burst = 1;
+    }
+    limiter->request_burst = burst > INT32_MAX / RL_TOKEN ?
+        INT32_MAX : burst * RL_TOKEN;
+    limiter->session_rate = rl_attrib(config, "ip_session_rate", 0);
+    burst = rl_attrib(config, "ip_session_burst", 2 * limiter->session_rate);
+    if(burst < 1) {
+        burst = 1;
+    }
+    limiter->session_burst = burst > INT32_MAX / RL_TOKEN ?
+        INT32_MAX : burst * RL_TOKEN;
+
+    if(limiter->max_connections == 0 && limiter->request_rate == 0 &&
+            limiter->session_rate == 0) {
+        free(limiter);
+        return NULL;
+    }
+
+    limiter->prefix_v4 = rl_attrib(config, "ip_prefix_v4", RL_PREFIX_V4);
+    if(limiter->prefix_v4 > 32) {
+        limiter->prefix_v4 = 32;
+    }
+    limiter->prefix_v6 = rl_attrib(config, "ip_prefix_v6", RL_PREFIX_V6);
+    if(limiter->prefix_v6 > 128) {
+        limiter->prefix_v6 = 128;
+    }
+
+    /* round the size up to a power of two */
+    size = RL_PROBES;
+    while(size < (size_t)rl_attrib(config, "ip_table_size", RL_TABLE_SIZE)) {
+        size <<= 1;
+    }
+    limiter->mask = size - 1;
+    limiter->seed = (uint64_t)get_time_ns() * 0x9e3779b97f4a7c15ull ^ getpid();
+
+    limiter->entries = malloc(size * sizeof(RateEntry));
+    metric_add(METRIC_RATE_LIMIT_TABLE_BYTES, size * sizeof(RateEntry));
+    for(i = 0; i < size; ++i) {
+        memset(&limiter->entries[i].key, 0, sizeof(PeerAddress));
+        limiter->entries[i].connections = 0;
+        limiter->entries[i].requests = limiter->request_burst;
+        limiter->entries[i].sessions = limiter->session_burst;
+        limiter->entries[i].refill = 0;
+    }
+
+    log(INFO, "Rate limits per address: %u connections, %d requests/s, "
+            "%d sessions/s, %zu entries", limiter->max_connections,
+            limiter->request_rate, limiter->session_rate, size);
+
+    return limiter;
+}
+
+/*! \brief Release the table */
+void rl_delete(RateLimiter* limiter) {
+    if(limiter == NULL) {
+        return;
+    }
+    metric_add(METRIC_RATE_LIMIT_TABLE_BYTES,
+            -(int64_t)((limiter->mask + 1) * sizeof(RateEntry)));
+    free(limiter->entries);
+    free(limiter);
+}
+
+/* Returns the prefix an address is counted under */
+static void rl_key(RateLimiter* limiter, const PeerAddress* address,
+        PeerAddress* key) {
+    static const unsigned char mapped[12] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+    };
+    int bits, i;
+
+    *key = *address;
+    if(memcmp(address->bytes, mapped, sizeof(mapped)) == 0) {
+        bits = 96 + limiter->prefix_v4;
+    } else {
+        bits = limiter->prefix_v6;
+    }
+
+    for(i = bits / 8; i < 16; ++i) {
+        key->bytes[i] = i == bits / 8 ? key->bytes[i] & (0xff00 >> (bits % 8))
+            : 0;
+    }
+}
+
+/* Returns the first slot of a key */
+static size_t rl_slot(RateLimiter* limiter, const PeerAddress* key) {
+    uint64_t a, b, h;
+
+    memcpy(&a, key->bytes, 8);
+    memcpy(&b, key->bytes + 8, 8);
+
+    h = (a ^ limiter->seed) * 0xff51afd7ed558ccdull;
+    h = (h ^ (h >> 32) ^ b) * 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 29;
+
+    return h & limiter->mask;
+}
+
+/* Adds the tokens earned since the last refill */
+static int32_t rl_fill(int32_t tokens, uint32_t elapsed, int rate,
+        int32_t burst) {
+    int64_t value = tokens + (int64_t)elapsed * rate;
+
+    return value > burst ? burst : value;
+}
+
+static void rl_refill(RateLimiter* limiter, RateEntry* entry, uint32_t now) {
+    /* the clock wraps after 49 days, an entry that old may get less tokens
+     * than its due once */
+    uint32_t elapsed = now - entry->refill;
+
+    entry->refill = now;
+    entry->requests = rl_fill(entry->requests, elapsed, limiter->request_rate,
+            limiter->request_burst);
+    entry->sessions = rl_fill(entry->sessions, elapsed, limiter->session_rate,
+            limiter->session_burst);
+}
+
+/* Returns the entry of an address, taking a free one if it has none
+ *
+ * When the slots of the address are all in use, NULL is returned and the
+ * address is not limited: the table is sized for the normal load, a flood of
+ * addresses must not lock out the clients already in it. */
+static RateEntry* rl_find(RateLimiter* limiter, const PeerAddress* address,
+        int create) {
+    RateEntry* entry;
+    RateEntry* free_entry = NULL;
+    PeerAddress key;
+    uint32_t now = get_time();
+    size_t slot;
+    int i;
+
+    rl_key(limiter, address, &key);
+    slot = rl_slot(limiter, &key);
+
+    for(i = 0; i < RL_PROBES; ++i) {
+        entry = &limiter->entries[(slot + i) & limiter->mask];
+        rl_refill(limiter, entry, now);
+        if(memcmp(&entry->key, &key, sizeof(key)) == 0) {
+            return entry;
+        }
+        if(free_entry == NULL && entry->connections == 0 &&
+                entry->requests == limiter->request_burst &&
+                entry->sessions == limiter->session_burst) {
+            free_entry = entry;
+        }
+    }
+
+    if(!create) {
+        return NULL;
+    }
+    if(free_entry == NULL) {
+        metric_inc(METRIC_RATE_LIMIT_TABLE_FULL);
+        return NULL;
+    }
+
+    free_entry->key = key;
+    return free_entry;
+}
+
+/*! \brief Count a new connection from an address
+ *
+ * Returns 0 if the address has too many connections open already, then the
+ * connection must be closed without calling rl_disconnect. */
+int rl_connect(RateLimiter* limiter, const PeerAddress* address) {
+    RateEntry* entry;
+
+    if(limiter == NULL || limiter->max_connections == 0) {
+        return 1;
+    }
+
+    entry = rl_find(limiter, address, 1);
+    if(entry == NULL) {
+        return 1;
+    }
+    if(entry->connections >= limiter->max_connections) {
+        return 0;
+    }
+    entry->connections++;
+
+    return 1;
+}
+
+/*! \brief Count a connection closed, after rl_connect accepted it */
+void rl_disconnect(RateLimiter* limiter, const PeerAddress* address) {
+    RateEntry* entry;
+
+    if(limiter == NULL || limiter->max_connections == 0) {
+        return;
+    }
+
+    /* the connection went uncounted if the table was full */
+    entry = rl_find(limiter, address, 0);
+    if(entry != NULL && entry->connections > 0) {
+        entry->connections--;
+    }
+}
+
+/*! \brief Take a token for a request, returns 0 if there is none left */
+int rl_request(RateLimiter* limiter, const PeerAddress* address) {
+    RateEntry* entry;
+
+    if(limiter == NULL || limiter->request_rate == 0) {
+        return 1;
+    }
+
+    entry = rl_find(limiter, address, 1);
+    if(entry == NULL) {
+        return 1;
+    }
+    if(entry->requests < RL_TOKEN) {
+        return 0;
+    }
+    entry->requests -= RL_TOKEN;
+
+    return 1;
+}
+
+/*! \brief Take a token for a new session, returns 0 if there is none left */
+int rl_session(RateLimiter* limiter, const PeerAddress* address) {
+    RateEntry* entry;
+
+    if(limiter == NULL || limiter->session_rate == 0) {
+        return 1;
+    }
+
+    entry = rl_find(limiter, address, 1);
+    if(entry == NULL) {
+        return 1;
+    }
+    if(entry->sessions < RL_TOKEN) {
+        return 0;
+    }
+    entry->sessions -= RL_TOKEN;
+
+    return 1;
+}
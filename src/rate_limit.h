@@ -0,0 +1,53 @@
+/*
+ *   Copyright (c) 2007-2008 C3SL.
+ *
+ *   This file is part of Bosh.
+ *
+ *   Bosh is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   any later version.
+ *
+ *   Bosh is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ */
+
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <iksemel.h>
+
+#include "socket.h"
+
+/* Limits per client address: the open connections, and token buckets for
+ * the requests and the new sessions. The addresses live in a fixed table
+ * allocated at startup, so a flood of addresses costs no memory. */
+
+/* default size of the table, in entries of 32 bytes */
+#define RL_TABLE_SIZE 65536
+
+/* default prefixes an address is counted under */
+#define RL_PREFIX_V4 32
+#define RL_PREFIX_V6 64
+
+struct RateLimiter;
+
+typedef struct RateLimiter RateLimiter;
+
+RateLimiter* rl_new(iks* config);
+
+void rl_delete(RateLimiter* limiter);
+
+int rl_connect(RateLimiter* limiter, const PeerAddress* address);
+
+void rl_disconnect(RateLimiter* limiter, const PeerAddress* address);
+
+int rl_request(RateLimiter* limiter, const PeerAddress* address);
+
+int rl_session(RateLimiter* limiter, const PeerAddress* address);
+
+#endif
@@ -0,0 +1,784 @@
+/*
+ *   Copyright (c) 2007-2008 C3SL.
+ *
+ *   This file is part of Bosh.
+ *
+ *   Bosh is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   any later version.
+ *
+ *   Bosh is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <signal.h>
+#include <inttypes.h>
+
+#include <iksemel.h>
+
+#include "router.h"
+#include "http_server.h"
+#include "socket_monitor.h"
+#include "socket.h"
+#include "list.h"
+#include "log.h"
+#include "allocator.h"
+#include "metrics.h"
+#include "time.h"
+
+/* idle connections kept open to each backend */
+#define POOL_SIZE (16)
+
+#define READ_SIZE (16 * 1024)
+
+/* a backend response bigger than this is a protocol error */
+#define MAX_RESPONSE_SIZE (16 * 1024 * 1024)
+
+#define MAX_ATTRIB_SIZE (32)
+
+#define FORWARD_HEADER "POST %s HTTP/1.1\r\n" \
+                        "Host: %s\r\n" \
+                        "Content-Type: text/xml; charset=UTF-8\r\n" \
+                        "Content-Length: %d\r\n" \
+                        "%s" \
+                        "\r\n"
+
+#define FORWARDED_FOR_FIELD "X-Forwarded-For: %s\r\n"
+
+#define ERROR_RESPONSE "<body type='terminate' condition='%s' xmlns='http://jabber.org/protocol/httpbind'/>"
+
+#define METRICS_PATH "/metrics"
+
+struct Backend;
+
+/* A persistent http connection to a backend */
+typedef struct BackendLink {
+    Socket* sock;
+    struct Backend* backend;
+    HttpConnection* client;     /* waiting for the response, NULL if gone */
+    int busy;                   /* a request was forwarded on it          */
+    int closing;                /* the backend closes it after a response */
+    char* buffer;               /* the response read so far               */
+    size_t buffer_size, buffer_len;
+    size_t response_size;       /* header plus content, 0 if not known    */
+    char* request;              /* a copy of the request sent on a pooled
+                                   link, to retry it if the backend closed
+                                   the link meanwhile, or NULL            */
+    size_t request_size;
+    list_iterator it;           /* position in the busy or idle list      */
+} BackendLink;
+
+/* A bosh instance behind the router */
+typedef struct Backend {
+    int node;                   /* the node id found in its sids          */
+    char* host;
+    int port;
+    char* path;                 /* unix socket of the backend or NULL     */
+    char* authority;            /* the Host header of the requests        */
+    list* idle_links;
+    list* busy_links;
+    int idle_count;
+    struct Router* router;
+} Backend;
+
+struct Router {
+    HttpServer* server;
+    Backend* backends;
+    int backend_count;
+    int pool_size;
+    char* metrics_path;
+    time_type start_time;
+    SocketOptions tcp_options;  /* tcp options of the backend links      */
+};
+
+DECLARE_ALLOCATOR(BackendLink);
+IMPLEMENT_ALLOCATOR(BackendLink);
+
+static volatile int running;
+
+/*! \brief Find an attribute of the <body> element without parsing the xml
+ *
+ * Only the start tag is scanned. Returns 1 and copies the value if the
+ * attribute is there, 0 otherwise. */
+int rt_find_attrib(const char* data, size_t size, const char* name,
+        char* value, size_t value_size) {
+    const char* end = data + size;
+    const char* p,* attrib,* start;
+    size_t name_len = strlen(name);
+    size_t attrib_len, n;
+    char quote;
+
+    p = memmem(data, size, "<body", 5);
+    if(p == NULL) {
+        return 0;
+    }
+
+    for(p += 5; p < end && *p != '>';) {
+        if(isspace((unsigned char)*p) || *p == '/') {
+            ++p;
+            continue;
+        }
+
+        /* read the attribute name */
+        attrib = p;
+        while(p < end && *p != '=' && *p != '>' &&
+                !isspace((unsigned char)*p)) {
+            ++p;
+        }
+        attrib_len = p - attrib;
+        while(p < end && isspace((unsigned char)*p)) {
+            ++p;
+        }
+        if(p == end || *p != '=') {
+            continue;
+        }
+
+        /* read the quoted value */
+        for(++p; p < end && isspace((unsigned char)*p); ++p);
+        if(p == end || (*p != '\'' && *p != '"')) {
+            return 0;
+        }
+        quote = *p++;
+        start = p;
+        p = memchr(p, quote, end - p);
+        if(p == NULL) {
+            return 0;
+        }
+
+        if(attrib_len == name_len && memcmp(attrib, name, name_len) == 0) {
+            n = p - start;
+            if(n >= value_size) {
+                n = value_size - 1;
+            }
+            memcpy(value, start, n);
+            value[n] = 0;
+            return 1;
+        }
+        ++p;
+    }
+
+    return 0;
+}
+
+/*! \brief Returns 1 if the <body> element has no children
+ *
+ * Like rt_find_attrib, the xml is not parsed. Returns 0 if unsure. */
+int rt_body_empty(const char* data, size_t size) {
+    const char* end = data + size;
+    const char* p;
+    char quote = 0;
+
+    p = memmem(data, size, "<body", 5);
+    if(p == NULL) {
+        return 0;
+    }
+
+    /* find the end of the start tag, a quoted value can hold a '>' */
+    for(p += 5; p < end; ++p) {
+        if(quote != 0) {
+            quote = *p == quote ? 0 : quote;
+        } else if(*p == '\'' || *p == '"') {
+            quote = *p;
+        } else if(*p == '>') {
+            break;
+        }
+    }
+    if(p == end) {
+        return 0;
+    }
+    if(p[-1] == '/') {
+        return 1;
+    }
+
+    /* only spaces before the end tag */
+    for(++p; p < end && isspace((unsigned char)*p); ++p);
+
+    return end - p >= 6 && memcmp(p, "</body", 6) == 0;
+}
+
+/*! \brief Scramble the bits of a key */
+static inline uint64_t rt_mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+/*! \brief Choose the backend of a new session
+ *
+ * Rendezvous hashing: each backend scores the key and the highest score
+ * wins, so adding a backend only takes the keys it now wins. */
+static Backend* rt_pick_backend(Router* router, uint64_t key) {
+    Backend* best = NULL;
+    uint64_t score, best_score = 0;
+    int i;
+
+    for(i = 0; i < router->backend_count; ++i) {
+        score = rt_mix(key ^ rt_mix(router->backends[i].node));
+        if(best == NULL || score > best_score) {
+            best = &router->backends[i];
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
+/*! \brief Find the backend that owns a sid */
+static Backend* rt_find_backend(Router* router, uint64_t sid) {
+    int node = sid >> SID_NODE_SHIFT;
+    int i;
+
+    for(i = 0; i < router->backend_count; ++i) {
+        if(router->backends[i].node == node) {
+            return &router->backends[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*! \brief Answer the client with a bosh error */
+static void rt_report_error(HttpConnection* connection, const char* condition) {
+    char* body;
+
+    asprintf(&body, ERROR_RESPONSE, condition);
+    hs_answer_request(connection, body, strlen(body), HTTP_XML_CONTENT);
+}
+
+/*! \brief Close a connection to a backend */
+static void rt_link_delete(BackendLink* link) {
+    Backend* backend = link->backend;
+
+    log(INFO, "Backend connection closed node=%d socket=%p", backend->node,
+            link->sock);
+
+    if(link->client != NULL) {
+        hc_set_close_callback(link->client, NULL, NULL);
+    }
+    list_erase(link->it);
+    if(!link->busy) {
+        backend->idle_count--;
+    }
+
+    sock_delete(link->sock);
+    free(link->buffer);
+    free(link->request);
+    metric_dec(METRIC_ROUTER_BACKEND_LINKS);
+
+    BackendLink_free(link);
+}
+
+static BackendLink* rt_link_open(Backend* backend);
+static void rt_client_closed(void* _link);
+
+/*! \brief Send the request again on a new connection
+ *
+ * A pooled connection can be closed by the backend just as a request is
+ * sent on it. Returns 1 if the request was sent again. */
+static int rt_link_retry(BackendLink* link) {
+    BackendLink* retry;
+
+    if(link->request == NULL || link->client == NULL ||
+            link->buffer_len != 0) {
+        return 0;
+    }
+
+    retry = rt_link_open(link->backend);
+    if(retry == NULL) {
+        return 0;
+    }
+
+    log(INFO, "Retrying a request on a new connection node=%d",
+            link->backend->node);
+
+    sock_send(retry->sock, link->request, link->request_size, 0);
+    link->request = NULL;
+
+    retry->client = link->client;
+    hc_set_close_callback(retry->client, rt_client_closed, retry);
+    link->client = NULL;
+
+    return 1;
+}
+
+/*! \brief The connection to the backend is lost */
+static void rt_link_fail(BackendLink* link) {
+    if(rt_link_retry(link)) {
+        rt_link_delete(link);
+        return;
+    }
+
+    if(link->busy) {
+        log(WARNING, "Lost the connection to backend node=%d",
+                link->backend->node);
+        metric_inc(METRIC_ROUTER_BACKEND_ERRORS);
+    }
+
+    /* the session might still be alive, let the client retry */
+    if(link->client != NULL) {
+        rt_report_error(link->client, "remote-connection-failed");
+        link->client = NULL;
+    }
+
+    rt_link_delete(link);
+}
+
+/*! \brief Put the connection back in the pool, or close it if full */
+static void rt_link_release(BackendLink* link) {
+    Backend* backend = link->backend;
+
+    link->client = NULL;
+    link->buffer_len = 0;
+    link->response_size = 0;
+    free(link->request);
+    link->request = NULL;
+
+    if(link->closing || backend->idle_count >= backend->router->pool_size) {
+        rt_link_delete(link);
+        return;
+    }
+
+    list_erase(link->it);
+    link->it = list_push_back(backend->idle_links, link);
+    link->busy = 0;
+    backend->idle_count++;
+}
+
+/*! \brief Find the size of the response once its header is complete
+ *
+ * Returns 1 if the size is known, 0 if more data is needed and -1 if the
+ * response is malformed. */
+static int rt_link_parse(BackendLink* link) {
+    HttpHeader* header;
+    const char* end;
+    const char* str;
+    long content_size;
+
+    end = strstr(link->buffer, HTTP_LINE_SEP HTTP_LINE_SEP);
+    if(end == NULL) {
+        return link->buffer_len > READ_SIZE ? -1 : 0;
+    }
+
+    header = http_parse(link->buffer);
+    if(header == NULL) {
+        return -1;
+    }
+    str = http_get_field(header, "Content-Length");
+    content_size = str != NULL ? atol(str) : 0;
+    str = http_get_field(header, "Connection");
+    link->closing = str != NULL && strcasestr(str, "close") != NULL;
+    http_delete(header);
+
+    if(content_size < 0 || content_size > MAX_RESPONSE_SIZE) {
+        return -1;
+    }
+
+    link->response_size = end + 4 - link->buffer + content_size;
+
+    return 1;
+}
+
+/*! \brief Read the response of a backend */
+static void rt_link_read(void* _link) {
+    BackendLink* link = _link;
+    ssize_t ret;
+
+    /* keep room for at least one read and the terminating null */
+    if(link->buffer_size - link->buffer_len < READ_SIZE + 1) {
+        link->buffer_size = link->buffer_len + READ_SIZE + 1;
+        link->buffer = realloc(link->buffer, link->buffer_size);
+    }
+
+    ret = sock_recv(link->sock, link->buffer + link->buffer_len, READ_SIZE);
+
+    if(ret > 0) {
+        link->buffer_len += ret;
+        link->buffer[link->buffer_len] = 0;
+
+        /* nothing is expected on an idle connection */
+        if(!link->busy ||
+                (link->response_size == 0 && rt_link_parse(link) < 0) ||
+                (link->response_size != 0 &&
+                 link->buffer_len > link->response_size)) {
+            log(WARNING, "Unexpected data from backend node=%d",
+                    link->backend->node);
+            rt_link_fail(link);
+            return;
+        }
+
+        if(link->response_size != 0 &&
+                link->buffer_len == link->response_size) {
+            /* relay the response as is, the buffer goes with it */
+            if(link->client != NULL) {
+                hs_answer_raw(link->client, link->buffer, link->buffer_len);
+                link->buffer = NULL;
+                link->buffer_size = 0;
+            }
+            rt_link_release(link);
+            return;
+        }
+    }
+
+    if(sock_status(link->sock) != SOCKET_CONNECTED) {
+        rt_link_fail(link);
+    }
+}
+
+/*! \brief Handle an error on a backend connection */
+static void rt_link_error(void* _link, int code) {
+    rt_link_fail(_link);
+}
+
+/*! \brief Handle the end of the connection attempt */
+static void rt_link_connected(int code, void* _link) {
+    BackendLink* link = _link;
+
+    if(code != 0) {
+        log(WARNING, "Could not connect to backend node=%d %s: %s",
+                link->backend->node, link->backend->path != NULL ?
+                link->backend->path : link->backend->authority,
+                strerror(code));
+        rt_link_fail(link);
+    }
+}
+
+/*! \brief Open a new connection to the backend */
+static BackendLink* rt_link_open(Backend* backend) {
+    BackendLink* link;
+
+    link = BackendLink_alloc();
+    link->sock = sock_new();
+    sock_set_options(link->sock, &backend->router->tcp_options);
+    link->backend = backend;
+    link->client = NULL;
+    link->busy = 1;
+    link->closing = 0;
+    link->buffer = NULL;
+    link->buffer_size = 0;
+    link->buffer_len = 0;
+    link->response_size = 0;
+    link->request = NULL;
+    link->request_size = 0;
+
+    if((backend->path != NULL ?
+                sock_connect_unix(link->sock, backend->path) :
+                sock_connect(link->sock, backend->host, backend->port)) == 0) {
+        sock_delete(link->sock);
+        BackendLink_free(link);
+        return NULL;
+    }
+
+    sock_set_data_callback(link->sock, rt_link_read, link);
+    sock_set_error_callback(link->sock, rt_link_error, link);
+    sock_set_connect_callback(link->sock, rt_link_connected, link);
+    link->it = list_push_back(backend->busy_links, link);
+    metric_inc(METRIC_ROUTER_BACKEND_LINKS);
+
+    log(INFO, "Backend connection created node=%d socket=%p", backend->node,
+            link->sock);
+
+    return link;
+}
+
+/*! \brief Take an idle connection to the backend, or open a new one */
+static BackendLink* rt_link_get(Backend* backend) {
+    BackendLink* link;
+
+    if(list_empty(backend->idle_links)) {
+        return rt_link_open(backend);
+    }
+
+    link = list_front(backend->idle_links);
+    list_erase(link->it);
+    link->it = list_push_back(backend->busy_links, link);
+    backend->idle_count--;
+    link->busy = 1;
+
+    return link;
+}
+
+/*! \brief The client went away, drop the response when it comes */
+static void rt_client_closed(void* _link) {
+    BackendLink* link = _link;
+
+    link->client = NULL;
+}
+
+/*! \brief Serve the metrics page of the router */
+static void rt_handle_get(Router* router, const HttpRequest* request) {
+    const char* path = request->header->path;
+    const char* metrics;
+    char* msg;
+    size_t size, n;
+
+    n = strcspn(path, "?");
+    if(strlen(router->metrics_path) != n ||
+            strncmp(path, router->metrics_path, n) != 0) {
+        hs_report_error(request->connection, 404, "Page not found");
+        return;
+    }
+
+    metric_set(METRIC_UPTIME_SECONDS, (get_time() - router->start_time)/1000);
+
+    metrics = metrics_render(&size);
+    msg = malloc(size);
+    memcpy(msg, metrics, size);
+
+    hs_answer_request(request->connection, msg, size, HTTP_METRICS_CONTENT);
+}
+
+/*! \brief Forward a request to the backend that owns the session */
+static void rt_handle_post(Router* router, const HttpRequest* request) {
+    char value[MAX_ATTRIB_SIZE];
+    char text[PEER_ADDRESS_LEN];
+    char forwarded[PEER_ADDRESS_LEN + sizeof(FORWARDED_FOR_FIELD)];
+    const PeerAddress* client;
+    Backend* backend;
+    BackendLink* link;
+    uint64_t sid;
+    char* header;
+    char* body;
+    size_t size;
+    int pooled;
+
+    if(rt_find_attrib(request->data, request->data_size, "sid", value,
+                sizeof(value))) {
+        /* the node id is in the sid */
+        sid = strtoull(value, NULL, 10);
+        backend = rt_find_backend(router, sid);
+        if(backend == NULL) {
+            log(WARNING, "No backend for sid=%" PRIu64 " node=%d", sid,
+                    (int)(sid >> SID_NODE_SHIFT));
+            metric_inc(METRIC_ROUTER_UNKNOWN_NODE);
+            rt_report_error(request->connection, "item-not-found");
+            return;
+        }
+    } else if(rt_find_attrib(request->data, request->data_size, "rid", value,
+                sizeof(value))) {
+        /* a new session, the rid is random enough to spread them */
+        backend = rt_pick_backend(router, strtoull(value, NULL, 10));
+    } else {
+        hs_report_error(request->connection, 400, "Not a BOSH request");
+        return;
+    }
+
+    pooled = !list_empty(backend->idle_links);
+    link = rt_link_get(backend);
+    if(link == NULL) {
+        metric_inc(METRIC_ROUTER_BACKEND_ERRORS);
+        rt_report_error(request->connection, "remote-connection-failed");
+        return;
+    }
+
+    /* tell the backend who the client is, it limits by address */
+    client = hc_client(request->connection);
+    if(client != NULL) {
+        snprintf(forwarded, sizeof(forwarded), FORWARDED_FOR_FIELD,
+                sock_format_address(client, text));
+    } else {
+        forwarded[0] = 0;
+    }
+
+    /* send the request as it came, queued until the link is connected */
+    asprintf(&header, FORWARD_HEADER, request->header->path,
+            backend->authority, (int)request->data_size, forwarded);
+    body = malloc(request->data_size);
+    memcpy(body, request->data, request->data_size);
+
+    /* the backend may have closed a pooled link, keep the request to retry */
+    if(pooled) {
+        size = strlen(header);
+        link->request_size = size + request->data_size;
+        link->request = malloc(link->request_size);
+        memcpy(link->request, header, size);
+        memcpy(link->request + size, request->data, request->data_size);
+    }
+
+    sock_send(link->sock, header, strlen(header), 1);
+    sock_send(link->sock, body, request->data_size, 0);
+
+    link->client = request->connection;
+    hc_set_close_callback(request->connection, rt_client_closed, link);
+    metric_inc(METRIC_ROUTER_REQUESTS);
+}
+
+/*! \brief Handle an http request */
+static void rt_handle_request(void* _router, const HttpRequest* request) {
+    Router* router = _router;
+
+    if(strcmp(request->header->type, "POST") == 0) {
+        rt_handle_post(router, request);
+    } else if(strcmp(request->header->type, "GET") == 0) {
+        rt_handle_get(router, request);
+    } else {
+        hs_report_error(request->connection, 400, "Bad request");
+    }
+}
+
+static void rt_handle_signal(int signal) {
+    running = 0;
+}
+
+/*! \brief Run the router until a SIGINT or SIGTERM signal is caught */
+void rt_run(Router* router) {
+    running = 1;
+
+    signal(SIGINT, rt_handle_signal);
+    signal(SIGTERM, rt_handle_signal);
+
+    log(INFO, "Router is running");
+
+    while(running == 1) {
+        sm_poll(hs_closest_timeout(router->server, 1000));
+        hs_check_timeout(router->server);
+    }
+}
+
+/*! \brief Create a router from the <router> element of the config */
+Router* rt_new(iks* config) {
+    Router* router;
+    iks* router_config;
+    iks* http_config;
+    iks* log_config;
+    iks* x;
+    Backend* backend;
+    const char* str;
+    int i;
+
+    router_config = iks_find(config, "router");
+    http_config = iks_find(config, "http_server");
+    log_config = iks_find(config, "log");
+
+    if(router_config == NULL || http_config == NULL || log_config == NULL) {
+        fprintf(stderr, "Incomplete config file.\n");
+        return NULL;
+    }
+
+    router = malloc(sizeof(Router));
+    router->server = NULL;
+
+    /* set the idle connections kept to each backend */
+    if((str = iks_find_attrib(router_config, "pool_size")) != NULL) {
+        router->pool_size = atoi(str);
+    } else {
+        router->pool_size = POOL_SIZE;
+    }
+
+    /* set the path of the metrics page */
+    if((str = iks_find_attrib(router_config, "metrics_path")) != NULL) {
+        router->metrics_path = strdup(str);
+    } else {
+        router->metrics_path = strdup(METRICS_PATH);
+    }
+
+    /* set the tcp options of the backend links */
+    sock_options_init(&router->tcp_options, router_config);
+
+    /* read the backends */
+    router->backend_count = 0;
+    for(x = iks_first_tag(router_config); x != NULL; x = iks_next_tag(x)) {
+        if(strcmp(iks_name(x), "backend") == 0) {
+            router->backend_count++;
+        }
+    }
+    router->backends = calloc(router->backend_count, sizeof(Backend));
+
+    i = 0;
+    for(x = iks_first_tag(router_config); x != NULL; x = iks_next_tag(x)) {
+        if(strcmp(iks_name(x), "backend") != 0) {
+            continue;
+        }
+        backend = &router->backends[i++];
+        str = iks_find_attrib(x, "node");
+        backend->node = str != NULL ? atoi(str) : -1;
+        str = iks_find_attrib(x, "host");
+        backend->host = strdup(str != NULL ? str : "localhost");
+        str = iks_find_attrib(x, "port");
+        backend->port = str != NULL ? atoi(str) : 0;
+        str = iks_find_attrib(x, "path");
+        backend->path = str != NULL ? strdup(str) : NULL;
+        if(backend->path != NULL) {
+            backend->authority = strdup(backend->host);
+        } else {
+            asprintf(&backend->authority, "%s:%d", backend->host,
+                    backend->port);
+        }
+        backend->idle_links = list_new();
+        backend->busy_links = list_new();
+        backend->idle_count = 0;
+        backend->router = router;
+
+        if(backend->node < 0 || backend->node > SID_MAX_NODE ||
+                (backend->port <= 0 && backend->path == NULL)) {
+            fprintf(stderr, "Invalid backend in the router config.\n");
+            router->backend_count = i;
+            rt_delete(router);
+            return NULL;
+        }
+    }
+
+    if(router->backend_count == 0) {
+        fprintf(stderr, "The router has no backends.\n");
+        rt_delete(router);
+        return NULL;
+    }
+
+    /* init log */
+    log_init(log_config);
+
+    sock_options_report(&router->tcp_options, "backend", 0);
+
+    /* create the http server */
+    router->server = hs_new(http_config, -1, rt_handle_request, router);
+    if(router->server == NULL) {
+        log(ERROR, "Failed to start HTTP server");
+        rt_delete(router);
+        return NULL;
+    }
+
+    router->start_time = get_time();
+
+    return router;
+}
+
+/*! \brief Destroy a router */
+void rt_delete(Router* router) {
+    Backend* backend;
+    int i;
+
+    /* close the clients first, the links of their requests are detached */
+    if(router->server != NULL) {
+        hs_delete(router->server);
+    }
+
+    for(i = 0; i < router->backend_count; ++i) {
+        backend = &router->backends[i];
+        while(!list_empty(backend->idle_links)) {
+            rt_link_delete(list_front(backend->idle_links));
+        }
+        while(!list_empty(backend->busy_links)) {
+            rt_link_delete(list_front(backend->busy_links));
+        }
+        list_delete(backend->idle_links, NULL);
+        list_delete(backend->busy_links, NULL);
+        free(backend->host);
+        free(backend->path);
+        free(backend->authority);
+    }
+
+    free(router->backends);
+    free(router->metrics_path);
+    free(router);
+}
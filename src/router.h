@@ -0,0 +1,46 @@
+/*
+ *   Copyright (c) 2007-2008 C3SL.
+ *
+ *   This file is part of Bosh.
+ *
+ *   Bosh is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   any later version.
+ *
+ *   Bosh is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ */
+
+
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <iksemel.h>
+
+/* A sid carries the node id of the bosh instance that owns the session in
+ * its top bits, so the router can find it without any shared state. */
+#define SID_NODE_SHIFT 48
+
+#define SID_MAX_NODE 0x7fff
+
+struct Router;
+
+typedef struct Router Router;
+
+Router* rt_new(iks* config);
+
+void rt_delete(Router* router);
+
+void rt_run(Router* router);
+
+int rt_find_attrib(const char* data, size_t size, const char* name,
+        char* value, size_t value_size);
+
+int rt_body_empty(const char* data, size_t size);
+
+#endif
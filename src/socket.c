@@ -16,11 +16,18 @@
  *   You should have received a copy of the GNU General Public License
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <fcntl.h>
 #include <string.h>
 
@@ -35,10 +42,16 @@
 #include "socket_monitor.h"
 
 #include "log.h"
+#include "metrics.h"
+
+/* buffers gathered in a single sendmsg */
+#define SOCK_MAX_IOV 64
 
 typedef struct QueueItem {
     void* buffer;
     size_t len, offset;
+    ReleaseCallback release;    /* if set, called instead of free(buffer) */
+    void* release_data;
 } QueueItem;
 
 struct Socket {
@@ -58,9 +71,32 @@ struct Socket {
     ErrorCallback error_callback;
     void* error_data;
 
+    WritableCallback writable_callback;
+    void* writable_data;
+
+    WritableCallback drained_callback;
+    void* drained_data;
+
     list* output_queue;
+    size_t queued_bytes;        /* bytes in the output queue not sent yet */
+    size_t high_water;          /* stop being writable above this         */
+    size_t low_water;           /* writable again below this              */
+    int write_blocked;
+    int flush_pending;          /* 1 if a flush is deferred to the end of
+                                   the poll                              */
 
     SocketStatus status;
+
+    int recv_paused;
+
+    int reuse_port;
+
+    const SocketOptions* options; /* tcp options, owned by the caller     */
+
+    PeerAddress peer;           /* the remote address of a connection     */
+
+    TlsSession* tls;            /* set while the records go through user
+                                   space, NULL for plain or kTLS sockets  */
 };
 
 DECLARE_ALLOCATOR(QueueItem);
@@ -69,18 +105,35 @@ IMPLEMENT_ALLOCATOR(QueueItem);
 DECLARE_ALLOCATOR(Socket);
 IMPLEMENT_ALLOCATOR(Socket);
 
+/*! \brief Fill the pools of sockets and of queued buffers before they are
+ * needed */
+void sock_reserve(size_t sockets) {
+    Socket_reserve(sockets);
+    QueueItem_reserve(sockets);
+}
+
 /*! \brief Alloc a queue item */
 QueueItem* item_new(void* buffer, size_t len, size_t offset) {
     QueueItem* item = QueueItem_alloc();
     item->buffer = buffer;
     item->len = len;
     item->offset = offset;
+    item->release = NULL;
+    item->release_data = NULL;
+    metric_inc(METRIC_SOCKET_QUEUE_ITEMS);
+    metric_add(METRIC_SOCKET_QUEUE_BYTES, len);
     return item;
 }
 
 /*! \brief Free a queue item */
 void item_delete(QueueItem* item) {
-    free(item->buffer);
+    metric_dec(METRIC_SOCKET_QUEUE_ITEMS);
+    metric_add(METRIC_SOCKET_QUEUE_BYTES, -(int64_t)item->len);
+    if(item->release != NULL) {
+        item->release(item->release_data);
+    } else {
+        free(item->buffer);
+    }
     QueueItem_free(item);
 }
 
@@ -101,17 +154,101 @@ Socket* sock_new() {
     sock->connect_data = NULL;
     sock->error_callback = NULL;
     sock->error_data = NULL;
+    sock->writable_callback = NULL;
+    sock->writable_data = NULL;
+    sock->drained_callback = NULL;
+    sock->drained_data = NULL;
     sock->si = NULL;
     sock->status = SOCKET_IDLE;
+    sock->recv_paused = 0;
+    sock->reuse_port = 0;
+    sock->options = NULL;
+    sock->tls = NULL;
+    memset(&sock->peer, 0, sizeof(sock->peer));
 
     /* create the output queue */
     sock->output_queue = list_new();
+    sock->queued_bytes = 0;
+    sock->high_water = SOCK_HIGH_WATER;
+    sock->low_water = SOCK_LOW_WATER;
+    sock->write_blocked = 0;
+    sock->flush_pending = 0;
 
     return sock;
 }
 
+/*! \brief Write the output queue until the socket would block
+ *
+ * The plain sockets get as many buffers as possible in a single sendmsg.
+ * Returns -1 on error, the socket is left open. */
+static int sock_write_queue(Socket* sock) {
+    struct iovec iov[SOCK_MAX_IOV];
+    struct msghdr msg;
+    list_iterator it;
+    QueueItem* item;
+    ssize_t ret;
+    int count;
+
+    while(!list_empty(sock->output_queue)) {
+        if(sock->tls != NULL) {
+            item = list_front(sock->output_queue);
+            ret = tls_send(sock->tls, item->buffer + item->offset,
+                    item->len - item->offset);
+        } else {
+            count = 0;
+            list_foreach(it, sock->output_queue) {
+                if(count == SOCK_MAX_IOV) {
+                    break;
+                }
+                item = list_iterator_value(it);
+                iov[count].iov_base = item->buffer + item->offset;
+                iov[count].iov_len = item->len - item->offset;
+                count++;
+            }
+
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            ret = sendmsg(sock->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT |
+                    (count == SOCK_MAX_IOV ? MSG_MORE : 0));
+        }
+        metric_inc(METRIC_SOCKET_SEND_CALLS);
+
+        if(ret == 0 || (ret == -1 && (errno == EAGAIN ||
+                        errno == EWOULDBLOCK))) {
+            return 0;
+        } else if(ret == -1) {
+            return -1;
+        }
+
+        sock->queued_bytes -= ret;
+        metric_add(METRIC_SOCKET_BYTES_SENT, ret);
+
+        /* drop the buffers sent, the last one might be sent in part */
+        while(ret > 0) {
+            item = list_front(sock->output_queue);
+            if((size_t)ret < item->len - item->offset) {
+                item->offset += ret;
+                return 0;
+            }
+            ret -= item->len - item->offset;
+            item_delete(list_pop_front(sock->output_queue));
+        }
+    }
+
+    return 0;
+}
+
 /*! \brief Close the socket */
 void sock_close(Socket* sock) {
+    /* what was sent before closing was meant to go out */
+    if(sock->flush_pending) {
+        sock->flush_pending = 0;
+        if(sock->status == SOCKET_CONNECTED) {
+            sock_write_queue(sock);
+        }
+    }
+
     /* close the socket */
     if(sock->fd != -1) {
         sm_del_socket(sock->si);
@@ -120,10 +257,20 @@ void sock_close(Socket* sock) {
         sock->fd = -1;
     }
 
+    if(sock->tls != NULL) {
+        tls_session_delete(sock->tls);
+        sock->tls = NULL;
+    }
+
     /* free remaining items in queue */
     while(!list_empty(sock->output_queue)) {
         item_delete(list_pop_front(sock->output_queue));
     }
+    sock->queued_bytes = 0;
+    if(sock->write_blocked) {
+        sock->write_blocked = 0;
+        metric_dec(METRIC_SOCKET_WRITE_BLOCKED);
+    }
 
     /* set status to idle */
     sock->status = SOCKET_IDLE;
@@ -138,48 +285,97 @@ void sock_delete(Socket* sock) {
 
 /*! \brief Send data that is in the queue to the socket */
 void sock_flush_data(Socket* sock) {
-    QueueItem* item;
-    ssize_t ret;
-    int flags;
+    WritableCallback drained;
 
-    while(!list_empty(sock->output_queue)) {
-        item = list_front(sock->output_queue);
-        flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+    if(sock_write_queue(sock) == -1) {
+        log(WARNING, "Failed to write to socket %d: %s", sock->fd,
+                strerror(errno));
+        metric_inc(METRIC_SOCKET_ERRORS);
+        sock_close(sock);
+        return;
+    }
 
-        if(!list_single(sock->output_queue)) {
-            flags |= MSG_MORE;
+    if(list_empty(sock->output_queue)) {
+        sm_del_events(sock->si, EPOLLOUT);
+    } else {
+        sm_add_events(sock->si, EPOLLOUT);
+    }
+
+    /* everything went out, the callback is called once and might delete the
+     * socket too */
+    if(sock->drained_callback != NULL && list_empty(sock->output_queue)) {
+        drained = sock->drained_callback;
+        sock->drained_callback = NULL;
+        if(sock->write_blocked) {
+            sock->write_blocked = 0;
+            metric_dec(METRIC_SOCKET_WRITE_BLOCKED);
         }
+        drained(sock->drained_data);
+        return;
+    }
 
-        while(item->offset < item->len) {
-            ret = send(sock->fd, item->buffer + item->offset,
-                    item->len - item->offset, flags);
+    /* tell the producer it can send again, this must be the last thing we
+     * do, the callback might delete the socket */
+    if(sock->write_blocked && sock->queued_bytes <= sock->low_water) {
+        sock->write_blocked = 0;
+        metric_dec(METRIC_SOCKET_WRITE_BLOCKED);
+        if(sock->writable_callback != NULL) {
+            sock->writable_callback(sock->writable_data);
+        }
+    }
+}
 
-            if(ret > 0) {
-                item->offset += ret;
-            } else if(ret == 0) {
-                break;
-            } else if(ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                break;
-            } else {
-                log(WARNING, "Failed to write to socket %d: %s", sock->fd,
-                        strerror(errno));
-                sock_close(sock);
-                return;
+/*! \brief Flush a socket at the end of the poll */
+static void sock_deferred_flush(void* _sock) {
+    Socket* sock = _sock;
+
+    sock->flush_pending = 0;
+    if(sock->status == SOCKET_CONNECTED) {
+        metric_inc(METRIC_SOCKET_DEFERRED_FLUSHES);
+        sock_flush_data(sock);
+    }
+}
+
+/*! \brief Continue the TLS handshake of an accepted socket */
+static void sock_handshake(Socket* sock) {
+    switch(tls_handshake(sock->tls)) {
+        case TLS_WANT_READ:
+            sm_del_events(sock->si, EPOLLOUT);
+            sm_add_events(sock->si, EPOLLIN);
+            return;
+        case TLS_WANT_WRITE:
+            sm_add_events(sock->si, EPOLLOUT);
+            return;
+        case TLS_ERROR:
+            metric_inc(METRIC_TLS_HANDSHAKE_FAILURES);
+            sock_close(sock);
+            if(sock->error_callback != NULL) {
+                sock->error_callback(sock->error_data, EPROTO);
             }
-        }
+            return;
+    }
 
-        if(item->offset < item->len) {
-            break;
-        } else {
-            item_delete(list_pop_front(sock->output_queue));
-        }
+    /* the kernel does the record layer, the socket is plain again */
+    if(tls_offloaded(sock->tls)) {
+        tls_session_delete(sock->tls);
+        sock->tls = NULL;
+        metric_inc(METRIC_TLS_HANDSHAKES_KERNEL);
+    } else {
+        metric_inc(METRIC_TLS_HANDSHAKES_USER);
     }
 
+    sock->status = SOCKET_CONNECTED;
+
     if(list_empty(sock->output_queue)) {
         sm_del_events(sock->si, EPOLLOUT);
     } else {
         sm_add_events(sock->si, EPOLLOUT);
     }
+    if(sock->data_callback != NULL && !sock->recv_paused) {
+        sm_add_events(sock->si, EPOLLIN);
+    } else {
+        sm_del_events(sock->si, EPOLLIN);
+    }
 }
 
 /*! \brief Handle events in the socket */
@@ -188,17 +384,22 @@ void socket_callback(int events, void* user_data) {
     socklen_t opt_len;
     Socket* sock = user_data;
 
-    if(events & (EPOLLERR | EPOLLHUP)) {
+    /* a hang up with data to read is a close, the read sees it after the
+     * data */
+    if((events & EPOLLERR) || ((events & EPOLLHUP) && !(events & EPOLLIN))) {
         /* If there was an error on the socket */
         opt_len = sizeof(error_code);
         getsockopt(sock->fd, SOL_SOCKET, SO_ERROR, &error_code, &opt_len);
 
         log(WARNING, "Error on socket %d: %s", sock->fd, strerror(error_code));
+        metric_inc(METRIC_SOCKET_ERRORS);
 
         sock_close(sock);
         if(sock->error_callback != NULL) {
             sock->error_callback(sock->error_data, error_code);
         }
+    } else if(sock->status == SOCKET_HANDSHAKE) {
+        sock_handshake(sock);
     } else if(events & EPOLLOUT) {
         /* The socket is writable now */
         if(sock->status == SOCKET_CONNECTING) {
@@ -210,7 +411,7 @@ void socket_callback(int events, void* user_data) {
                 sock->status = SOCKET_IDLE;
             } else {
                 sock->status = SOCKET_CONNECTED;
-                if(sock->data_callback != NULL) {
+                if(sock->data_callback != NULL && !sock->recv_paused) {
                     sm_add_events(sock->si, EPOLLIN);
                 }
             }
@@ -247,23 +448,69 @@ void socket_callback(int events, void* user_data) {
     }
 }
 
-/*! \brief Asynchronously connect to the given host.
+/*! \brief Set an integer option, unless it is -1 */
+static void sock_setopt(int fd, int level, int name, int value,
+        const char* label, int verbose) {
+    if(value == -1) {
+        return;
+    }
+
+    if(setsockopt(fd, level, name, &value, sizeof(value)) == -1 && verbose) {
+        log(WARNING, "Unable to set %s to %d: %s", label, value,
+                strerror(errno));
+    }
+}
+
+/*! \brief Set the tcp options on a socket before connect or listen
+ *
+ * Fast open takes the queue length on a listening socket, and only says
+ * whether to send the request in the SYN on a connecting one. */
+static void sock_apply_options(int fd, const SocketOptions* options,
+        int listening, int verbose) {
+    sock_setopt(fd, IPPROTO_TCP, TCP_NODELAY, options->nodelay,
+            "tcp_nodelay", verbose);
+    sock_setopt(fd, SOL_SOCKET, SO_SNDBUF, options->send_buffer,
+            "tcp_send_buffer", verbose);
+    sock_setopt(fd, SOL_SOCKET, SO_RCVBUF, options->receive_buffer,
+            "tcp_receive_buffer", verbose);
+    sock_setopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, options->notsent_lowat,
+            "tcp_notsent_lowat", verbose);
+
+    /* a keepalive idle time of 0 turns the keepalive off */
+    if(options->keepalive_idle != -1) {
+        sock_setopt(fd, SOL_SOCKET, SO_KEEPALIVE, options->keepalive_idle > 0,
+                "tcp_keepalive", verbose);
+    }
+    if(options->keepalive_idle > 0) {
+        sock_setopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, options->keepalive_idle,
+                "tcp_keepalive_idle", verbose);
+    }
+    sock_setopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, options->keepalive_interval,
+            "tcp_keepalive_interval", verbose);
+    sock_setopt(fd, IPPROTO_TCP, TCP_KEEPCNT, options->keepalive_count,
+            "tcp_keepalive_count", verbose);
+
+    sock_setopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, options->user_timeout,
+            "tcp_user_timeout", verbose);
+
+    if(listening) {
+        sock_setopt(fd, IPPROTO_TCP, TCP_FASTOPEN, options->fastopen,
+                "tcp_fastopen", verbose);
+    } else if(options->fastopen != -1) {
+        sock_setopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+                options->fastopen > 0, "tcp_fastopen", verbose);
+    }
+}
+
+/*! \brief Start a non blocking connection to the given address
  *
  * Returns 1 on success 0 otherwise */
-int sock_connect(Socket* sock, const char* host, int port) {
-    
-    struct hostent *hp;
-    struct sockaddr_in sa;
+static int sock_connect_address(Socket* sock, const struct sockaddr* address,
+        socklen_t address_len, const char* name) {
     int arg, ret;
 
-    /* resolve host address */
-    if((hp = gethostbyname(host)) == NULL) {
-        log(ERROR, "Unable to resolve host %s: %s", host, strerror(errno));
-        return 0;
-    }
-
     /* create the socket */
-    sock->fd = socket(hp->h_addrtype, SOCK_STREAM, 0);
+    sock->fd = socket(address->sa_family, SOCK_STREAM, 0);
     if(sock->fd == -1) {
         log(ERROR, "Unable to create socket: %s", strerror(errno));
         return 0;
@@ -274,18 +521,17 @@ int sock_connect(Socket* sock, const char* host, int port) {
     arg |= O_NONBLOCK; 
     fcntl(sock->fd, F_SETFL, arg); 
 
-    /* set up host address */
-    memset(&sa, 0, sizeof(sa));
-    memcpy((char *)&sa.sin_addr, (char *)hp->h_addr, hp->h_length);
-    sa.sin_family = hp->h_addrtype;
-    sa.sin_port = htons(port);
+    /* the buffer sizes must be known before the SYN for the window scale */
+    if(sock->options != NULL && address->sa_family != AF_UNIX) {
+        sock_apply_options(sock->fd, sock->options, 0, 0);
+    }
 
-    /* connect to the host */
-    ret = connect(sock->fd, (struct sockaddr *) &sa, sizeof sa);
+    /* connect to the host, a unix socket connects right away */
+    ret = connect(sock->fd, address, address_len);
     if(ret < 0 && errno != EINPROGRESS) {
-        log(ERROR, "Unable to connect to %s:%d: %s", host, port,
-                strerror(errno));
+        log(ERROR, "Unable to connect to %s: %s", name, strerror(errno));
         close(sock->fd);
+        sock->fd = -1;
         return 0;
     } 
 
@@ -297,6 +543,51 @@ int sock_connect(Socket* sock, const char* host, int port) {
     return 1;
 }
 
+/*! \brief Asynchronously connect to the given host.
+ *
+ * Returns 1 on success 0 otherwise */
+int sock_connect(Socket* sock, const char* host, int port) {
+    
+    struct hostent *hp;
+    struct sockaddr_in sa;
+    char name[256];
+
+    /* resolve host address */
+    if((hp = gethostbyname(host)) == NULL) {
+        log(ERROR, "Unable to resolve host %s: %s", host, strerror(errno));
+        return 0;
+    }
+
+    /* set up host address */
+    memset(&sa, 0, sizeof(sa));
+    memcpy((char *)&sa.sin_addr, (char *)hp->h_addr, hp->h_length);
+    sa.sin_family = hp->h_addrtype;
+    sa.sin_port = htons(port);
+
+    snprintf(name, sizeof(name), "%s:%d", host, port);
+
+    return sock_connect_address(sock, (struct sockaddr*)&sa, sizeof(sa), name);
+}
+
+/*! \brief Asynchronously connect to a unix socket
+ *
+ * It behaves like sock_connect, the connect callback is called from the
+ * event loop. Returns 1 on success 0 otherwise */
+int sock_connect_unix(Socket* sock, const char* path) {
+    struct sockaddr_un sa;
+
+    if(strlen(path) >= sizeof(sa.sun_path)) {
+        log(ERROR, "Unix socket path is too long: %s", path);
+        return 0;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+
+    return sock_connect_address(sock, (struct sockaddr*)&sa, sizeof(sa), path);
+}
+
 /*! \brief Receive data from the socket
  *
  * This function receive data from the socket and write on the buffer, at most
@@ -307,14 +598,21 @@ ssize_t sock_recv(Socket* sock, void* buffer, size_t len) {
     ssize_t ret;
 
     /* read data */
-    ret = recv(sock->fd, buffer, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(sock->tls != NULL) {
+        ret = tls_recv(sock->tls, buffer, len);
+    } else {
+        ret = recv(sock->fd, buffer, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
 
-    if(ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    if(ret > 0) {
+        metric_add(METRIC_SOCKET_BYTES_RECEIVED, ret);
+    } else if(ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
         /* no data available */
         ret = 0;
     } else if(ret == -1) {
         /* connection error */
         log(WARNING, "Unable to read socket %d: %s", sock->fd, strerror(errno));
+        metric_inc(METRIC_SOCKET_ERRORS);
         sock_close(sock);
         ret = 0;
     } else if(ret == 0) {
@@ -325,35 +623,66 @@ ssize_t sock_recv(Socket* sock, void* buffer, size_t len) {
     return ret;
 }
 
+/*! \brief Look at the incoming data without removing it from the socket
+ *
+ * Returns the number of bytes available, at most len, or 0 if there is no
+ * data. Errors are left to sock_recv. */
+ssize_t sock_peek(Socket* sock, void* buffer, size_t len) {
+    ssize_t ret;
+
+    ret = recv(sock->fd, buffer, len, MSG_PEEK | MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    return ret > 0 ? ret : 0;
+}
+
 /*! \brief Send data to the socket
  *
  * This function never blocks, if the send would block, the buffer is queued
  * to be sent later. The ownership of the buffer is passed to the calee
  * function. Don't expect the buffer pointer to be valid after this call. */
 void sock_send(Socket* sock, void* buffer, size_t len, int more) {
+    sock_send_ref(sock, buffer, len, more, NULL, NULL);
+}
+
+/*! \brief Send a buffer owned by someone else
+ *
+ * Like sock_send, but the buffer is not freed, instead the release callback
+ * is called with user_data when the socket doesn't need it anymore. If the
+ * callback is NULL, the buffer is freed as in sock_send. */
+void sock_send_ref(Socket* sock, const void* buffer, size_t len, int more,
+        ReleaseCallback release, void* user_data) {
     QueueItem* item;
 
     if(buffer != NULL) {
-        item = item_new(buffer, len, 0);
+        item = item_new((void*)buffer, len, 0);
+        item->release = release;
+        item->release_data = user_data;
         list_push_back(sock->output_queue, item);
+        sock->queued_bytes += len;
+        if(!sock->write_blocked && sock->high_water > 0 &&
+                sock->queued_bytes > sock->high_water) {
+            sock->write_blocked = 1;
+            metric_inc(METRIC_SOCKET_WRITE_BLOCKED);
+        }
     }
 
-    if(sock->status == SOCKET_CONNECTED && more == 0) {
-        sock_flush_data(sock);
+    /* the sends of the whole poll batch go out together */
+    if(sock->status == SOCKET_CONNECTED && more == 0 && !sock->flush_pending) {
+        sock->flush_pending = 1;
+        sm_defer(sock->si, sock_deferred_flush);
     }
 }
 
-/*! \brief Start listening on the given port
+/*! \brief Bind a non blocking socket to the address and start listening
  *
- * This function will not block, instead, the accept callback will be called
- * if there is an incoming connection. */
-int sock_listen(Socket* sock, int port) {
-    struct sockaddr_in addr_in;
+ * Returns 1 on success 0 otherwise */
+static int sock_listen_address(Socket* sock, const struct sockaddr* address,
+        socklen_t address_len, const char* name) {
     int opt, arg;
 
     /* create the socket */
-    if((sock->fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        log(ERROR, "Unable to create a socket on port %d: %s", port, strerror(errno));
+    if((sock->fd = socket(address->sa_family, SOCK_STREAM, 0)) == -1) {
+        log(ERROR, "Unable to create a socket on %s: %s", name, strerror(errno));
         return 0;
     }
 
@@ -362,27 +691,39 @@ int sock_listen(Socket* sock, int port) {
     arg |= O_NONBLOCK; 
     fcntl(sock->fd, F_SETFL, arg); 
 
-    /* set REUSEADDR so we can restart bosh quickly */
     opt = 1;
-    if(setsockopt(sock->fd, SOL_SOCKET, SO_REUSEADDR, (void*)&opt,
-                sizeof(opt)) == -1) {
-        log(WARNING, "Unable to set REUSEADDR option: %s", strerror(errno));
+    if(address->sa_family == AF_INET) {
+        /* set REUSEADDR so we can restart bosh quickly */
+        if(setsockopt(sock->fd, SOL_SOCKET, SO_REUSEADDR, (void*)&opt,
+                    sizeof(opt)) == -1) {
+            log(WARNING, "Unable to set REUSEADDR option: %s", strerror(errno));
+        }
+
+        /* let other processes listen on the same port */
+        if(sock->reuse_port && setsockopt(sock->fd, SOL_SOCKET, SO_REUSEPORT,
+                    (void*)&opt, sizeof(opt)) == -1) {
+            log(WARNING, "Unable to set REUSEPORT option: %s", strerror(errno));
+        }
     }
 
-    /* bind to the port */
-    addr_in.sin_family = AF_INET;
-    addr_in.sin_port = htons(port);
-    addr_in.sin_addr.s_addr = INADDR_ANY;
-    if(bind(sock->fd, (struct sockaddr*) &addr_in, sizeof(addr_in)) < 0) {
-        log(ERROR, "Unable to bind to port %d: %s", port, strerror(errno));
+    /* the accepted sockets inherit the options of the listening one */
+    if(sock->options != NULL && address->sa_family != AF_UNIX) {
+        sock_apply_options(sock->fd, sock->options, 1, 0);
+    }
+
+    /* bind to the address */
+    if(bind(sock->fd, address, address_len) < 0) {
+        log(ERROR, "Unable to bind to %s: %s", name, strerror(errno));
         close(sock->fd);
+        sock->fd = -1;
         return 0;
     }
 
     /* start listening */
     if(listen(sock->fd, 1024) == -1 ) {
-        log(ERROR, "Unable to listen port %d: %s", port, strerror(errno));
+        log(ERROR, "Unable to listen %s: %s", name, strerror(errno));
         close(sock->fd);
+        sock->fd = -1;
         return 0;
     }
 
@@ -396,14 +737,87 @@ int sock_listen(Socket* sock, int port) {
     return 1;
 }
 
+/*! \brief Start listening on the given port
+ *
+ * This function will not block, instead, the accept callback will be called
+ * if there is an incoming connection. */
+int sock_listen(Socket* sock, int port) {
+    struct sockaddr_in addr_in;
+    char name[32];
+
+    memset(&addr_in, 0, sizeof(addr_in));
+    addr_in.sin_family = AF_INET;
+    addr_in.sin_port = htons(port);
+    addr_in.sin_addr.s_addr = INADDR_ANY;
+
+    snprintf(name, sizeof(name), "port %d", port);
+
+    return sock_listen_address(sock, (struct sockaddr*)&addr_in,
+            sizeof(addr_in), name);
+}
+
+/*! \brief Start listening on a unix socket
+ *
+ * Like sock_listen but on a path of the file system. A socket left behind by
+ * a previous run is removed first, any other kind of file is an error. */
+int sock_listen_unix(Socket* sock, const char* path) {
+    struct sockaddr_un addr_un;
+    struct stat st;
+    int fd;
+
+    if(strlen(path) >= sizeof(addr_un.sun_path)) {
+        log(ERROR, "Unix socket path is too long: %s", path);
+        return 0;
+    }
+
+    memset(&addr_un, 0, sizeof(addr_un));
+    addr_un.sun_family = AF_UNIX;
+    strcpy(addr_un.sun_path, path);
+
+    /* remove a stale socket, bind fails if the path exists. Nobody accepts
+     * on a stale socket, so a connection is refused. */
+    if(stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd != -1 && connect(fd, (struct sockaddr*)&addr_un,
+                    sizeof(addr_un)) == -1 && errno == ECONNREFUSED &&
+                unlink(path) == -1) {
+            log(WARNING, "Unable to remove %s: %s", path, strerror(errno));
+        }
+        if(fd != -1) {
+            close(fd);
+        }
+    }
+
+    return sock_listen_address(sock, (struct sockaddr*)&addr_un,
+            sizeof(addr_un), path);
+}
+
+/* Stores the address of a connection's peer, the unix and unknown
+ * families are left as zeros. */
+static void sock_set_peer(Socket* sock, const struct sockaddr_storage* addr) {
+    memset(&sock->peer, 0, sizeof(sock->peer));
+
+    if(addr->ss_family == AF_INET) {
+        const struct sockaddr_in* in = (const struct sockaddr_in*)addr;
+        sock->peer.bytes[10] = 0xff;
+        sock->peer.bytes[11] = 0xff;
+        memcpy(sock->peer.bytes + 12, &in->sin_addr, 4);
+    } else if(addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)addr;
+        memcpy(sock->peer.bytes, &in6->sin6_addr, 16);
+    }
+}
+
 /*! \brief Accepts an incoming connection.
  *
  * This function should be called when the accept callback is called */
 Socket* sock_accept(Socket* sock) {
     Socket* client;
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
     int fd;
 
-    fd = accept(sock->fd, NULL, NULL);
+    fd = accept(sock->fd, (struct sockaddr*)&addr, &len);
 
     if(fd == -1) {
         if(errno != EAGAIN && errno != EWOULDBLOCK) {
@@ -413,20 +827,130 @@ Socket* sock_accept(Socket* sock) {
         return NULL;
     }
 
+    metric_inc(METRIC_SOCKET_ACCEPTED);
+
     client = sock_new();
 
     client->fd = fd;
     client->status = SOCKET_CONNECTED;
     client->si = sm_add_socket(fd, socket_callback, client, 0);
+    sock_set_peer(client, &addr);
 
     return client;
 }
 
+/*! \brief Use a socket created by someone else, like another process
+ *
+ * The status must be SOCKET_CONNECTED or SOCKET_LISTENING. */
+void sock_adopt(Socket* sock, int fd, SocketStatus status) {
+    int arg;
+
+    /* set socket as non blocking */
+    arg = fcntl(fd, F_GETFL, NULL);
+    arg |= O_NONBLOCK;
+    fcntl(fd, F_SETFL, arg);
+
+    sock->fd = fd;
+    sock->status = status;
+    sock->si = sm_add_socket(fd, socket_callback, sock, 0);
+
+    if(status == SOCKET_CONNECTED) {
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+
+        if(getpeername(fd, (struct sockaddr*)&addr, &len) == 0) {
+            sock_set_peer(sock, &addr);
+        }
+    }
+}
+
 /*! \brief Returns the socket current status */
 SocketStatus sock_status(Socket* sock) {
     return sock->status;
 }
 
+/*! \brief Returns the address of the peer of an accepted or adopted
+ * connection */
+const PeerAddress* sock_peer(Socket* sock) {
+    return &sock->peer;
+}
+
+/*! \brief Parses an IPv4 or IPv6 address of len characters
+ *
+ * The spaces around it are ignored. Returns 1 on success, 0 otherwise. */
+int sock_parse_address(const char* text, size_t len, PeerAddress* address) {
+    char buffer[PEER_ADDRESS_LEN];
+
+    while(len > 0 && (*text == ' ' || *text == '\t')) {
+        ++text;
+        --len;
+    }
+    while(len > 0 && (text[len - 1] == ' ' || text[len - 1] == '\t')) {
+        --len;
+    }
+    if(len == 0 || len >= sizeof(buffer)) {
+        return 0;
+    }
+    memcpy(buffer, text, len);
+    buffer[len] = 0;
+
+    memset(address, 0, sizeof(*address));
+    if(inet_pton(AF_INET, buffer, address->bytes + 12) == 1) {
+        address->bytes[10] = 0xff;
+        address->bytes[11] = 0xff;
+        return 1;
+    }
+    return inet_pton(AF_INET6, buffer, address->bytes) == 1;
+}
+
+/*! \brief Writes an address as text, in PEER_ADDRESS_LEN bytes
+ *
+ * Returns text. */
+const char* sock_format_address(const PeerAddress* address, char* text) {
+    static const unsigned char mapped[12] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+    };
+
+    if(memcmp(address->bytes, mapped, sizeof(mapped)) == 0) {
+        inet_ntop(AF_INET, address->bytes + 12, text, PEER_ADDRESS_LEN);
+    } else {
+        inet_ntop(AF_INET6, address->bytes, text, PEER_ADDRESS_LEN);
+    }
+    return text;
+}
+
+/*! \brief Start the server side of a TLS session on an accepted socket
+ *
+ * The data callback is not called until the handshake is complete, and
+ * the data sent before is queued. If the handshake fails, the error
+ * callback is called. Returns 1 on success, 0 otherwise. */
+int sock_start_tls(Socket* sock, TlsContext* context) {
+    int arg;
+
+    /* the handshake is done by OpenSSL, which needs a non blocking socket */
+    arg = fcntl(sock->fd, F_GETFL, NULL);
+    arg |= O_NONBLOCK;
+    fcntl(sock->fd, F_SETFL, arg);
+
+    sock->tls = tls_session_new(context, sock->fd);
+    if(sock->tls == NULL) {
+        return 0;
+    }
+
+    /* wait for the client hello */
+    sock->status = SOCKET_HANDSHAKE;
+    sm_add_events(sock->si, EPOLLIN);
+
+    return 1;
+}
+
+/*! \brief Returns 1 if the socket encrypts in user space
+ *
+ * Such a socket can't be passed to another process. */
+int sock_has_tls(Socket* sock) {
+    return sock->tls != NULL;
+}
+
 /*! \brief Set the data callback.
  *
  * This callback will be called whenever there is data to read from the
@@ -437,7 +961,8 @@ void sock_set_data_callback(Socket* sock, DataCallback callback,
     sock->data_callback = callback;
     sock->data_data = user_data;
 
-    if(sock->status == SOCKET_CONNECTED && sock->data_callback != NULL) {
+    if(sock->status == SOCKET_CONNECTED && sock->data_callback != NULL &&
+            !sock->recv_paused) {
         sm_add_events(sock->si, EPOLLIN);
     }
 }
@@ -452,7 +977,8 @@ void sock_set_accept_callback(Socket* sock, AcceptCallback callback,
     sock->accept_callback = callback;
     sock->accept_data = user_data;
 
-    if(sock->status == SOCKET_LISTENING && sock->accept_callback != NULL) {
+    if(sock->status == SOCKET_LISTENING && sock->accept_callback != NULL &&
+            !sock->recv_paused) {
         sm_add_events(sock->si, EPOLLIN);
     }
 }
@@ -483,3 +1009,178 @@ void sock_set_error_callback(Socket* sock, ErrorCallback callback,
 int sock_fd(Socket* sock) {
     return sock->fd;
 }
+
+/*! \brief Stop calling the data or the accept callback
+ *
+ * The incoming data stays in the kernel buffers, so the peer will stop
+ * sending when they are full. */
+void sock_pause_recv(Socket* sock) {
+    sock->recv_paused = 1;
+
+    if(sock->status == SOCKET_CONNECTED || sock->status == SOCKET_LISTENING) {
+        sm_del_events(sock->si, EPOLLIN);
+    }
+}
+
+/*! \brief Call the callbacks again after sock_pause_recv */
+void sock_resume_recv(Socket* sock) {
+    sock->recv_paused = 0;
+
+    if((sock->status == SOCKET_CONNECTED && sock->data_callback != NULL) ||
+            (sock->status == SOCKET_LISTENING &&
+             sock->accept_callback != NULL)) {
+        sm_add_events(sock->si, EPOLLIN);
+    }
+}
+
+/*! \brief Returns 1 if the data callback is paused, 0 otherwise */
+int sock_recv_paused(Socket* sock) {
+    return sock->recv_paused;
+}
+
+/*! \brief Returns the number of bytes queued and not sent yet */
+size_t sock_queued_bytes(Socket* sock) {
+    return sock->queued_bytes;
+}
+
+/*! \brief Returns 1 if the producers may send more data, 0 otherwise
+ *
+ * The socket stops being writable when the output queue goes above the high
+ * water mark, and is writable again when it drains below the low water mark.
+ * Then the writable callback is called. sock_send still accepts data while
+ * the socket is not writable. */
+int sock_writable(Socket* sock) {
+    return !sock->write_blocked;
+}
+
+/*! \brief Set the water marks of the output queue
+ *
+ * A high water mark of 0 disables them. */
+void sock_set_water_marks(Socket* sock, size_t high, size_t low) {
+    sock->high_water = high;
+    sock->low_water = low < high ? low : high;
+}
+
+/*! \brief Set the writable callback.
+ *
+ * This callback will be called when the output queue drains below the low
+ * water mark after going above the high water mark. */
+void sock_set_writable_callback(Socket* sock, WritableCallback callback,
+        void* user_data) {
+
+    sock->writable_callback = callback;
+    sock->writable_data = user_data;
+}
+
+/*! \brief Set the drained callback.
+ *
+ * This callback will be called once, when the output queue is empty after a
+ * write. It is not called if the queue is empty already. */
+void sock_set_drained_callback(Socket* sock, WritableCallback callback,
+        void* user_data) {
+
+    sock->drained_callback = callback;
+    sock->drained_data = user_data;
+}
+
+/*! \brief Send a FIN to the peer, reads still work */
+void sock_shutdown_write(Socket* sock) {
+    if(sock->fd != -1) {
+        shutdown(sock->fd, SHUT_WR);
+    }
+}
+
+/*! \brief Share the port with other sockets, must be called before
+ * sock_listen */
+void sock_set_reuse_port(Socket* sock, int reuse_port) {
+    sock->reuse_port = reuse_port;
+}
+
+/*! \brief Get an integer attribute, or -1 if it is not set */
+static int sock_option_attrib(iks* config, const char* name) {
+    const char* str;
+
+    if(config == NULL || (str = iks_find_attrib(config, name)) == NULL) {
+        return -1;
+    }
+
+    return atoi(str);
+}
+
+/*! \brief Read the tcp options from the attributes of a config element
+ *
+ * The options that are not in the config are left to the system, so are
+ * all of them if config is NULL. */
+void sock_options_init(SocketOptions* options, iks* config) {
+    options->nodelay = sock_option_attrib(config, "tcp_nodelay");
+    options->send_buffer = sock_option_attrib(config, "tcp_send_buffer");
+    options->receive_buffer = sock_option_attrib(config, "tcp_receive_buffer");
+    options->notsent_lowat = sock_option_attrib(config, "tcp_notsent_lowat");
+    options->keepalive_idle = sock_option_attrib(config, "tcp_keepalive_idle");
+    options->keepalive_interval = sock_option_attrib(config,
+            "tcp_keepalive_interval");
+    options->keepalive_count = sock_option_attrib(config,
+            "tcp_keepalive_count");
+    options->user_timeout = sock_option_attrib(config, "tcp_user_timeout");
+    options->fastopen = sock_option_attrib(config, "tcp_fastopen");
+}
+
+/*! \brief Use the tcp options when connecting or listening
+ *
+ * The options must stay valid while the socket is used. They are set right
+ * away on a socket that is already listening, like an adopted one. They are
+ * ignored on unix sockets. */
+void sock_set_options(Socket* sock, const SocketOptions* options) {
+    sock->options = options;
+
+    if(sock->fd != -1 && sock->status == SOCKET_LISTENING) {
+        sock_apply_options(sock->fd, options, 1, 0);
+    }
+}
+
+/*! \brief Get an integer option, or -1 if it is not available */
+static int sock_getopt(int fd, int level, int name) {
+    socklen_t len;
+    int value;
+
+    len = sizeof(value);
+    if(getsockopt(fd, level, name, &value, &len) == -1) {
+        return -1;
+    }
+
+    return value;
+}
+
+/*! \brief Log the values the system takes for the tcp options
+ *
+ * The options are set on a scratch socket and read back, so the values
+ * clamped or rounded by the kernel are the ones shown, and the options the
+ * kernel refuses are logged as warnings. */
+void sock_options_report(const SocketOptions* options, const char* name,
+        int listening) {
+    int fd;
+
+    if((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        return;
+    }
+
+    sock_apply_options(fd, options, listening, 1);
+
+    log(INFO, "tcp options of the %s sockets: nodelay=%d send_buffer=%d "
+            "receive_buffer=%d notsent_lowat=%d keepalive=%d "
+            "keepalive_idle=%d keepalive_interval=%d keepalive_count=%d "
+            "user_timeout=%d fastopen=%d", name,
+            sock_getopt(fd, IPPROTO_TCP, TCP_NODELAY),
+            sock_getopt(fd, SOL_SOCKET, SO_SNDBUF),
+            sock_getopt(fd, SOL_SOCKET, SO_RCVBUF),
+            sock_getopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT),
+            sock_getopt(fd, SOL_SOCKET, SO_KEEPALIVE),
+            sock_getopt(fd, IPPROTO_TCP, TCP_KEEPIDLE),
+            sock_getopt(fd, IPPROTO_TCP, TCP_KEEPINTVL),
+            sock_getopt(fd, IPPROTO_TCP, TCP_KEEPCNT),
+            sock_getopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT),
+            sock_getopt(fd, IPPROTO_TCP,
+                listening ? TCP_FASTOPEN : TCP_FASTOPEN_CONNECT));
+
+    close(fd);
+}
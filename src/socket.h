@@ -21,39 +21,125 @@
 
 #include <sys/types.h>
 
+#include <iksemel.h>
+
+#include "tls.h"
+
+/* default water marks of the output queue, in bytes */
+#define SOCK_HIGH_WATER (256 * 1024)
+#define SOCK_LOW_WATER (64 * 1024)
+
 typedef enum SocketStatus {
     SOCKET_IDLE,
     SOCKET_CONNECTING,
     SOCKET_CONNECTED,
-    SOCKET_LISTENING
+    SOCKET_LISTENING,
+    SOCKET_HANDSHAKE
 } SocketStatus;
 
 struct Socket;
 typedef struct Socket Socket;
 
+/* the address of a peer, IPv4 is mapped in IPv6 (::ffff:a.b.c.d), all
+ * zeros for a unix socket */
+typedef struct PeerAddress {
+    unsigned char bytes[16];
+} PeerAddress;
+
+/* size of the text of a PeerAddress, with the terminating zero */
+#define PEER_ADDRESS_LEN 46
+
+/* tcp options of a group of sockets, -1 leaves the system default */
+typedef struct SocketOptions {
+    int nodelay;
+    int send_buffer;            /* SO_SNDBUF, in bytes                  */
+    int receive_buffer;         /* SO_RCVBUF, in bytes                  */
+    int notsent_lowat;          /* unsent bytes before EPOLLOUT stops   */
+    int keepalive_idle;         /* seconds, 0 turns the keepalive off   */
+    int keepalive_interval;     /* seconds between the probes           */
+    int keepalive_count;        /* probes before the connection drops   */
+    int user_timeout;           /* ms the data can stay unacknowledged  */
+    int fastopen;               /* queue length when listening, on/off
+                                   when connecting                      */
+} SocketOptions;
+
 typedef void(*DataCallback)(void* user_data);
 typedef void(*AcceptCallback)(void* user_data);
 typedef void(*ErrorCallback)(void* user_data, int code);
 typedef void(*ConnectCallback)(int success, void* user_data);
+typedef void(*WritableCallback)(void* user_data);
+typedef void(*ReleaseCallback)(void* user_data);
 
 Socket *sock_new();
 
 void sock_delete(Socket* sock);
 
+void sock_reserve(size_t sockets);
+
 int sock_connect(Socket* sock, const char* host, int port);
 
+int sock_connect_unix(Socket* sock, const char* path);
+
 ssize_t sock_recv(Socket* sock, void *buffer, size_t len);
 
+ssize_t sock_peek(Socket* sock, void *buffer, size_t len);
+
 void sock_send(Socket* sock, void* buffer, size_t len, int more);
 
+void sock_send_ref(Socket* sock, const void* buffer, size_t len, int more,
+        ReleaseCallback release, void* user_data);
+
 int sock_listen(Socket* sock, int port);
 
+int sock_listen_unix(Socket* sock, const char* path);
+
+void sock_set_reuse_port(Socket* sock, int reuse_port);
+
+void sock_options_init(SocketOptions* options, iks* config);
+
+void sock_set_options(Socket* sock, const SocketOptions* options);
+
+void sock_options_report(const SocketOptions* options, const char* name,
+        int listening);
+
 Socket* sock_accept(Socket* sock);
 
+void sock_adopt(Socket* sock, int fd, SocketStatus status);
+
+int sock_start_tls(Socket* sock, TlsContext* context);
+
+int sock_has_tls(Socket* sock);
+
 SocketStatus sock_status(Socket* sock);
 
+const PeerAddress* sock_peer(Socket* sock);
+
+int sock_parse_address(const char* text, size_t len, PeerAddress* address);
+
+const char* sock_format_address(const PeerAddress* address, char* text);
+
 int sock_fd(Socket* sock);
 
+void sock_pause_recv(Socket* sock);
+
+void sock_resume_recv(Socket* sock);
+
+int sock_recv_paused(Socket* sock);
+
+size_t sock_queued_bytes(Socket* sock);
+
+int sock_writable(Socket* sock);
+
+void sock_set_water_marks(Socket* sock, size_t high, size_t low);
+
+void sock_set_writable_callback(Socket* sock, WritableCallback callback,
+        void* user_data);
+
+void sock_set_drained_callback(Socket* sock, WritableCallback callback,
+        void* user_data);
+
+void sock_shutdown_write(Socket* sock);
+
 void sock_set_data_callback(Socket* sock, DataCallback callback,
         void* user_data);
 
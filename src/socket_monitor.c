@@ -26,10 +26,14 @@
 #include "socket_monitor.h"
 #include "allocator.h"
 #include "log.h"
+#include "metrics.h"
 
 #define MAX_SOCKETS (1024*16)
 #define MAX_EVENTS 1024
 
+/* a new sample weighs 1 / 2^LAG_SMOOTHING of the lag average */
+#define LAG_SMOOTHING 3
+
 static inline unsigned int hash_int(int i) {
     return i;
 }
@@ -45,6 +49,10 @@ typedef struct SocketMonitor {
     int epoll_fd;
     int_hash* socket_hash;
     int socket_count;
+    SocketInfo** deferred;      /* sockets with work for the end of poll */
+    int deferred_count;
+    int deferred_size;
+    int64_t lag;                /* moving average of the loop lag, in ns */
 } SocketMonitor;
 
 struct SocketInfo {
@@ -52,6 +60,8 @@ struct SocketInfo {
     void* user_data;
     int socket_fd;
     int events;
+    deferred_t deferred;        /* NULL if nothing to do or cancelled    */
+    int deferred_queued;        /* 1 while in the monitor deferred array */
 };
 
 DECLARE_ALLOCATOR(SocketInfo);
@@ -63,6 +73,10 @@ SocketMonitor* sm_new() {
     SocketMonitor* monitor = malloc(sizeof(SocketMonitor));
     monitor->socket_count = 0;
     monitor->socket_hash = int_hash_new();
+    monitor->deferred = NULL;
+    monitor->deferred_count = 0;
+    monitor->deferred_size = 0;
+    monitor->lag = 0;
 
     /* according to the manual, the first argument is ignored,
      * so it doesn't really mater the value of MAX_SOCKETS */
@@ -84,6 +98,8 @@ void sm_delete(SocketMonitor* monitor) {
     int_hash_iterate(monitor->socket_hash, socket_free_callback);
     int_hash_delete(monitor->socket_hash);
 
+    free(monitor->deferred);
+
     /* free monitor memory */
     free(monitor);
 }
@@ -99,12 +115,15 @@ SocketInfo* sm_add_socket(int socket_fd, callback_t callback, void* user_data,
     si = int_hash_find(monitor->socket_hash, socket_fd);
     if(si == NULL) {
         si = SocketInfo_alloc();
+        si->deferred_queued = 0;
         int_hash_insert(monitor->socket_hash, socket_fd, si);
     }
 
-    /* set parameters */
+    /* set parameters, the work deferred for a previous socket with this fd
+     * is dropped */
     si->callback = callback;
     si->user_data = user_data;
+    si->deferred = NULL;
     si->events = events;
     si->socket_fd = socket_fd;
 
@@ -145,6 +164,11 @@ void sm_del_events(SocketInfo* si, int events) {
     epoll_ctl(monitor->epoll_fd, EPOLL_CTL_MOD, si->socket_fd, &eevent);
 }
 
+void sm_reserve(size_t sockets) {
+    SocketInfo_reserve(sockets);
+    _int_hash_node_reserve(sockets);
+}
+
 void sm_del_socket(SocketInfo* si) {
     /* erase the socket from the epoll */
     epoll_ctl(monitor->epoll_fd, EPOLL_CTL_DEL, si->socket_fd, NULL);
@@ -153,6 +177,7 @@ void sm_del_socket(SocketInfo* si) {
     si->events = 0;
     si->callback = NULL;
     si->user_data = NULL;
+    si->deferred = NULL;
 
     /* decremente the socket count */
     monitor->socket_count--;
@@ -161,27 +186,91 @@ void sm_del_socket(SocketInfo* si) {
      * to prevent troubles if this function was called from sm_poll */
 }
 
+void sm_defer(SocketInfo* si, deferred_t callback) {
+    si->deferred = callback;
+
+    if(si->deferred_queued) {
+        return;
+    }
+
+    if(monitor->deferred_count == monitor->deferred_size) {
+        monitor->deferred_size = monitor->deferred_size > 0 ?
+            monitor->deferred_size * 2 : 64;
+        monitor->deferred = realloc(monitor->deferred,
+                monitor->deferred_size * sizeof(SocketInfo*));
+    }
+    monitor->deferred[monitor->deferred_count++] = si;
+    si->deferred_queued = 1;
+}
+
+/*! \brief Call the deferred callbacks
+ *
+ * The callbacks can defer more work, it is done in the same pass. */
+static void sm_run_deferred() {
+    SocketInfo* si;
+    deferred_t deferred;
+    int i;
+
+    for(i = 0; i < monitor->deferred_count; ++i) {
+        si = monitor->deferred[i];
+        deferred = si->deferred;
+        si->deferred = NULL;
+        si->deferred_queued = 0;
+        if(deferred != NULL) {
+            deferred(si->user_data);
+        }
+    }
+    monitor->deferred_count = 0;
+}
+
 void sm_poll(time_type timeout) {
     struct epoll_event events[MAX_EVENTS];
     int ret, i;
+    int64_t start, scheduled, wakeup, lag;
     SocketInfo* si;
 
     log(INFO, "sockets = %d", monitor->socket_count);
 
+    /* finish the work deferred out of the poll, like by the timers */
+    sm_run_deferred();
+
     /* poll for events and call the callbacks */
+    scheduled = get_time_ns() + timeout * 1000000ll;
     ret = epoll_wait(monitor->epoll_fd, events, MAX_EVENTS, timeout);
+    wakeup = get_time_ns();
+    metric_inc(METRIC_POLL_ITERATIONS);
     if(ret > 0) {
+        metric_add(METRIC_POLL_EVENTS, ret);
         for(i = 0; i < ret; ++i) {
             si = events[i].data.ptr;
             /* if the callback is null the socket was removed already */
             if(si->callback != NULL) {
                 log(INFO, "Event on socket %d", si->socket_fd);
+                start = get_time_ns();
                 si->callback(events[i].events, si->user_data);
+                latency_record(LATENCY_DISPATCH, get_time_ns() - start);
             }
         }
     } else if(ret < 0) {
         log(ERROR, "%s", strerror(errno));
     }
+
+    /* the callbacks of this batch are done, the sockets they wrote to are
+     * flushed once */
+    sm_run_deferred();
+
+    /* the lag is how late the timers can fire: a late wakeup from the
+     * timeout plus the time spent on the batch */
+    lag = get_time_ns() - wakeup;
+    if(ret == 0 && wakeup > scheduled) {
+        lag += wakeup - scheduled;
+    }
+    latency_record(LATENCY_LOOP_LAG, lag);
+    monitor->lag += (lag - monitor->lag) / (1 << LAG_SMOOTHING);
+}
+
+time_type sm_lag() {
+    return monitor->lag / 1000000ll;
 }
 
 void sm_init() {
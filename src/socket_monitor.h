@@ -27,6 +27,7 @@
 #include "list.h"
 
 typedef void (*callback_t)(int events, void* user_data);
+typedef void (*deferred_t)(void* user_data);
 
 typedef struct SocketInfo SocketInfo;
 
@@ -46,10 +47,19 @@ void sm_add_events(SocketInfo* si, int events);
 /*! \brief Don't monitor the given events anymore */
 void sm_del_events(SocketInfo* si, int events);
 
+/*! \brief Fill the pool of socket entries before they are needed. */
+void sm_reserve(size_t sockets);
+
 /*! \brief Remove a socket from the monitor. */
 void sm_del_socket(SocketInfo* si);
 
+/*! \brief Call the callback once after the events of the current poll. */
+void sm_defer(SocketInfo* si, deferred_t callback);
+
 /*! \brief Poll the sockets for any activity. */
 void sm_poll(time_type max_time);
 
+/*! \brief The smoothed lag of the loop, in ms. */
+time_type sm_lag();
+
 #endif
@@ -27,3 +27,9 @@ time_type get_time() {
     return tp.tv_sec * 1000ll + tp.tv_nsec / 1000000ll;
 }
 
+int64_t get_time_ns() {
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000000ll + tp.tv_nsec;
+}
+
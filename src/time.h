@@ -27,4 +27,7 @@ typedef int64_t time_type;
 /*" \brief Returns he current time in miliseconds */
 time_type get_time();
 
+/*! \brief Returns the current time in nanoseconds */
+int64_t get_time_ns();
+
 #endif
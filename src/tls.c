@@ -0,0 +1,263 @@
+/*
+ *   Copyright (c) 2007-2008 C3SL.
+ *
+ *   This file is part of Bosh.
+ *
+ *   Bosh is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   any later version.
+ *
+ *   Bosh is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "tls.h"
+#include "log.h"
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+/* name of the session cache, resumed sessions must match it */
+#define SESSION_ID_CONTEXT "bosh"
+
+/* the ciphers the kernel offloads in both directions */
+#define OFFLOAD_CIPHERS "ECDHE-ECDSA-AES128-GCM-SHA256:" \
+                        "ECDHE-RSA-AES128-GCM-SHA256:" \
+                        "ECDHE-ECDSA-AES256-GCM-SHA384:" \
+                        "ECDHE-RSA-AES256-GCM-SHA384"
+#define OFFLOAD_CIPHERSUITES "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384"
+
+struct TlsContext {
+    SSL_CTX* ctx;
+};
+
+/*! \brief Log and clear the OpenSSL error queue */
+static void tls_log_errors(const char* what) {
+    unsigned long code;
+    char msg[256];
+
+    while((code = ERR_get_error()) != 0) {
+        ERR_error_string_n(code, msg, sizeof(msg));
+        log(WARNING, "%s: %s", what, msg);
+    }
+}
+
+/*! \brief Create a server context with the given certificate chain and
+ * private key, both in PEM files
+ *
+ * Returns NULL on error */
+TlsContext* tls_new(const char* certificate, const char* key) {
+    TlsContext* context;
+    SSL_CTX* ctx;
+
+    ctx = SSL_CTX_new(TLS_server_method());
+    if(ctx == NULL) {
+        tls_log_errors("Failed to create the TLS context");
+        return NULL;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION |
+            SSL_OP_IGNORE_UNEXPECTED_EOF);
+
+    /* the socket retries a write from its queue, maybe with more data, and
+     * idle connections don't keep the record buffers */
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+            SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    /* resumption with the session cache and with tickets */
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx,
+            (const unsigned char*)SESSION_ID_CONTEXT,
+            sizeof(SESSION_ID_CONTEXT) - 1);
+
+    if(SSL_CTX_use_certificate_chain_file(ctx, certificate) != 1 ||
+            SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(ctx) != 1) {
+        tls_log_errors("Failed to load the TLS certificate");
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    context = malloc(sizeof(TlsContext));
+    context->ctx = ctx;
+
+    return context;
+}
+
+/*! \brief Free a context, the sessions keep a reference to it */
+void tls_delete(TlsContext* context) {
+    SSL_CTX_free(context->ctx);
+    free(context);
+}
+
+/*! \brief Returns 1 if the sessions can be offloaded to the kernel
+ *
+ * OpenSSL must be built with kTLS, and the kernel must take the tls ULP on a
+ * connected socket. The probe is a loopback connection, so the module is
+ * loaded on demand like on a real session. */
+int tls_kernel_available() {
+#ifdef BIO_get_ktls_send
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int server_fd, client_fd, ret = 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    client_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(server_fd != -1 && client_fd != -1 &&
+            bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+            getsockname(server_fd, (struct sockaddr*)&addr, &len) == 0 &&
+            listen(server_fd, 1) == 0 &&
+            connect(client_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        ret = setsockopt(client_fd, SOL_TCP, TCP_ULP, "tls",
+                sizeof("tls")) == 0;
+    }
+    if(server_fd != -1) {
+        close(server_fd);
+    }
+    if(client_fd != -1) {
+        close(client_fd);
+    }
+
+    return ret;
+#else
+    return 0;
+#endif
+}
+
+/*! \brief Only negotiate what the kernel can take in both directions
+ *
+ * AES-GCM is offloaded by every kernel with the tls ULP. Before OpenSSL 3.2
+ * only TLS 1.2 is offloaded on the receive side, so TLS 1.3 is refused.
+ * Returns 0 on error. */
+int tls_restrict_offload(TlsContext* context) {
+    if(SSL_CTX_set_cipher_list(context->ctx, OFFLOAD_CIPHERS) != 1 ||
+            SSL_CTX_set_ciphersuites(context->ctx,
+                OFFLOAD_CIPHERSUITES) != 1) {
+        tls_log_errors("Failed to set the TLS ciphers");
+        return 0;
+    }
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+    SSL_CTX_set_max_proto_version(context->ctx, TLS1_2_VERSION);
+#endif
+
+    return 1;
+}
+
+/*! \brief Start the server side of a session on a non blocking socket */
+TlsSession* tls_session_new(TlsContext* context, int fd) {
+    SSL* ssl;
+
+    ssl = SSL_new(context->ctx);
+    if(ssl == NULL || SSL_set_fd(ssl, fd) != 1) {
+        tls_log_errors("Failed to create the TLS session");
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+
+    return ssl;
+}
+
+/*! \brief Free a session, the socket is not closed */
+void tls_session_delete(TlsSession* session) {
+    SSL_free(session);
+}
+
+/*! \brief Continue the handshake
+ *
+ * Returns one of TLS_STATUS, TLS_WANT_READ and TLS_WANT_WRITE tell what the
+ * socket must wait for before calling it again. */
+int tls_handshake(TlsSession* session) {
+    int ret;
+
+    ret = SSL_do_handshake(session);
+    if(ret == 1) {
+        return TLS_DONE;
+    }
+
+    switch(SSL_get_error(session, ret)) {
+        case SSL_ERROR_WANT_READ:
+            return TLS_WANT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return TLS_WANT_WRITE;
+        default:
+            tls_log_errors("TLS handshake failed");
+            ERR_clear_error();
+            return TLS_ERROR;
+    }
+}
+
+/*! \brief Returns 1 if the kernel took the record layer in both directions
+ *
+ * Then the session is not needed anymore, the socket is used directly. */
+int tls_offloaded(TlsSession* session) {
+#ifdef BIO_get_ktls_send
+    return BIO_get_ktls_send(SSL_get_wbio(session)) &&
+        BIO_get_ktls_recv(SSL_get_rbio(session));
+#else
+    return 0;
+#endif
+}
+
+/*! \brief Convert the result of SSL_read or SSL_write to the recv or send
+ * convention */
+static ssize_t tls_result(TlsSession* session, int ret) {
+    int error = errno;
+
+    if(ret > 0) {
+        return ret;
+    }
+
+    switch(SSL_get_error(session, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            ERR_clear_error();
+            errno = error != 0 ? error : EPIPE;
+            return -1;
+        default:
+            tls_log_errors("TLS error");
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+/*! \brief Decrypt data from the session, like recv */
+ssize_t tls_recv(TlsSession* session, void* buffer, size_t len) {
+    errno = 0;
+    return tls_result(session, SSL_read(session, buffer, len));
+}
+
+/*! \brief Encrypt data to the session, like send */
+ssize_t tls_send(TlsSession* session, const void* buffer, size_t len) {
+    errno = 0;
+    return tls_result(session, SSL_write(session, buffer, len));
+}
@@ -0,0 +1,64 @@
+/*
+ *   Copyright (c) 2007-2008 C3SL.
+ *
+ *   This file is part of Bosh.
+ *
+ *   Bosh is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   any later version.
+ *
+ *   Bosh is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ */
+
+
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+
+/* The TLS layer of the server sockets. When the kernel supports it, the
+ * record layer is moved to the socket (kTLS) after the handshake, so the
+ * socket is read and written with plain recv and send. Otherwise the
+ * records go through OpenSSL in user space. */
+
+struct TlsContext;
+typedef struct TlsContext TlsContext;
+
+/* an OpenSSL SSL object */
+struct ssl_st;
+typedef struct ssl_st TlsSession;
+
+enum TLS_STATUS {
+    TLS_DONE,
+    TLS_WANT_READ,
+    TLS_WANT_WRITE,
+    TLS_ERROR
+};
+
+TlsContext* tls_new(const char* certificate, const char* key);
+
+void tls_delete(TlsContext* context);
+
+int tls_kernel_available();
+
+int tls_restrict_offload(TlsContext* context);
+
+TlsSession* tls_session_new(TlsContext* context, int fd);
+
+void tls_session_delete(TlsSession* session);
+
+int tls_handshake(TlsSession* session);
+
+int tls_offloaded(TlsSession* session);
+
+ssize_t tls_recv(TlsSession* session, void* buffer, size_t len);
+
+ssize_t tls_send(TlsSession* session, const void* buffer, size_t len);
+
+#endif
@@ -0,0 +1,277 @@
+/*
+ *   Copyright (c) 2007-2008 C3SL.
+ *
+ *   This file is part of Bosh.
+ *
+ *   Bosh is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   any later version.
+ *
+ *   Bosh is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ */
+
+/* Multi-process mode.
+ *
+ * The master forks the workers and only supervises them. Every worker
+ * listens on the http port with SO_REUSEPORT and owns the sessions it
+ * creates. Each worker has a seqpacket channel, any worker can send messages
+ * to it on the other end. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "workers.h"
+
+/* seconds before a crashed worker is forked again */
+#define RESTART_DELAY 1
+
+/* the master gives up when the workers crash more often than this */
+#define MAX_CRASHES 5
+#define CRASH_PERIOD 60
+
+typedef struct Worker {
+    pid_t pid;
+    int inbox;                  /* end read by the worker                 */
+    int channel;                /* end written by the other workers       */
+    int ready;                  /* written by the worker once it started,
+                                   read by the master                     */
+} Worker;
+
+static Worker* workers = NULL;
+static int worker_count = 1;
+static int worker_index = 0;
+
+static volatile int stopping = 0;
+
+/*! \brief Forward the exit signals to the workers */
+static void workers_handle_signal(int signal) {
+    int i;
+
+    stopping = 1;
+    for(i = 0; i < worker_count; ++i) {
+        if(workers[i].pid > 0) {
+            kill(workers[i].pid, signal);
+        }
+    }
+}
+
+/*! \brief Fork a worker, returns 1 in the worker and 0 in the master */
+static int workers_fork(int i) {
+    pid_t pid;
+    int fds[2];
+    int j;
+
+    if(pipe(fds) == -1) {
+        fprintf(stderr, "Unable to create worker pipe: %s\n", strerror(errno));
+        return 0;
+    }
+
+    pid = fork();
+    if(pid == -1) {
+        fprintf(stderr, "Unable to fork worker %d: %s\n", i, strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+
+    if(pid == 0) {
+        /* keep only our inbox and the channels to the others */
+        worker_index = i;
+        for(j = 0; j < worker_count; ++j) {
+            if(j != i) {
+                close(workers[j].inbox);
+            }
+            if(workers[j].ready != -1) {
+                close(workers[j].ready);
+                workers[j].ready = -1;
+            }
+        }
+        close(fds[0]);
+        workers[i].ready = fds[1];
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        return 1;
+    }
+
+    close(fds[1]);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    workers[i].ready = fds[0];
+    workers[i].pid = pid;
+
+    return 0;
+}
+
+/*! \brief Returns 1 if the dead worker had finished starting */
+static int workers_started(int i) {
+    char byte;
+    int ret;
+
+    ret = read(workers[i].ready, &byte, 1);
+    close(workers[i].ready);
+    workers[i].ready = -1;
+
+    return ret == 1;
+}
+
+/*! \brief Stop the workers after a failure */
+static void workers_abort() {
+    int i;
+
+    stopping = 1;
+    for(i = 0; i < worker_count; ++i) {
+        if(workers[i].pid > 0) {
+            kill(workers[i].pid, SIGTERM);
+        }
+    }
+}
+
+/*! \brief Fork the worker processes */
+int workers_start(int count) {
+    int fds[2];
+    int i, status, running, crashes, failed;
+    time_t period;
+    pid_t pid;
+
+    if(count <= 1) {
+        return 1;
+    }
+
+    worker_count = count;
+    workers = calloc(worker_count, sizeof(Worker));
+
+    /* create the channels */
+    for(i = 0; i < worker_count; ++i) {
+        if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == -1) {
+            fprintf(stderr, "Unable to create worker channel: %s\n",
+                    strerror(errno));
+            exit(1);
+        }
+        workers[i].inbox = fds[0];
+        workers[i].channel = fds[1];
+        workers[i].ready = -1;
+    }
+
+    signal(SIGINT, workers_handle_signal);
+    signal(SIGTERM, workers_handle_signal);
+
+    /* the upgrade hands off a single process */
+    signal(SIGUSR2, SIG_IGN);
+
+    /* start the workers */
+    for(i = 0; i < worker_count; ++i) {
+        if(workers_fork(i)) {
+            return 1;
+        }
+    }
+
+    /* wait for the workers, restarting the ones that crash after starting */
+    running = worker_count;
+    crashes = 0;
+    failed = 0;
+    period = time(NULL);
+    while(running > 0) {
+        pid = wait(&status);
+        if(pid == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        for(i = 0; i < worker_count && workers[i].pid != pid; ++i);
+        if(i == worker_count) {
+            continue;
+        }
+        workers[i].pid = 0;
+
+        if(!workers_started(i) && !stopping &&
+                !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+            /* a bad configuration would fail again */
+            fprintf(stderr, "Worker %d failed to start\n", i);
+            failed = 1;
+            workers_abort();
+        }
+
+        if(!stopping && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+            if(time(NULL) - period > CRASH_PERIOD) {
+                period = time(NULL);
+                crashes = 0;
+            }
+            if(++crashes > MAX_CRASHES) {
+                fprintf(stderr, "Workers crashed %d times in %d seconds, "
+                        "giving up\n", crashes, CRASH_PERIOD);
+                failed = 1;
+                workers_abort();
+            } else {
+                fprintf(stderr, "Worker %d died, restarting\n", i);
+                sleep(RESTART_DELAY);
+            }
+        }
+
+        /* the delay may have been interrupted by a stop */
+        if(!stopping && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+            if(workers_fork(i)) {
+                return 1;
+            }
+            if(workers[i].pid > 0) {
+                continue;
+            }
+        }
+        running--;
+    }
+
+    free(workers);
+    workers = NULL;
+
+    return failed ? -1 : 0;
+}
+
+/*! \brief Tell the master that this worker started */
+void workers_ready() {
+    char byte = 1;
+
+    if(workers == NULL || workers[worker_index].ready == -1) {
+        return;
+    }
+
+    if(write(workers[worker_index].ready, &byte, 1) != 1) {
+        fprintf(stderr, "Unable to notify the master: %s\n", strerror(errno));
+    }
+    close(workers[worker_index].ready);
+    workers[worker_index].ready = -1;
+}
+
+/*! \brief Returns the number of workers */
+int workers_count() {
+    return worker_count;
+}
+
+/*! \brief Returns the index of this worker */
+int workers_index() {
+    return worker_index;
+}
+
+/*! \brief Returns the channel to send messages to the given worker */
+int workers_channel(int i) {
+    return workers[i].channel;
+}
+
+/*! \brief Returns the channel where this worker receives messages */
+int workers_inbox() {
+    return workers[worker_index].inbox;
+}
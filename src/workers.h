@@ -0,0 +1,46 @@
+/*
+ *   Copyright (c) 2007-2008 C3SL.
+ *
+ *   This file is part of Bosh.
+ *
+ *   Bosh is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   any later version.
+ *
+ *   Bosh is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ */
+
+#ifndef WORKERS_H
+#define WORKERS_H
+
+/*! \brief Fork the worker processes
+ *
+ * Returns 1 in the workers, which should run the server. The master process
+ * waits for the workers, restarting the ones that crash, and returns 0 when
+ * all of them exit. It stops them all and returns -1 if a worker fails
+ * before calling workers_ready, or if they crash too often. With a single
+ * worker, nothing is forked and 1 is returned. */
+int workers_start(int count);
+
+/*! \brief Tell the master that this worker started */
+void workers_ready();
+
+/*! \brief Returns the number of workers */
+int workers_count();
+
+/*! \brief Returns the index of this worker */
+int workers_index();
+
+/*! \brief Returns the channel to send messages to the given worker */
+int workers_channel(int index);
+
+/*! \brief Returns the channel where this worker receives messages */
+int workers_inbox();
+
+#endif